@@ -25,6 +25,7 @@
 #include <string.h>
 #include <math.h>
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "freertos/semphr.h"
 #include "esp_bt.h"
@@ -34,17 +35,54 @@
 #include "esp_gatt_common_api.h"
 #include "conf.h"
 #include "bt.h"
+#include "fwd.h"
+#include "stats.h"
 
 static const char* TAG = "BT";
 SemaphoreHandle_t bt_mutex = NULL;
 #define BT_MUTEX_WAIT	(1000 / portTICK_PERIOD_MS)
+#ifndef BT_ADV_WINDOW_S			// shortened by the simulator
+#define BT_ADV_WINDOW_S	60
+#endif
+#define BT_ADV_WINDOW	(BT_ADV_WINDOW_S * 1000 / portTICK_PERIOD_MS)
+#define BT_RSSI_WEIGHT	8	// EWMA: new sample gets 1/BT_RSSI_WEIGHT
+
+static struct bt_stats bt_stats;
 
 struct result {
 	float h;
 	float t;
+	float rssi;				// exponentially weighted RSSI
+	TickType_t adv_win;		// start of the current counting window
+	uint16_t adv_cnt;		// advertisements in the current window
+	uint16_t adv_rate;		// advertisements in the last full window
+	uint8_t frm_seq;		// last MiBeacon frame counter
+	uint8_t frm_first;		// frame counter at the start of the window
+	uint16_t frm_cnt;		// distinct frames in the current window
+	int16_t frm_rx;			// frames received of those sent, last full window, per mille
 };
 struct result bt_results[CONF_MAX_IFX_CLIENTS];
 
+/* Sensors whose reading changed since the last bt_results_take_dirty() */
+static uint32_t bt_dirty[BT_DIRTY_WORDS];
+/* Bumped whenever any stored reading changes */
+static uint32_t bt_gen;
+
+struct bt_scan_entry {
+	uint64_t addr;			// 0 if unused
+	float t;
+	float h;
+	int8_t rssi;
+	TickType_t last_seen;
+};
+static struct bt_scan_entry bt_scan[BT_SCAN_SIZE];
+
+/* Scanning state, for the low power bursts and the duty cycle */
+static int bt_low_power;
+static int bt_scanning;
+static TickType_t bt_scan_since;
+static uint32_t bt_scan_ms;		// radio time spent scanning, wraps
+
 static esp_ble_scan_params_t ble_scan_params = {
     .scan_type              = BLE_SCAN_TYPE_PASSIVE,
     .own_addr_type          = BLE_ADDR_TYPE_PUBLIC,
@@ -65,85 +103,365 @@ static uint64_t bdaddr_to_uint64(esp_bd_addr_t adr) {
 	return ret;
 }
 
-static int bt_find_dev(esp_bd_addr_t adr) {
+static int bt_find_dev(const struct conf *c, esp_bd_addr_t adr) {
 	uint64_t adr64 = bdaddr_to_uint64(adr);
 	int i;
 	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
-		const struct conf_influx_client *cli = &conf.influx.clients[i];
+		const struct conf_influx_client *cli = &c->clients[i];
 		if (cli->addr == 0 || cli->name[0] == '\0') continue;
 		if (cli->addr == adr64) return i;
 	}
 	return -1;
 }
 
+static int bt_lock() {
+	uint32_t begin = stats_begin();
+	int ok = xSemaphoreTake(bt_mutex, BT_MUTEX_WAIT);
+	stats_end(STATS_BT_LOCK, begin);
+	if (ok) return 1;
+	__atomic_fetch_add(&bt_stats.mutex_timeouts, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Radio on-time of a scan that ran for the given ticks */
+static uint32_t bt_scan_radio_ms(TickType_t ticks) {
+	return (uint64_t) ticks * portTICK_PERIOD_MS *
+			ble_scan_params.scan_window / ble_scan_params.scan_interval;
+}
+
+void bt_stats_get(struct bt_stats *s) {
+	*s = bt_stats;
+	if (!bt_lock()) return;
+	s->scan_ms = bt_scan_ms;
+	if (bt_scanning) s->scan_ms += bt_scan_radio_ms(xTaskGetTickCount() - bt_scan_since);
+	xSemaphoreGive(bt_mutex);
+}
+
+/* Called from the BT task whenever scanning starts or ends */
+static void bt_scan_mark(int on) {
+	if (!bt_lock()) return;
+	TickType_t now = xTaskGetTickCount();
+	if (bt_scanning) bt_scan_ms += bt_scan_radio_ms(now - bt_scan_since);
+	bt_scanning = on;
+	bt_scan_since = now;
+	xSemaphoreGive(bt_mutex);
+}
+
+/*
+ * In low power mode the scanner is off except for bursts started by
+ * bt_scan_burst(); otherwise it scans permanently.
+ */
+void bt_set_low_power(int on) {
+	if (on == bt_low_power) return;
+	bt_low_power = on;
+	ESP_LOGI(TAG, "Low power %s", on ? "on" : "off");
+	if (on) esp_ble_gap_stop_scanning();
+	else esp_ble_gap_start_scanning(0);	// 0=permanent
+}
+
+void bt_scan_burst(uint32_t duration_s) {
+	if (!bt_low_power || duration_s == 0) return;
+	esp_ble_gap_start_scanning(duration_s);
+}
+
+static void bt_result_reset(int i) {
+	bt_results[i].t = NAN;
+	bt_results[i].h = NAN;
+	bt_results[i].rssi = NAN;
+	bt_results[i].adv_win = xTaskGetTickCount();
+	bt_results[i].adv_cnt = 0;
+	bt_results[i].adv_rate = 0;
+	bt_results[i].frm_cnt = 0;
+	bt_results[i].frm_rx = -1;
+}
+
 void bt_results_clear() {
-	if (!xSemaphoreTake(bt_mutex, BT_MUTEX_WAIT)) return;
+	if (!bt_lock()) return;
 	int i;
 	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
-		bt_results[i].t = NAN;
-		bt_results[i].h = NAN;
+		bt_result_reset(i);
 	}
+	bt_gen++;
+	xSemaphoreGive(bt_mutex);
+}
+void bt_result_clear(int i) {
+	if (!bt_lock()) return;
+	bt_result_reset(i);
+	bt_gen++;
 	xSemaphoreGive(bt_mutex);
 }
 float bt_result_get_t(int i) {
-	if (!xSemaphoreTake(bt_mutex, BT_MUTEX_WAIT)) return NAN;
+	if (!bt_lock()) return NAN;
 	float ret = bt_results[i].t;
 	xSemaphoreGive(bt_mutex);
 	return ret;
 }
 float bt_result_get_clear_t(int i) {
-	if (!xSemaphoreTake(bt_mutex, BT_MUTEX_WAIT)) return NAN;
+	if (!bt_lock()) return NAN;
 	float ret = bt_results[i].t;
+	if (!isnan(ret)) bt_gen++;
 	bt_results[i].t = NAN;
 	xSemaphoreGive(bt_mutex);
 	return ret;
 }
 float bt_result_get_h(int i) {
-	if (!xSemaphoreTake(bt_mutex, BT_MUTEX_WAIT)) return NAN;
+	if (!bt_lock()) return NAN;
 	float ret = bt_results[i].h;
 	xSemaphoreGive(bt_mutex);
 	return ret;
 }
 float bt_result_get_clear_h(int i) {
-	if (!xSemaphoreTake(bt_mutex, BT_MUTEX_WAIT)) return NAN;
+	if (!bt_lock()) return NAN;
 	float ret = bt_results[i].h;
+	if (!isnan(ret)) bt_gen++;
 	bt_results[i].h = NAN;
 	xSemaphoreGive(bt_mutex);
 	return ret;
 }
+static void bt_result_mark_dirty(int i) {
+	__atomic_fetch_or(&bt_dirty[i/32], 1u << (i%32), __ATOMIC_RELAXED);
+	bt_gen++;
+}
+uint32_t bt_results_generation() {
+	return __atomic_load_n(&bt_gen, __ATOMIC_RELAXED);
+}
+void bt_results_take_dirty(uint32_t dirty[BT_DIRTY_WORDS]) {
+	int i;
+	for (i=0; i<BT_DIRTY_WORDS; i++)
+		dirty[i] = __atomic_exchange_n(&bt_dirty[i], 0, __ATOMIC_RELAXED);
+}
 void bt_result_set_t(int i, float t) {
-	if (!xSemaphoreTake(bt_mutex, BT_MUTEX_WAIT)) return;
+	if (!bt_lock()) return;
+	if (bt_results[i].t != t) bt_result_mark_dirty(i);
 	bt_results[i].t = t;
 	xSemaphoreGive(bt_mutex);
 }
 void bt_result_set_h(int i, float h) {
-	if (!xSemaphoreTake(bt_mutex, BT_MUTEX_WAIT)) return;
+	if (!bt_lock()) return;
+	if (bt_results[i].h != h) bt_result_mark_dirty(i);
 	bt_results[i].h = h;
 	xSemaphoreGive(bt_mutex);
 }
+float bt_result_get_rssi(int i) {
+	if (!bt_lock()) return NAN;
+	float ret = bt_results[i].rssi;
+	xSemaphoreGive(bt_mutex);
+	return ret;
+}
+int bt_result_get_adv_rate(int i) {
+	if (!bt_lock()) return 0;
+	const struct result *r = &bt_results[i];
+	TickType_t age = xTaskGetTickCount() - r->adv_win;
+	int ret = r->adv_rate;
+	if (age >= 2*BT_ADV_WINDOW) ret = 0;
+	else if (age >= BT_ADV_WINDOW) ret = r->adv_cnt;
+	xSemaphoreGive(bt_mutex);
+	return ret;
+}
+/* Share of the frames sent in the current window that were received, per mille */
+static int bt_frm_rx(const struct result *r) {
+	if (r->frm_cnt == 0) return -1;
+	int sent = (uint8_t)(r->frm_seq - r->frm_first) + 1;
+	return r->frm_cnt >= sent ? 1000 : r->frm_cnt * 1000 / sent;
+}
+int bt_result_get_reception(int i) {
+	if (!bt_lock()) return -1;
+	const struct result *r = &bt_results[i];
+	TickType_t age = xTaskGetTickCount() - r->adv_win;
+	int ret = r->frm_rx;
+	if (age >= 2*BT_ADV_WINDOW) ret = -1;
+	else if (age >= BT_ADV_WINDOW) ret = bt_frm_rx(r);
+	xSemaphoreGive(bt_mutex);
+	return ret;
+}
+static void bt_result_adv(int i, int rssi, uint8_t seq) {
+	if (!bt_lock()) return;
+	struct result *r = &bt_results[i];
 
+	if (isnan(r->rssi)) r->rssi = rssi;
+	else r->rssi += (rssi - r->rssi) / BT_RSSI_WEIGHT;
 
+	TickType_t now = xTaskGetTickCount();
+	TickType_t age = now - r->adv_win;
+	if (age >= BT_ADV_WINDOW) {
+		r->adv_rate = (age >= 2*BT_ADV_WINDOW) ? 0 : r->adv_cnt;
+		r->frm_rx = (age >= 2*BT_ADV_WINDOW) ? -1 : bt_frm_rx(r);
+		r->adv_cnt = 0;
+		r->frm_cnt = 0;
+		r->adv_win = now;
+	}
+	if (r->adv_cnt < UINT16_MAX) r->adv_cnt++;
+
+	/* Sensors repeat each frame several times; gaps in the counter are losses */
+	if (r->frm_cnt == 0) {
+		r->frm_first = seq;
+		r->frm_cnt = 1;
+	} else if (seq != r->frm_seq && r->frm_cnt < UINT16_MAX) {
+		r->frm_cnt++;
+	}
+	r->frm_seq = seq;
+	xSemaphoreGive(bt_mutex);
+}
+
+
+
+#define BT_DEC_T	0x01
+#define BT_DEC_H	0x02
+
+/* Decodes a sensor object, returns BT_DEC_* flags of the values found */
+static int bt_decode(const uint8_t *srv_data, float *t, float *h) {
+	if (srv_data[0] == 0x04 && srv_data[2]==0x02) { // temp
+		int16_t v = (srv_data[4]<<8) | srv_data[3];
+		ESP_LOGV(TAG, "T %d", v);
+		*t = v / 10.0f;
+		return BT_DEC_T;
+	}
+	if (srv_data[0] == 0x06 && srv_data[2]==0x02) { // hum
+		uint16_t v = (srv_data[4]<<8) | srv_data[3];
+		ESP_LOGV(TAG, "H %d", v);
+		*h = v / 10.0f;
+		return BT_DEC_H;
+	}
+	if (srv_data[0] == 0x0D && srv_data[2]==0x04) { // temp+hum
+		int16_t vt = (srv_data[4]<<8) | srv_data[3];
+		ESP_LOGV(TAG, "T %d", vt);
+		*t = vt / 10.0f;
+		uint16_t vh = (srv_data[6]<<8) | srv_data[5];
+		ESP_LOGV(TAG, "H %d", vh);
+		*h = vh / 10.0f;
+		return BT_DEC_T | BT_DEC_H;
+	}
+	return 0;
+}
+
+/* Advertisement of a configured sensor, srv_data points to the object */
+static void bt_dev_adv(int dev, const uint8_t *srv_data, int rssi, uint8_t seq) {
+	ESP_LOGV(TAG, "DEV %d", dev);
+	bt_stats.adv_matched++;
+	bt_result_adv(dev, rssi, seq);
+
+	float t, h;
+	int dec = bt_decode(srv_data, &t, &h);
+	if (dec & BT_DEC_T) bt_result_set_t(dev, t);
+	if (dec & BT_DEC_H) bt_result_set_h(dev, h);
+	if (dec) bt_stats.adv_decoded++;
+}
+
+/*
+ * Reading of an unconfigured sensor: remembered in a small table that
+ * evicts the least recently seen device, so memory stays bounded however
+ * many sensors are in range.
+ */
+static void bt_scan_store(uint64_t addr, int dec, float t, float h, int rssi) {
+	if (!bt_lock()) return;
+	TickType_t now = xTaskGetTickCount();
+	struct bt_scan_entry *e = NULL;
+	int i;
+	for (i=0; i<BT_SCAN_SIZE; i++) {
+		struct bt_scan_entry *it = &bt_scan[i];
+		if (it->addr == addr) {
+			e = it;
+			break;
+		}
+		if (e == NULL || it->addr == 0 ||
+				(e->addr != 0 && now - it->last_seen > now - e->last_seen))
+			e = it;
+	}
+	if (e->addr != addr) {
+		e->addr = addr;
+		e->t = NAN;
+		e->h = NAN;
+	}
+	if (dec & BT_DEC_T) e->t = t;
+	if (dec & BT_DEC_H) e->h = h;
+	e->rssi = rssi;
+	e->last_seen = now;
+	xSemaphoreGive(bt_mutex);
+}
+
+static void bt_scan_adv(uint64_t addr, const uint8_t *srv_data, int rssi) {
+	float t, h;
+	int dec = bt_decode(srv_data, &t, &h);
+	if (dec) bt_scan_store(addr, dec, t, h, rssi);
+}
+
+/* Reading relayed by an edge proxy, handled like an advertisement heard here */
+void bt_relay_reading(uint64_t addr, float t, float h, int rssi) {
+	int dec = (isnan(t) ? 0 : BT_DEC_T) | (isnan(h) ? 0 : BT_DEC_H);
+	if (!dec) return;
+
+	const struct conf *c = conf_get();
+	int i;
+	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
+		const struct conf_influx_client *cli = &c->clients[i];
+		if (cli->addr == addr && cli->name[0] != '\0') break;
+	}
+	if (i == CONF_MAX_IFX_CLIENTS) {
+		bt_scan_store(addr, dec, t, h, rssi);
+	} else {
+		if (dec & BT_DEC_T) bt_result_set_t(i, t);
+		if (dec & BT_DEC_H) bt_result_set_h(i, h);
+	}
+	conf_put(c);
+}
+
+/* Copies the discovered devices not configured in c, newest first */
+int bt_scan_get(const struct conf *c, struct bt_scan_result *res, int max) {
+	if (!bt_lock()) return 0;
+	TickType_t now = xTaskGetTickCount();
+	int i, j, n = 0;
+	for (i=0; i<BT_SCAN_SIZE; i++) {
+		const struct bt_scan_entry *e = &bt_scan[i];
+		if (e->addr == 0) continue;
+		for (j=0; j<CONF_MAX_IFX_CLIENTS; j++) {
+			if (c->clients[j].addr == e->addr) break;
+		}
+		if (j < CONF_MAX_IFX_CLIENTS) continue;
+
+		uint32_t age = (now - e->last_seen) / configTICK_RATE_HZ;
+		for (j=n; j>0 && res[j-1].age_s > age; j--) {
+			if (j < max) res[j] = res[j-1];
+		}
+		if (j >= max) continue;
+		res[j].addr = e->addr;
+		res[j].t = e->t;
+		res[j].h = e->h;
+		res[j].rssi = e->rssi;
+		res[j].age_s = age;
+		if (n < max) n++;
+	}
+	xSemaphoreGive(bt_mutex);
+	return n;
+}
 
 void gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
+	uint32_t begin = stats_begin();
 	ESP_LOGV(TAG, "gap CB %d", (int) event);
 
 	switch (event) {
     case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT:
-	    esp_ble_gap_start_scanning(0);	// 0=permanent
+		if (!bt_low_power) esp_ble_gap_start_scanning(0);	// 0=permanent
 		break;
 	case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:
 		ESP_LOGV(TAG, "scan started");
+		if (param->scan_start_cmpl.status == ESP_BT_STATUS_SUCCESS) bt_scan_mark(1);
+		break;
+	case ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT:
+		ESP_LOGV(TAG, "scan stopped");
+		bt_scan_mark(0);
 		break;
 	case ESP_GAP_BLE_SCAN_RESULT_EVT: {
 		ESP_LOGV(TAG, "gap rst %d", (int) param->scan_rst.search_evt);
 		switch (param->scan_rst.search_evt) {
 		case ESP_GAP_SEARCH_INQ_RES_EVT: {
 			ESP_LOG_BUFFER_HEX_LEVEL(TAG, param->scan_rst.bda, 6, ESP_LOG_DEBUG);
+			bt_stats.adv_seen++;
 
 			uint8_t srv_data_len = 0;
 			uint8_t *srv_data = esp_ble_resolve_adv_data(param->scan_rst.ble_adv,
 					ESP_BLE_AD_TYPE_SERVICE_DATA, &srv_data_len);
 			ESP_LOG_BUFFER_HEX_LEVEL(TAG, srv_data, srv_data_len, ESP_LOG_DEBUG);
+			fwd_adv(param->scan_rst.bda, param->scan_rst.rssi, srv_data, srv_data_len);
 
 			if (srv_data_len < 6) break;
 			if (srv_data[0] != 0x95 || srv_data[1] != 0xFE) break;
@@ -151,36 +469,24 @@ void gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
 			uint8_t ofs = 13;
 			if (hdr & 0x20) ofs = 14;
 			if (srv_data_len < ofs+3) break;
+			uint8_t seq = srv_data[6];		// frame counter
 			srv_data += ofs;
 			srv_data_len -= ofs;
 
 			if (srv_data[1] != 0x10) break;
 			if (srv_data_len-3 != srv_data[2]) break;
 
-			int dev = bt_find_dev(param->scan_rst.bda);
-			if (dev < 0) break;
-			ESP_LOGV(TAG, "DEV %s", conf.influx.clients[dev].name);
-
-			if (srv_data[0] == 0x04 && srv_data[2]==0x02) { // temp
-				int16_t t = (srv_data[4]<<8) | srv_data[3];
-				ESP_LOGV(TAG, "T %d", t);
-				bt_result_set_t(dev, t / 10.0f);
-			}
-			if (srv_data[0] == 0x06 && srv_data[2]==0x02) { // hum
-				uint16_t h = (srv_data[4]<<8) | srv_data[3];
-				ESP_LOGV(TAG, "H %d", h);
-				bt_result_set_h(dev, h / 10.0f);
-			}
-			if (srv_data[0] == 0x0D && srv_data[2]==0x04) { // temp+hum
-				int16_t t = (srv_data[4]<<8) | srv_data[3];
-				ESP_LOGV(TAG, "T %d", t);
-				bt_result_set_t(dev, t / 10.0f);
-				uint16_t h = (srv_data[6]<<8) | srv_data[5];
-				ESP_LOGV(TAG, "H %d", h);
-				bt_result_set_h(dev, h / 10.0f);
-			}
+			/* Pinned until the result is stored, see conf_commit() */
+			const struct conf *c = conf_get();
+			int dev = bt_find_dev(c, param->scan_rst.bda);
+			if (dev >= 0) bt_dev_adv(dev, srv_data, param->scan_rst.rssi, seq);
+			else bt_scan_adv(bdaddr_to_uint64(param->scan_rst.bda), srv_data, param->scan_rst.rssi);
+			conf_put(c);
 			break;
 		}
+		case ESP_GAP_SEARCH_INQ_CMPL_EVT:		// burst duration elapsed
+			bt_scan_mark(0);
+			break;
 		default:
 			break;
 		}
@@ -190,6 +496,7 @@ void gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
 	default:
 		break;
 	}
+	if (event == ESP_GAP_BLE_SCAN_RESULT_EVT) stats_end(STATS_GAP_CB, begin);
 }
 
 void bt_init() {
@@ -198,6 +505,7 @@ void bt_init() {
 	//esp_log_level_set(TAG, ESP_LOG_VERBOSE);
 	bt_results_clear();
 
+#if !CONFIG_HYG_SOAK	/* QEMU has no controller, soak.c calls gap_cb() instead */
     ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
 	esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
 	ESP_ERROR_CHECK(esp_bt_controller_init(&bt_cfg));
@@ -212,6 +520,7 @@ void bt_init() {
 	ESP_ERROR_CHECK(esp_ble_gap_register_callback(gap_cb));
 
     ESP_ERROR_CHECK(esp_ble_gap_set_scan_params(&ble_scan_params));
+#endif
 }
 
 
@@ -20,14 +20,48 @@
 #define MAIN_BT_H_
 
 #include "esp_bt_defs.h"
+#include "conf.h"
+
+#define BT_DIRTY_WORDS	((CONF_MAX_IFX_CLIENTS + 31) / 32)
+#define BT_SCAN_SIZE	16		// discovered, unconfigured devices kept
+
+struct bt_scan_result {
+	uint64_t addr;
+	float t;
+	float h;
+	int rssi;
+	uint32_t age_s;			// seconds since last advertisement
+};
+
+/* Cumulative counters of the scan path, read by the self-telemetry */
+struct bt_stats {
+	uint32_t adv_seen;			// all advertisements received
+	uint32_t adv_matched;		// advertisements from configured sensors
+	uint32_t adv_decoded;		// measurements decoded from those
+	uint32_t mutex_timeouts;	// result accesses dropped on BT_MUTEX_WAIT
+	uint32_t scan_ms;			// radio time spent scanning, wraps
+};
 
 void bt_init();
+void bt_stats_get(struct bt_stats *s);
+void bt_set_low_power(int on);
+void bt_scan_burst(uint32_t duration_s);
 
 void bt_results_clear();
+void bt_result_clear(int i);
 float bt_result_get_clear_t(int i);
 float bt_result_get_clear_h(int i);
 
 float bt_result_get_t(int i);
 float bt_result_get_h(int i);
+float bt_result_get_rssi(int i);
+int bt_result_get_adv_rate(int i);
+int bt_result_get_reception(int i);
+void bt_results_take_dirty(uint32_t dirty[BT_DIRTY_WORDS]);
+uint32_t bt_results_generation();
+
+void bt_relay_reading(uint64_t addr, float t, float h, int rssi);
+
+int bt_scan_get(const struct conf *c, struct bt_scan_result *res, int max);
 
 #endif /* MAIN_BT_H_ */
@@ -19,6 +19,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 //#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
 #include "esp_log.h"
@@ -30,6 +31,11 @@
 #include "driver/uart.h"
 #include "driver/uart_vfs.h"
 #include "wifi.h"
+#include "bt.h"
+#include "conf.h"
+#include "relay.h"
+#include "tasks.h"
+#include "stats.h"
 #include "cli.h"
 
 static int cli_disconnect(int argc, char **argv) {
@@ -85,6 +91,135 @@ void cli_register_connect(void)
 	ESP_ERROR_CHECK( esp_console_cmd_register(&connect_cmd) );
 }
 
+///////////////////////////////////////////////////////////////////////////////
+static int cli_scan(int argc, char **argv) {
+	struct bt_scan_result res[BT_SCAN_SIZE];
+	const struct conf *c = conf_get();
+	int n = bt_scan_get(c, res, BT_SCAN_SIZE);
+	conf_put(c);
+
+	printf("%-12s %6s %6s %5s %5s\n", "Address", "Temp", "Hum", "RSSI", "Age");
+	int i;
+	for (i=0; i<n; i++) {
+		printf("%012llx %6.1f %6.1f %5d %4lus\n", res[i].addr,
+				res[i].t, res[i].h, res[i].rssi, (unsigned long) res[i].age_s);
+	}
+	return 0;
+}
+
+void cli_register_scan(void)
+{
+	const esp_console_cmd_t scan_cmd = {
+		.command = "scan",
+		.help = "List discovered, unconfigured sensors",
+		.hint = NULL,
+		.func = &cli_scan,
+	};
+	ESP_ERROR_CHECK( esp_console_cmd_register(&scan_cmd) );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static int cli_relay(int argc, char **argv) {
+	struct relay_stats st;
+	relay_stats_get(&st);
+
+	switch (relay_mode()) {
+	case RELAY_EDGE:
+		printf("Edge: %lu frames acknowledged, %lu lost, round trip %lu ms\n",
+				(unsigned long) st.frames, (unsigned long) st.lost, (unsigned long) st.rtt_ms);
+		break;
+	case RELAY_GATEWAY: {
+		struct relay_edge_info res[RELAY_EDGES];
+		int n = relay_edges_get(res, RELAY_EDGES);
+		printf("%-12s %8s %6s %6s %6s %5s\n", "Edge", "Frames", "Gaps", "Lost", "RTT", "Age");
+		int i;
+		for (i=0; i<n; i++) {
+			printf("%012llx %8lu %6lu %6lu %4lums %4lus\n", res[i].addr,
+					(unsigned long) res[i].frames, (unsigned long) res[i].gaps,
+					(unsigned long) res[i].edge_lost, (unsigned long) res[i].rtt_ms,
+					(unsigned long) res[i].age_s);
+		}
+		break;
+	}
+	default:
+		printf("Relay off\n");
+		break;
+	}
+	return 0;
+}
+
+void cli_register_relay(void)
+{
+	const esp_console_cmd_t relay_cmd = {
+		.command = "relay",
+		.help = "Show ESP-NOW relay link counters",
+		.hint = NULL,
+		.func = &cli_relay,
+	};
+	ESP_ERROR_CHECK( esp_console_cmd_register(&relay_cmd) );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static int cli_tasks(int argc, char **argv) {
+	printf("%-10s %4s %4s %6s %6s\n", "Task", "Core", "Prio", "Stack", "Free");
+	int id;
+	for (id=0; id<TASK_COUNT; id++) {
+		const struct task_layout *t = &task_layout[id];
+		uint32_t left = task_stack_free(id);
+		if (left == 0) continue;		// not running
+		printf("%-10s %4d %4u %6lu %6lu%s\n", t->name, (int) t->core, (unsigned) t->prio,
+				(unsigned long) t->stack, (unsigned long) left,
+				left < CONFIG_HYG_STACK_MARGIN ? " low" : "");
+	}
+	return 0;
+}
+
+void cli_register_tasks(void)
+{
+	const esp_console_cmd_t tasks_cmd = {
+		.command = "tasks",
+		.help = "List task cores, priorities and free stack",
+		.hint = NULL,
+		.func = &cli_tasks,
+	};
+	ESP_ERROR_CHECK( esp_console_cmd_register(&tasks_cmd) );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static int cli_stats(int argc, char **argv) {
+	if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+		stats_reset();
+		printf("Statistics cleared\n");
+		return 0;
+	}
+	if (argc > 1) {
+		printf("Usage: stats [reset]\n");
+		return 1;
+	}
+
+	printf("%-12s %8s %8s %8s %8s %8s\n", "us", "Count", "p50", "p90", "p99", "Max");
+	int id;
+	for (id=0; id<STATS_COUNT; id++) {
+		struct stats_hist h;
+		stats_get(id, &h);
+		printf("%-12s %8lu %8lu %8lu %8lu %8lu\n", stats_name(id), (unsigned long) h.count,
+				(unsigned long) stats_pct(&h, 50), (unsigned long) stats_pct(&h, 90),
+				(unsigned long) stats_pct(&h, 99), (unsigned long) h.max_us);
+	}
+	return 0;
+}
+
+void cli_register_stats(void)
+{
+	const esp_console_cmd_t stats_cmd = {
+		.command = "stats",
+		.help = "Show hot path latency percentiles, 'stats reset' clears them",
+		.hint = "[reset]",
+		.func = &cli_stats,
+	};
+	ESP_ERROR_CHECK( esp_console_cmd_register(&stats_cmd) );
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 void cli_init()
@@ -126,6 +261,10 @@ void cli_init()
 	esp_console_register_help_command();
 	cli_register_connect();
 	cli_register_disconnect();
+	cli_register_scan();
+	cli_register_relay();
+	cli_register_tasks();
+	cli_register_stats();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
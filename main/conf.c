@@ -19,84 +19,294 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <sys/param.h>
 
 //#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
 #include "esp_log.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_vfs_fat.h"
 #include "esp_system.h"
 #include "nvs_flash.h"
 #include "nvs.h"
+#include "esp_rom_crc.h"
 
 #include "conf.h"
 
-struct conf conf;
+uint32_t conf_version;
 
+#define CONF_BLOB_KEY		"conf"
+#define CONF_BLOB_MAGIC		0x43475948	// "HYGC"
+#define CONF_BLOB_VERSION	1
 
-void conf_init() {
-	nvs_handle_t hnd;
-	esp_err_t err = nvs_open("storage", NVS_READWRITE, &hnd);
-	ESP_ERROR_CHECK( err );
+struct conf_blob_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t settings_len;	// bytes of struct conf before clients
+	uint16_t n_clients;
+	uint16_t reserved;
+	uint32_t crc;			// over everything after the header
+};
+
+/*
+ * Configuration snapshots. conf_cur is only ever replaced with a single
+ * atomic store, readers pin the snapshot they got with a reference count.
+ * A snapshot is recycled once it is neither current nor pinned. Writes are
+ * serialized and conf_commit() waits for the readers of the snapshot it
+ * replaced, so one spare is enough: conf_get() pins it only for an instant
+ * when racing a commit.
+ */
+#define CONF_SNAPSHOTS		2
+
+struct conf_snap {
+	struct conf_blob_hdr hdr;	// stored together with conf as the blob
+	struct conf conf;
+	uint32_t refs;
+};
+
+static struct conf_snap conf_snaps[CONF_SNAPSHOTS];
+static struct conf_snap *conf_cur;
+static int conf_stored;			// NVS holds the current snapshot
+static SemaphoreHandle_t conf_wr_mutex;
+static TaskHandle_t conf_watcher;
 
-	memset(&conf, 0, sizeof(conf));
+#define CONF_SETTINGS_LEN	offsetof(struct conf, clients)
 
+/*
+ * NVS entries of the blob: 32 bytes each, plus a header per chunk of at most
+ * a page and the index. One page of free entries is NVS's spare for
+ * garbage collection.
+ */
+#define CONF_NVS_PAGE_ENTRIES	126
+#define CONF_BLOB_LEN		(sizeof(struct conf_blob_hdr) + sizeof(struct conf))
+#define CONF_BLOB_ENTRIES	((CONF_BLOB_LEN + 31) / 32 + (CONF_BLOB_LEN + 3999) / 4000 + 1)
+
+_Static_assert(sizeof(struct conf) ==
+		CONF_SETTINGS_LEN + CONF_MAX_IFX_CLIENTS * sizeof(struct conf_influx_client),
+		"clients must end struct conf");
+_Static_assert(offsetof(struct conf_snap, conf) == sizeof(struct conf_blob_hdr),
+		"blob must not have padding");
+
+static struct conf_snap *conf_snap_of(const struct conf *c) {
+	return (struct conf_snap *) ((const char *) c - offsetof(struct conf_snap, conf));
+}
+
+
+/* Pre-blob layout: one NVS key per field, at most 8 sensors */
+#define CONF_LEGACY_CLIENTS	8
+
+static void conf_load_legacy(nvs_handle_t hnd, struct conf *c) {
+	esp_err_t err;
 	size_t len;
 	int i;
-	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
+	for (i=0; i<CONF_LEGACY_CLIENTS; i++) {
 		char tmp[32];
 
-		len = sizeof(tmp);
+		len = sizeof(c->clients[i].name);
 		snprintf(tmp, sizeof(tmp), "ifx_%d_name", i);
-		err = nvs_get_str(hnd, tmp, conf.influx.clients[i].name, &len);
+		err = nvs_get_str(hnd, tmp, c->clients[i].name, &len);
 		if (err != ESP_OK) continue;
 
 		snprintf(tmp, sizeof(tmp), "ifx_%d_addr", i);
-		err = nvs_get_u64(hnd, tmp, &conf.influx.clients[i].addr);
+		err = nvs_get_u64(hnd, tmp, &c->clients[i].addr);
 		if (err != ESP_OK) continue;
 	}
 
-	len = sizeof(conf.influx.host);
-	nvs_get_str(hnd, "ifx_host", conf.influx.host, &len);
-	len = sizeof(conf.influx.db);
-	nvs_get_str(hnd, "ifx_db", conf.influx.db, &len);
-	len = sizeof(conf.influx.pfx);
-	nvs_get_str(hnd, "ifx_pfx", conf.influx.pfx, &len);
+	len = sizeof(c->influx.host);
+	nvs_get_str(hnd, "ifx_host", c->influx.host, &len);
+	len = sizeof(c->influx.db);
+	nvs_get_str(hnd, "ifx_db", c->influx.db, &len);
+	len = sizeof(c->influx.pfx);
+	nvs_get_str(hnd, "ifx_pfx", c->influx.pfx, &len);
+
+	nvs_get_u16(hnd, "ifx_intrvl", &c->influx.interval_s);
+}
+
+static void conf_erase_legacy(nvs_handle_t hnd) {
+	int i;
+	for (i=0; i<CONF_LEGACY_CLIENTS; i++) {
+		char tmp[32];
+		snprintf(tmp, sizeof(tmp), "ifx_%d_name", i);
+		nvs_erase_key(hnd, tmp);
+		snprintf(tmp, sizeof(tmp), "ifx_%d_addr", i);
+		nvs_erase_key(hnd, tmp);
+	}
+	nvs_erase_key(hnd, "ifx_host");
+	nvs_erase_key(hnd, "ifx_db");
+	nvs_erase_key(hnd, "ifx_pfx");
+	nvs_erase_key(hnd, "ifx_intrvl");
+}
+
+static esp_err_t conf_load_blob(nvs_handle_t hnd, struct conf *c) {
+	size_t len = 0;
+	esp_err_t err = nvs_get_blob(hnd, CONF_BLOB_KEY, NULL, &len);
+	if (err != ESP_OK) return err;
+	if (len < sizeof(struct conf_blob_hdr)) return ESP_ERR_INVALID_SIZE;
+
+	uint8_t *buf = malloc(len);
+	if (buf == NULL) return ESP_ERR_NO_MEM;
+	err = nvs_get_blob(hnd, CONF_BLOB_KEY, buf, &len);
+	if (err != ESP_OK) goto out;
+
+	struct conf_blob_hdr hdr;
+	memcpy(&hdr, buf, sizeof(hdr));
+	const uint8_t *data = buf + sizeof(hdr);
+	size_t data_len = len - sizeof(hdr);
+
+	err = ESP_ERR_INVALID_SIZE;
+	if (hdr.magic != CONF_BLOB_MAGIC || hdr.version != CONF_BLOB_VERSION) goto out;
+	if (data_len != hdr.settings_len + hdr.n_clients * sizeof(struct conf_influx_client)) goto out;
+	err = ESP_ERR_INVALID_CRC;
+	if (esp_rom_crc32_le(0, data, data_len) != hdr.crc) goto out;
+
+	/* Settings missing from an older blob stay zero */
+	memcpy(c, data, MIN(hdr.settings_len, CONF_SETTINGS_LEN));
+	data += hdr.settings_len;
+
+	int n = hdr.n_clients;
+	if (n > CONF_MAX_IFX_CLIENTS) {
+		ESP_LOGW("CONF", "Dropping %d sensors over the limit", n - CONF_MAX_IFX_CLIENTS);
+		n = CONF_MAX_IFX_CLIENTS;
+	}
+	memcpy(c->clients, data, n * sizeof(struct conf_influx_client));
+	err = ESP_OK;
+
+out:
+	free(buf);
+	return err;
+}
+
+/* The header goes right before the snapshot, so the blob is written in place */
+static void conf_write_blob(nvs_handle_t hnd, struct conf_snap *s) {
+	s->hdr.magic = CONF_BLOB_MAGIC;
+	s->hdr.version = CONF_BLOB_VERSION;
+	s->hdr.settings_len = CONF_SETTINGS_LEN;
+	s->hdr.n_clients = CONF_MAX_IFX_CLIENTS;
+	s->hdr.reserved = 0;
+	s->hdr.crc = esp_rom_crc32_le(0, (const uint8_t *) &s->conf, sizeof(s->conf));
+
+	esp_err_t err = nvs_set_blob(hnd, CONF_BLOB_KEY, &s->hdr, sizeof(s->hdr) + sizeof(s->conf));
+	if (err != ESP_OK) {
+		ESP_LOGE("CONF", "Storing configuration failed: %s", esp_err_to_name(err));
+	}
+	conf_stored = err == ESP_OK;
+}
+
+/* Writes the configuration blob unless it is the stored one, unchanged */
+static void conf_store(struct conf_snap *s, const struct conf_snap *old) {
+	if (conf_stored && memcmp(&old->conf, &s->conf, sizeof(s->conf)) == 0) return;
 
-	nvs_get_u16(hnd, "ifx_intrvl", &conf.influx.interval_s);
+	nvs_handle_t hnd;
+	esp_err_t err = nvs_open("storage", NVS_READWRITE, &hnd);
+	ESP_ERROR_CHECK( err );
 
+	conf_write_blob(hnd, s);
+
+	nvs_commit(hnd);
 	nvs_close(hnd);
 }
 
-void conf_store() {
+void conf_init() {
 	nvs_handle_t hnd;
 	esp_err_t err = nvs_open("storage", NVS_READWRITE, &hnd);
 	ESP_ERROR_CHECK( err );
 
-	int i;
-	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
-		char tmp[32];
+	conf_wr_mutex = xSemaphoreCreateMutex();
+	struct conf *c = &conf_snaps[0].conf;
+	memset(conf_snaps, 0, sizeof(conf_snaps));
 
-		snprintf(tmp, sizeof(tmp), "ifx_%d_name", i);
-		if (conf.influx.clients[i].addr)
-			nvs_set_str(hnd, tmp, conf.influx.clients[i].name);
-		else
-			nvs_erase_key(hnd, tmp);
+	err = conf_load_blob(hnd, c);
+	if (err == ESP_OK) {
+		conf_stored = 1;
+	} else if (err == ESP_ERR_NVS_NOT_FOUND) {
+		ESP_LOGI("CONF", "Migrating configuration");
+		conf_load_legacy(hnd, c);
+		conf_write_blob(hnd, &conf_snaps[0]);
+		if (conf_stored) conf_erase_legacy(hnd);
+		nvs_commit(hnd);
+	} else {
+		ESP_LOGE("CONF", "Stored configuration invalid: %s", esp_err_to_name(err));
+		memset(c, 0, sizeof(*c));
+	}
 
-		snprintf(tmp, sizeof(tmp), "ifx_%d_addr", i);
-		if (conf.influx.clients[i].addr)
-			nvs_set_u64(hnd, tmp, conf.influx.clients[i].addr);
-		else
-			nvs_erase_key(hnd, tmp);
+	nvs_close(hnd);
+
+	/* A change writes the new blob before erasing the old one */
+	nvs_stats_t st;
+	if (nvs_get_stats(NULL, &st) == ESP_OK) {
+		if (st.free_entries < CONF_BLOB_ENTRIES + CONF_NVS_PAGE_ENTRIES) {
+			ESP_LOGW("CONF", "NVS %u of %u entries free, too few to store a change of %u",
+					(unsigned) st.free_entries, (unsigned) st.total_entries, (unsigned) CONF_BLOB_ENTRIES);
+		} else {
+			ESP_LOGI("CONF", "NVS %u of %u entries free, a change takes %u",
+					(unsigned) st.free_entries, (unsigned) st.total_entries, (unsigned) CONF_BLOB_ENTRIES);
+		}
+	}
+	__atomic_store_n(&conf_cur, &conf_snaps[0], __ATOMIC_RELEASE);
+}
+
+/* Pins the current configuration, must be released with conf_put() */
+const struct conf *conf_get() {
+	while (1) {
+		struct conf_snap *s = __atomic_load_n(&conf_cur, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&s->refs, 1, __ATOMIC_SEQ_CST);
+		/* A writer may have recycled s meanwhile; then it is no longer current */
+		if (s == __atomic_load_n(&conf_cur, __ATOMIC_SEQ_CST)) return &s->conf;
+		__atomic_sub_fetch(&s->refs, 1, __ATOMIC_SEQ_CST);
 	}
+}
 
-	nvs_set_str(hnd, "ifx_host", conf.influx.host);
-	nvs_set_str(hnd, "ifx_db", conf.influx.db);
-	nvs_set_str(hnd, "ifx_pfx", conf.influx.pfx);
-	nvs_set_u16(hnd, "ifx_intrvl", conf.influx.interval_s);
+void conf_put(const struct conf *c) {
+	struct conf_snap *s = conf_snap_of(c);
+	__atomic_sub_fetch(&s->refs, 1, __ATOMIC_SEQ_CST);
+}
 
-	nvs_commit(hnd);
-	nvs_close(hnd);
+/* Returns a private copy of the current configuration to modify */
+struct conf *conf_edit() {
+	xSemaphoreTake(conf_wr_mutex, portMAX_DELAY);
+
+	struct conf_snap *cur = __atomic_load_n(&conf_cur, __ATOMIC_SEQ_CST);
+	while (1) {
+		int i;
+		for (i=0; i<CONF_SNAPSHOTS; i++) {
+			struct conf_snap *s = &conf_snaps[i];
+			if (s == cur || __atomic_load_n(&s->refs, __ATOMIC_SEQ_CST) != 0) continue;
+			memcpy(&s->conf, &cur->conf, sizeof(s->conf));
+			return &s->conf;
+		}
+		/* All old snapshots still pinned, readers hold them only briefly */
+		vTaskDelay(1);
+	}
+}
+
+/*
+ * Publishes and stores a configuration obtained from conf_edit(). Returns
+ * once no reader holds the previous snapshot any more, so per-sensor state
+ * can be reset afterwards without racing a reader of the old sensor list.
+ */
+void conf_commit(struct conf *c) {
+	struct conf_snap *s = conf_snap_of(c);
+	struct conf_snap *old = __atomic_exchange_n(&conf_cur, s, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&conf_version, 1, __ATOMIC_RELAXED);
+	while (__atomic_load_n(&old->refs, __ATOMIC_SEQ_CST) != 0) {
+		vTaskDelay(1);
+	}
+	conf_store(s, old);
+	xSemaphoreGive(conf_wr_mutex);
+
+	TaskHandle_t w = __atomic_load_n(&conf_watcher, __ATOMIC_RELAXED);
+	if (w != NULL) xTaskNotifyGive(w);
+}
+
+void conf_abort(struct conf *c) {
+	xSemaphoreGive(conf_wr_mutex);
+}
+
+void conf_watch(TaskHandle_t task) {
+	__atomic_store_n(&conf_watcher, task, __ATOMIC_RELAXED);
 }
@@ -22,32 +22,97 @@
 #define MAIN_CONF_H_
 
 #include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 
 #define CONF_IFX_CLI_NAME_LEN	32
-#define CONF_MAX_IFX_CLIENTS	8
+/*
+ * Each sensor takes 40 bytes in both configuration snapshots and in the NVS
+ * blob. At 128, struct conf is 5320 bytes: 10.4 KB of static DRAM, and 170
+ * of the 630 entries the 24 KB NVS partition has besides its spare page,
+ * twice while a change is stored. conf_init() logs what is left.
+ */
+#ifndef CONF_MAX_IFX_CLIENTS		// raised by the simulator
+#define CONF_MAX_IFX_CLIENTS	128
+#endif
 #define CONF_MAX_IFX_HOSTLEN	32
 #define CONF_MAX_IFX_DB			16
 #define CONF_MAX_IFX_PFX		32
+#define CONF_FWD_UUIDS			8
 
 struct conf_influx_client {
 	uint64_t addr;
 	char name[CONF_IFX_CLI_NAME_LEN];
 };
 
+/*
+ * Stored as one NVS blob: everything before clients is copied as is, so new
+ * settings are added right before clients and read as zero from older blobs.
+ */
 struct conf {
 	struct conf_influx {
-		struct conf_influx_client clients[CONF_MAX_IFX_CLIENTS];
 		char host[CONF_MAX_IFX_HOSTLEN];
 		char db[CONF_MAX_IFX_DB];
 		char pfx[CONF_MAX_IFX_PFX];
 		uint16_t interval_s;
 	} influx;
+	struct conf_net {			// all 0: DHCP
+		uint32_t ip;			// network byte order
+		uint32_t gw;
+		uint32_t mask;
+		uint32_t dns;
+	} net;
+	struct conf_power {
+		uint8_t low;			// modem sleep, BLE scans only before reports
+		uint8_t scan_s;			// BLE scan burst length, 0: default
+	} power;
+	struct conf_gossip {
+		uint8_t on;				// elect one reporter among proxies
+	} gossip;
+	struct conf_relay {
+		uint8_t mode;			// RELAY_*, applied on restart
+		uint8_t channel;		// edge: WiFi channel of the gateway, 0: search
+	} relay;
+	struct conf_fwd {			// raw advertisement forwarding, off if no host
+		char host[CONF_MAX_IFX_HOSTLEN];
+		uint16_t port;
+		uint16_t rate_ms;		// per device, 0: unlimited
+		uint16_t uuids[CONF_FWD_UUIDS];	// service data UUIDs, 0-terminated, none: all
+	} fwd;
+	struct conf_bin {			// binary reports, see ifxbin.c
+		uint8_t on;
+		uint16_t port;			// on the Influx host, 0: default
+	} bin;
+	struct conf_syslog {		// remote log output, off if no host
+		char host[CONF_MAX_IFX_HOSTLEN];
+		uint16_t port;			// 0: 514
+	} syslog;
+	struct conf_influx_client clients[CONF_MAX_IFX_CLIENTS];
 };
 
-extern struct conf conf;
+extern uint32_t conf_version;	// bumped on every conf_commit()
 
 void conf_init();
-void conf_store();
+
+/*
+ * Readers pin the current configuration with conf_get() and release it with
+ * conf_put(); the snapshot never changes in between. Pins are meant to be
+ * short, do not hold one across a delay.
+ */
+const struct conf *conf_get();
+void conf_put(const struct conf *c);
+
+/*
+ * Writers modify a copy and publish it atomically, writes are serialized.
+ * conf_commit() waits for readers of the old snapshot, so it must not be
+ * called while holding a pin.
+ */
+struct conf *conf_edit();
+void conf_commit(struct conf *c);
+void conf_abort(struct conf *c);
+
+/* The task gets a notification (xTaskNotifyGive) after every conf_commit() */
+void conf_watch(TaskHandle_t task);
 
 #endif /* MAIN_CONF_H_ */
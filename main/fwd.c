@@ -0,0 +1,240 @@
+/*
+ * fwd.c
+ *
+ * Forwarding of raw advertisements to a central decoder
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Service data of the advertisements that pass the UUID allowlist and the
+ * per-device rate limit is collected into a batch, sent as one UDP datagram
+ * every FWD_FLUSH_MS or when full. Multi-byte fields are little endian:
+ *
+ *   'H' 'F' version flags proxy_mac[6] time_ms(u64) n(u16)
+ *   n times: len(u8, of the rest of the record) mac[6] rssi(i8) dt_ms(u16)
+ *            service_data[len - 9], starting with the 16-bit UUID
+ *
+ * time_ms is the unix time of the first record with FWD_TIME_UNIX set in
+ * flags, the uptime otherwise. dt_ms is the record's offset from it.
+ */
+
+#include <string.h>
+#include <sys/time.h>
+
+//#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "conf.h"
+#include "wifi.h"
+#include "tasks.h"
+#include "fwd.h"
+
+#define FWD_VERSION		1
+#define FWD_TIME_UNIX	0x01
+#define FWD_HDR_LEN		20
+#define FWD_REC_HDR		10
+#define FWD_REC_MAX		(FWD_REC_HDR + 31)	// service data fits in one AD structure
+#define FWD_BUF_LEN		1400
+#define FWD_FLUSH_MS	1000
+#define FWD_MACS		64			// devices tracked for the rate limit
+#define FWD_TIME_VALID	1577836800	// 2020-01-01, earlier means no SNTP yet
+
+static SemaphoreHandle_t fwd_mutex;
+static TaskHandle_t fwd_task_hdl;
+static struct fwd_stats fwd_stats;
+
+/* Batch being filled by the BT task and the copy being sent */
+static uint8_t fwd_buf[FWD_BUF_LEN];
+static uint8_t fwd_out[FWD_BUF_LEN];
+static int fwd_len;				// 0 if no batch is open
+static int fwd_n;
+static int64_t fwd_base_us;
+static uint64_t fwd_base_ms;
+static uint8_t fwd_flags;
+
+/* Settings as seen by the BT task, reloaded when the configuration changes */
+static uint32_t fwd_conf_ver;
+static int fwd_on;
+static uint16_t fwd_uuids[CONF_FWD_UUIDS];
+static TickType_t fwd_rate;
+
+static struct {
+	uint64_t addr;
+	TickType_t last;
+} fwd_macs[FWD_MACS];
+
+static void fwd_load() {
+	const struct conf *c = conf_get();
+	fwd_on = c->fwd.host[0] != '\0';
+	memcpy(fwd_uuids, c->fwd.uuids, sizeof(fwd_uuids));
+	fwd_rate = c->fwd.rate_ms / portTICK_PERIOD_MS;
+	conf_put(c);
+}
+
+/* An empty allowlist lets everything with service data through */
+static int fwd_allowed(uint16_t uuid) {
+	int i;
+	if (fwd_uuids[0] == 0) return 1;
+	for (i=0; i<CONF_FWD_UUIDS && fwd_uuids[i] != 0; i++) {
+		if (fwd_uuids[i] == uuid) return 1;
+	}
+	return 0;
+}
+
+/* Devices are tracked least recently forwarded first out */
+static int fwd_rate_ok(uint64_t addr) {
+	if (fwd_rate == 0) return 1;
+	TickType_t now = xTaskGetTickCount();
+	int i, e = 0;
+	for (i=0; i<FWD_MACS; i++) {
+		if (fwd_macs[i].addr == addr) {
+			if (now - fwd_macs[i].last < fwd_rate) return 0;
+			fwd_macs[i].last = now;
+			return 1;
+		}
+		if (now - fwd_macs[i].last > now - fwd_macs[e].last) e = i;
+	}
+	fwd_macs[e].addr = addr;
+	fwd_macs[e].last = now;
+	return 1;
+}
+
+/* Called from the BT task for every advertisement */
+void fwd_adv(const uint8_t *bda, int rssi, const uint8_t *srv_data, int srv_len) {
+	uint32_t ver = __atomic_load_n(&conf_version, __ATOMIC_RELAXED);
+	if (ver != fwd_conf_ver) {
+		fwd_conf_ver = ver;
+		fwd_load();
+	}
+	if (!fwd_on || srv_data == NULL || srv_len < 2) return;
+	if (!fwd_allowed(srv_data[0] | (srv_data[1] << 8))) return;
+
+	uint64_t addr = 0;
+	int i;
+	for (i=0; i<6; i++) addr = (addr << 8) | bda[i];
+	if (!fwd_rate_ok(addr)) {
+		fwd_stats.rate_drops++;
+		return;
+	}
+
+	int rec = FWD_REC_HDR + srv_len;
+	if (rec > FWD_REC_MAX) return;
+	int64_t now = esp_timer_get_time();
+
+	xSemaphoreTake(fwd_mutex, portMAX_DELAY);
+	if (fwd_len + rec > FWD_BUF_LEN) {
+		fwd_stats.drops++;
+		xSemaphoreGive(fwd_mutex);
+		xTaskNotifyGive(fwd_task_hdl);
+		return;
+	}
+	if (fwd_len == 0) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		fwd_base_us = now;
+		fwd_flags = tv.tv_sec >= FWD_TIME_VALID ? FWD_TIME_UNIX : 0;
+		fwd_base_ms = fwd_flags ? tv.tv_sec * 1000ULL + tv.tv_usec / 1000 : (uint64_t) now / 1000;
+		fwd_len = FWD_HDR_LEN;
+		fwd_n = 0;
+	}
+	uint8_t *p = fwd_buf + fwd_len;
+	int64_t dt = (now - fwd_base_us) / 1000;
+	if (dt > UINT16_MAX) dt = UINT16_MAX;
+	p[0] = rec - 1;
+	memcpy(p + 1, bda, 6);
+	p[7] = (int8_t) rssi;
+	p[8] = dt;
+	p[9] = dt >> 8;
+	memcpy(p + FWD_REC_HDR, srv_data, srv_len);
+	fwd_len += rec;
+	fwd_n++;
+	int full = fwd_len > FWD_BUF_LEN - FWD_REC_MAX;
+	xSemaphoreGive(fwd_mutex);
+
+	if (full) xTaskNotifyGive(fwd_task_hdl);
+}
+
+/* Returns nonzero if the datagram could not be sent */
+static int fwd_send(int sock, const uint8_t *buf, int len) {
+	const struct conf *c = conf_get();
+	struct sockaddr_in dest = {
+		.sin_family = AF_INET,
+		.sin_port = htons(c->fwd.port ? c->fwd.port : FWD_PORT_DEFAULT),
+	};
+	dest.sin_addr.s_addr = inet_addr(c->fwd.host);
+	conf_put(c);
+	if (dest.sin_addr.s_addr == INADDR_NONE) return -1;
+	if (!wifi_wait_conn(0)) return -1;
+	return sendto(sock, buf, len, 0, (struct sockaddr *) &dest, sizeof(dest)) < 0;
+}
+
+static void fwd_task(void *arg) {
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+	if (sock < 0) {
+		ESP_LOGE("FWD", "Unable to create socket: errno %d", errno);
+		vTaskDelete(NULL);
+		return;
+	}
+
+	uint8_t proxy[6];
+	esp_read_mac(proxy, ESP_MAC_WIFI_STA);
+
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, FWD_FLUSH_MS / portTICK_PERIOD_MS);
+
+		xSemaphoreTake(fwd_mutex, portMAX_DELAY);
+		int len = fwd_len, n = fwd_n, i;
+		if (len != 0) {
+			uint8_t *h = fwd_buf;
+			h[0] = 'H';
+			h[1] = 'F';
+			h[2] = FWD_VERSION;
+			h[3] = fwd_flags;
+			memcpy(h + 4, proxy, 6);
+			for (i=0; i<8; i++) h[10 + i] = fwd_base_ms >> (8*i);
+			h[18] = n;
+			h[19] = n >> 8;
+			memcpy(fwd_out, fwd_buf, len);
+			fwd_len = 0;
+		}
+		xSemaphoreGive(fwd_mutex);
+		if (len == 0) continue;
+
+		if (fwd_send(sock, fwd_out, len)) {
+			fwd_stats.drops += n;
+		} else {
+			fwd_stats.datagrams++;
+			fwd_stats.recs += n;
+		}
+	}
+}
+
+void fwd_stats_get(struct fwd_stats *s) {
+	*s = fwd_stats;
+}
+
+void fwd_init() {
+	fwd_mutex = xSemaphoreCreateMutex();
+	fwd_conf_ver = __atomic_load_n(&conf_version, __ATOMIC_RELAXED);
+	fwd_load();
+	task_create(TASK_FWD, fwd_task, NULL, &fwd_task_hdl);
+}
@@ -0,0 +1,39 @@
+/*
+ * fwd.h
+ *
+ * Forwarding of raw advertisements to a central decoder
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MAIN_FWD_H_
+#define MAIN_FWD_H_
+
+#include <stdint.h>
+
+#define FWD_PORT_DEFAULT	8091
+
+struct fwd_stats {
+	uint32_t recs;			// advertisements forwarded
+	uint32_t datagrams;
+	uint32_t rate_drops;	// over the per-device rate limit
+	uint32_t drops;			// batch full, offline or not sent
+};
+
+void fwd_init();
+void fwd_adv(const uint8_t *bda, int rssi, const uint8_t *srv_data, int srv_len);
+void fwd_stats_get(struct fwd_stats *s);
+
+#endif /* MAIN_FWD_H_ */
@@ -0,0 +1,329 @@
+/*
+ * gossip.c
+ *
+ * Best-receiver election between proxies that hear the same sensors
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Every proxy multicasts a summary of the configured sensors it hears: the
+ * averaged RSSI, the share of frames received (from gaps in the MiBeacon
+ * frame counter) and whether it currently reports the sensor. From those all
+ * proxies rank the receivers the same way and only the best one reports.
+ * A proxy that goes silent drops out after GOSSIP_TIMEOUT_MS and the next
+ * best takes over on its next report.
+ *
+ * Datagram, multi-byte fields big endian:
+ *   'H' 'G' version n proxy_mac[6]
+ *   n times: sensor_mac[6] rssi(int8) rx(percent, 0xFF unknown) flags
+ */
+
+#include <string.h>
+#include <math.h>
+
+//#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+#include "esp_mac.h"
+#include "conf.h"
+#include "bt.h"
+#include "wifi.h"
+#include "tasks.h"
+#include "gossip.h"
+
+#define GOSSIP_VERSION		1
+#define GOSSIP_HDR_LEN		10
+#define GOSSIP_ENTRY_LEN	9
+#define GOSSIP_ENTRIES		(CONF_MAX_IFX_CLIENTS < 255 ? CONF_MAX_IFX_CLIENTS : 255)	// count is one byte
+#define GOSSIP_BUF_LEN		(GOSSIP_HDR_LEN + GOSSIP_ENTRIES * GOSSIP_ENTRY_LEN)
+#define GOSSIP_PERIOD_MS	5000
+#define GOSSIP_TIMEOUT_MS	(3 * GOSSIP_PERIOD_MS + 1000)
+#define GOSSIP_LOSS_DB		20		// score penalty for losing every frame
+#define GOSSIP_HYST_DB		3		// bonus of the current reporter
+#define GOSSIP_PEERS		8		// tracked for telemetry only
+#define GOSSIP_CLAIM		0x01
+
+/* Best other receiver of each configured sensor */
+struct gossip_remote {
+	uint8_t proxy[6];
+	uint8_t valid;
+	int16_t score;
+	TickType_t seen;
+};
+
+static struct gossip_remote gossip_best[CONF_MAX_IFX_CLIENTS];
+static uint32_t gossip_claim[BT_DIRTY_WORDS];	// sensors this proxy reports
+static uint32_t gossip_conf_ver;
+static SemaphoreHandle_t gossip_mutex;
+static uint8_t gossip_id[6];
+static int gossip_on;
+
+static struct {
+	uint8_t id[6];
+	TickType_t seen;
+} gossip_peers[GOSSIP_PEERS];
+
+static uint8_t gossip_buf[GOSSIP_BUF_LEN + 1];
+
+/* Reception quality in dB: the RSSI, less GOSSIP_LOSS_DB if all frames are lost */
+static int gossip_score(int rssi, int rx_pm, int claim) {
+	if (rx_pm < 0) rx_pm = 1000;
+	return rssi - GOSSIP_LOSS_DB * (1000 - rx_pm) / 1000 + (claim ? GOSSIP_HYST_DB : 0);
+}
+
+/* Total order, so all proxies agree: higher score, then lower proxy id */
+static int gossip_better(int score, const uint8_t *id, int other, const uint8_t *other_id) {
+	if (score != other) return score > other;
+	return memcmp(id, other_id, 6) < 0;
+}
+
+static int gossip_fresh(const struct gossip_remote *r, TickType_t now) {
+	return r->valid && now - r->seen < GOSSIP_TIMEOUT_MS / portTICK_PERIOD_MS;
+}
+
+/* Sensor indices are only meaningful for one configuration; call locked */
+static void gossip_check_conf() {
+	uint32_t ver = __atomic_load_n(&conf_version, __ATOMIC_RELAXED);
+	if (ver == gossip_conf_ver) return;
+	gossip_conf_ver = ver;
+	memset(gossip_best, 0, sizeof(gossip_best));
+	memset(gossip_claim, 0, sizeof(gossip_claim));
+}
+
+static int gossip_find(const struct conf *c, uint64_t addr) {
+	int i;
+	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
+		const struct conf_influx_client *cli = &c->clients[i];
+		if (cli->addr == addr && cli->name[0] != '\0') return i;
+	}
+	return -1;
+}
+
+/* Whether this proxy should report sensor i now, called by the poller */
+int gossip_should_report(int i) {
+	if (!gossip_on) return 1;
+
+	float rssi = bt_result_get_rssi(i);
+	int heard = !isnan(rssi) && bt_result_get_adv_rate(i) > 0;
+	int rx = bt_result_get_reception(i);
+
+	xSemaphoreTake(gossip_mutex, portMAX_DELAY);
+	gossip_check_conf();
+	uint32_t bit = 1u << (i%32);
+	const struct gossip_remote *r = &gossip_best[i];
+	int own;
+	if (!gossip_fresh(r, xTaskGetTickCount())) {
+		own = 1;		// nobody else hears it, or its receiver went silent
+	} else if (!heard) {
+		own = 0;
+	} else {
+		int score = gossip_score(lroundf(rssi), rx, gossip_claim[i/32] & bit);
+		own = gossip_better(score, gossip_id, r->score, r->proxy);
+	}
+	if (own) gossip_claim[i/32] |= bit;
+	else gossip_claim[i/32] &= ~bit;
+	xSemaphoreGive(gossip_mutex);
+	return own;
+}
+
+static void gossip_peer_seen(const uint8_t *id, TickType_t now) {
+	int i, oldest = 0;
+	for (i=0; i<GOSSIP_PEERS; i++) {
+		if (memcmp(gossip_peers[i].id, id, 6) == 0) break;
+		if (now - gossip_peers[i].seen > now - gossip_peers[oldest].seen) oldest = i;
+	}
+	if (i == GOSSIP_PEERS) {
+		i = oldest;
+		memcpy(gossip_peers[i].id, id, 6);
+	}
+	gossip_peers[i].seen = now;
+}
+
+/* Other proxies heard within GOSSIP_TIMEOUT_MS */
+uint32_t gossip_get_peers() {
+	TickType_t now = xTaskGetTickCount();
+	uint32_t n = 0;
+	int i;
+	xSemaphoreTake(gossip_mutex, portMAX_DELAY);
+	for (i=0; i<GOSSIP_PEERS; i++) {
+		if (gossip_peers[i].seen != 0 &&
+				now - gossip_peers[i].seen < GOSSIP_TIMEOUT_MS / portTICK_PERIOD_MS) n++;
+	}
+	xSemaphoreGive(gossip_mutex);
+	return n;
+}
+
+static void gossip_recv(const uint8_t *b, int len) {
+	if (len < GOSSIP_HDR_LEN || b[0] != 'H' || b[1] != 'G' || b[2] != GOSSIP_VERSION) return;
+	int n = b[3];
+	if (len != GOSSIP_HDR_LEN + n * GOSSIP_ENTRY_LEN) return;
+	const uint8_t *proxy = b + 4;
+	if (memcmp(proxy, gossip_id, 6) == 0) return;	// our own, looped back
+
+	TickType_t now = xTaskGetTickCount();
+	uint32_t listed[BT_DIRTY_WORDS] = { 0 };
+
+	const struct conf *c = conf_get();
+	xSemaphoreTake(gossip_mutex, portMAX_DELAY);
+	gossip_check_conf();
+	gossip_peer_seen(proxy, now);
+
+	int e, i;
+	for (e=0; e<n; e++) {
+		const uint8_t *p = b + GOSSIP_HDR_LEN + e * GOSSIP_ENTRY_LEN;
+		uint64_t addr = 0;
+		for (i=0; i<6; i++) addr = (addr << 8) | p[i];
+		i = gossip_find(c, addr);
+		if (i < 0) continue;
+
+		int rx = p[7] == 0xFF ? -1 : p[7] * 10;
+		int score = gossip_score((int8_t) p[6], rx, p[8] & GOSSIP_CLAIM);
+		struct gossip_remote *r = &gossip_best[i];
+		if (!gossip_fresh(r, now) || memcmp(r->proxy, proxy, 6) == 0 ||
+				gossip_better(score, proxy, r->score, r->proxy)) {
+			memcpy(r->proxy, proxy, 6);
+			r->score = score;
+			r->seen = now;
+			r->valid = 1;
+		}
+		listed[i/32] |= 1u << (i%32);
+	}
+
+	/* A sensor the peer no longer lists is no longer covered by it */
+	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
+		struct gossip_remote *r = &gossip_best[i];
+		if (r->valid && !(listed[i/32] & (1u << (i%32))) &&
+				memcmp(r->proxy, proxy, 6) == 0) r->valid = 0;
+	}
+	xSemaphoreGive(gossip_mutex);
+	conf_put(c);
+}
+
+static void gossip_send(int sock) {
+	uint8_t *b = gossip_buf;
+	b[0] = 'H';
+	b[1] = 'G';
+	b[2] = GOSSIP_VERSION;
+	memcpy(b + 4, gossip_id, 6);
+
+	int n = 0, i, k;
+	const struct conf *c = conf_get();
+	/* Sensors past the limit are not announced, peers then report them too */
+	for (i=0; i<CONF_MAX_IFX_CLIENTS && n < GOSSIP_ENTRIES; i++) {
+		const struct conf_influx_client *cli = &c->clients[i];
+		if (cli->addr == 0 || cli->name[0] == '\0') continue;
+		float rssi = bt_result_get_rssi(i);
+		if (isnan(rssi) || bt_result_get_adv_rate(i) == 0) continue;
+		int rx = bt_result_get_reception(i);
+
+		uint8_t *p = b + GOSSIP_HDR_LEN + n * GOSSIP_ENTRY_LEN;
+		for (k=0; k<6; k++) p[k] = cli->addr >> (40 - 8*k);
+		p[6] = (int8_t) lroundf(rssi);
+		p[7] = rx < 0 ? 0xFF : rx / 10;
+		p[8] = (__atomic_load_n(&gossip_claim[i/32], __ATOMIC_RELAXED) & (1u << (i%32)))
+				? GOSSIP_CLAIM : 0;
+		n++;
+	}
+	conf_put(c);
+	b[3] = n;
+
+	struct sockaddr_in dest = {
+		.sin_family = AF_INET,
+		.sin_port = htons(GOSSIP_PORT),
+	};
+	dest.sin_addr.s_addr = inet_addr(GOSSIP_GROUP);
+	if (sendto(sock, b, GOSSIP_HDR_LEN + n * GOSSIP_ENTRY_LEN, 0,
+			(struct sockaddr *) &dest, sizeof(dest)) < 0) {
+		ESP_LOGW("GSP", "Unable to send: errno %d", errno);
+	}
+}
+
+static int gossip_open() {
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+	if (sock < 0) {
+		ESP_LOGE("GSP", "Unable to create socket: errno %d", errno);
+		return -1;
+	}
+
+	int one = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(GOSSIP_PORT),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	struct ip_mreq mreq = { 0 };
+	mreq.imr_multiaddr.s_addr = inet_addr(GOSSIP_GROUP);
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	uint8_t ttl = 1;
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 500000 };
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0 ||
+			setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+			setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		ESP_LOGE("GSP", "Unable to join %s: errno %d", GOSSIP_GROUP, errno);
+		close(sock);
+		return -1;
+	}
+	ESP_LOGI("GSP", "Joined %s:%d", GOSSIP_GROUP, GOSSIP_PORT);
+	return sock;
+}
+
+static void gossip_task(void *arg) {
+	int sock = -1;
+	TickType_t last_sent = 0;
+	while (1) {
+		const struct conf *c = conf_get();
+		int on = c->gossip.on;
+		conf_put(c);
+		gossip_on = on;
+
+		/* Rejoined after every reconnect, the interface may have changed */
+		if (!on || !wifi_wait_conn(0)) {
+			if (sock >= 0) {
+				close(sock);
+				sock = -1;
+			}
+			vTaskDelay(GOSSIP_PERIOD_MS / portTICK_PERIOD_MS);
+			continue;
+		}
+		if (sock < 0) {
+			sock = gossip_open();
+			if (sock < 0) {
+				vTaskDelay(GOSSIP_PERIOD_MS / portTICK_PERIOD_MS);
+				continue;
+			}
+		}
+
+		TickType_t now = xTaskGetTickCount();
+		if (now - last_sent >= GOSSIP_PERIOD_MS / portTICK_PERIOD_MS) {
+			last_sent = now;
+			gossip_send(sock);
+		}
+		int len = recv(sock, gossip_buf, sizeof(gossip_buf), 0);
+		if (len > 0) gossip_recv(gossip_buf, len);
+	}
+}
+
+void gossip_init() {
+	gossip_mutex = xSemaphoreCreateMutex();
+	esp_read_mac(gossip_id, ESP_MAC_WIFI_STA);
+	task_create(TASK_GOSSIP, gossip_task, NULL, NULL);
+}
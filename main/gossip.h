@@ -0,0 +1,33 @@
+/*
+ * gossip.h
+ *
+ * Best-receiver election between proxies that hear the same sensors
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MAIN_GOSSIP_H_
+#define MAIN_GOSSIP_H_
+
+#include <stdint.h>
+
+#define GOSSIP_GROUP		"239.255.72.71"
+#define GOSSIP_PORT			8090
+
+void gossip_init();
+int gossip_should_report(int i);
+uint32_t gossip_get_peers();
+
+#endif /* MAIN_GOSSIP_H_ */
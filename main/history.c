@@ -0,0 +1,200 @@
+/*
+ * history.c
+ *
+ * Short-term reading history per sensor
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <math.h>
+
+//#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "conf.h"
+#include "history.h"
+
+#define HISTORY_MISSING		INT16_MIN
+#define HISTORY_RANGE		16383		// readings beyond +-1638.3 are not plausible
+
+/*
+ * Values are stored in 0.1 units as int16 deltas from the first reading of
+ * their block. Readings are limited to +-HISTORY_RANGE, so every delta
+ * within a block fits exactly and none of them is the missing marker;
+ * readings outside that are ignored, never clipped. Whole
+ * blocks are dropped when the ring is full.
+ */
+struct history_block {
+	int16_t base[2];			// HISTORY_NONE until the first reading
+	int16_t delta[HISTORY_BLOCK][2];
+};
+
+struct history_slot {
+	uint64_t addr;				// 0 if unused
+	uint32_t start;				// step number of the oldest point
+	uint16_t first;				// oldest block
+	uint16_t n;					// points stored
+	struct history_block blocks[HISTORY_BLOCKS];
+};
+
+static struct history_slot history[HISTORY_SENSORS];
+static SemaphoreHandle_t history_mutex;
+
+void history_init() {
+	history_mutex = xSemaphoreCreateMutex();
+}
+
+static uint32_t history_step() {
+	return esp_timer_get_time() / (1000000LL * HISTORY_STEP_S);
+}
+
+/* Finds the slot of a sensor, claiming a free or no longer configured one */
+static struct history_slot *history_slot(uint64_t addr, int claim) {
+	struct history_slot *free_slot = NULL;
+	int i, j;
+	for (i=0; i<HISTORY_SENSORS; i++) {
+		if (history[i].addr == addr) return &history[i];
+	}
+	if (!claim) return NULL;
+
+	const struct conf *c = conf_get();
+	for (i=0; i<HISTORY_SENSORS && free_slot == NULL; i++) {
+		if (history[i].addr == 0) {
+			free_slot = &history[i];
+			continue;
+		}
+		for (j=0; j<CONF_MAX_IFX_CLIENTS; j++) {
+			if (c->clients[j].addr == history[i].addr) break;
+		}
+		if (j == CONF_MAX_IFX_CLIENTS) free_slot = &history[i];
+	}
+	conf_put(c);
+
+	if (free_slot == NULL) return NULL;
+	memset(free_slot, 0, sizeof(*free_slot));
+	free_slot->addr = addr;
+	free_slot->start = history_step();
+	return free_slot;
+}
+
+static void history_set(struct history_slot *s, int pos, int ch, float v) {
+	struct history_block *b = &s->blocks[(s->first + pos / HISTORY_BLOCK) % HISTORY_BLOCKS];
+	int16_t *d = &b->delta[pos % HISTORY_BLOCK][ch];
+	if (isnan(v)) {
+		*d = HISTORY_MISSING;
+		return;
+	}
+	if (fabsf(v * 10) > HISTORY_RANGE) return;	// left as it was
+	int x = lroundf(v * 10);
+	if (b->base[ch] == HISTORY_NONE) b->base[ch] = x;
+	*d = x - b->base[ch];		// within +-2 * HISTORY_RANGE
+}
+
+/* Appends an empty point, dropping the oldest block when full */
+static void history_append(struct history_slot *s) {
+	if (s->n == HISTORY_LEN) {
+		s->first = (s->first + 1) % HISTORY_BLOCKS;
+		s->start += HISTORY_BLOCK;
+		s->n -= HISTORY_BLOCK;
+	}
+	struct history_block *b = &s->blocks[(s->first + s->n / HISTORY_BLOCK) % HISTORY_BLOCKS];
+	if (s->n % HISTORY_BLOCK == 0) {
+		b->base[0] = b->base[1] = HISTORY_NONE;
+	}
+	b->delta[s->n % HISTORY_BLOCK][0] = HISTORY_MISSING;
+	b->delta[s->n % HISTORY_BLOCK][1] = HISTORY_MISSING;
+	s->n++;
+}
+
+/* Records a reading; the last one within a step is kept */
+void history_push(uint64_t addr, float t, float h) {
+	xSemaphoreTake(history_mutex, portMAX_DELAY);
+	/* A sensor gets a slot with its first reading */
+	struct history_slot *s = history_slot(addr, !isnan(t) || !isnan(h));
+	if (s == NULL) {
+		xSemaphoreGive(history_mutex);
+		return;
+	}
+
+	uint32_t now = history_step();
+	if (now - s->start >= (uint32_t) s->n + HISTORY_LEN) {
+		/* Not heard of for longer than the history covers */
+		s->n = 0;
+		s->first = 0;
+		s->start = now;
+	}
+	while (s->start + s->n <= now) history_append(s);
+
+	/* Missing values do not overwrite a reading from earlier in the step */
+	if (!isnan(t)) history_set(s, s->n - 1, 0, t);
+	if (!isnan(h)) history_set(s, s->n - 1, 1, h);
+	xSemaphoreGive(history_mutex);
+}
+
+static int16_t history_value(const struct history_slot *s, int pos, int ch) {
+	const struct history_block *b = &s->blocks[(s->first + pos / HISTORY_BLOCK) % HISTORY_BLOCKS];
+	int16_t d = b->delta[pos % HISTORY_BLOCK][ch];
+	if (d == HISTORY_MISSING) return HISTORY_NONE;
+	return b->base[ch] + d;
+}
+
+static void history_minmax(int16_t v, int16_t *min, int16_t *max) {
+	if (v == HISTORY_NONE) return;
+	if (*min == HISTORY_NONE || v < *min) *min = v;
+	if (*max == HISTORY_NONE || v > *max) *max = v;
+}
+
+/*
+ * Downsamples the history of a sensor into at most points min/max buckets,
+ * oldest first. Returns the number of buckets, bucket_s is the time each
+ * one covers and age_s how long ago the newest one started.
+ */
+int history_get(uint64_t addr, struct history_bucket *res, int points,
+		uint32_t *bucket_s, uint32_t *age_s) {
+	if (points <= 0) return 0;
+
+	xSemaphoreTake(history_mutex, portMAX_DELAY);
+	const struct history_slot *s = history_slot(addr, 0);
+	if (s == NULL || s->n == 0) {
+		xSemaphoreGive(history_mutex);
+		return 0;
+	}
+
+	int per = (s->n + points - 1) / points;
+	/* Buckets are aligned to the newest point, the oldest one may be partial */
+	int cnt = (s->n + per - 1) / per;
+	int pos = s->n - cnt * per;
+	int i, j;
+	for (i=0; i<cnt; i++) {
+		struct history_bucket *r = &res[i];
+		r->t_min = r->t_max = r->h_min = r->h_max = HISTORY_NONE;
+		for (j=0; j<per; j++, pos++) {
+			if (pos < 0) continue;
+			history_minmax(history_value(s, pos, 0), &r->t_min, &r->t_max);
+			history_minmax(history_value(s, pos, 1), &r->h_min, &r->h_max);
+		}
+	}
+
+	uint64_t now_s = esp_timer_get_time() / 1000000;
+	uint64_t newest_s = (uint64_t)(s->start + s->n - per) * HISTORY_STEP_S;
+	*bucket_s = per * HISTORY_STEP_S;
+	*age_s = now_s > newest_s ? now_s - newest_s : 0;
+	xSemaphoreGive(history_mutex);
+	return cnt;
+}
@@ -0,0 +1,47 @@
+/*
+ * history.h
+ *
+ * Short-term reading history per sensor
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MAIN_HISTORY_H_
+#define MAIN_HISTORY_H_
+
+#include <stdint.h>
+
+#define HISTORY_STEP_S		300		// one point per 5 minutes
+#define HISTORY_BLOCK		12		// points per block, one hour
+#define HISTORY_BLOCKS		24		// blocks kept per sensor
+#define HISTORY_LEN			(HISTORY_BLOCK * HISTORY_BLOCKS)
+#define HISTORY_SENSORS		16		// sensors with history at once
+
+#define HISTORY_NONE		INT16_MIN	// bucket without readings
+
+/* Range of one downsampled bucket, in 0.1 units */
+struct history_bucket {
+	int16_t t_min;
+	int16_t t_max;
+	int16_t h_min;
+	int16_t h_max;
+};
+
+void history_init();
+void history_push(uint64_t addr, float t, float h);
+int history_get(uint64_t addr, struct history_bucket *res, int points,
+		uint32_t *bucket_s, uint32_t *age_s);
+
+#endif /* MAIN_HISTORY_H_ */
@@ -19,237 +19,927 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <sys/param.h>
 
 //#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
 #include "esp_log.h"
 
 #include "esp_http_server.h"
 #include "esp_system.h"
-#include "cJSON.h"
+#include "esp_timer.h"
 #include "bt.h"
 #include "conf.h"
+#include "json.h"
+#include "history.h"
+#include "relay.h"
+#include "tasks.h"
+#include "stats.h"
 #include "http.h"
+#include "http_assets.h"
 
-extern const char index_html_start[] asm("_binary_index_html_start");
-extern const char index_html_end[]   asm("_binary_index_html_end");
-extern const char conf_html_start[] asm("_binary_conf_html_start");
-extern const char conf_html_end[]   asm("_binary_conf_html_end");
-extern const char hdr_html_start[] asm("_binary_hdr_html_start");
-extern const char hdr_html_end[]   asm("_binary_hdr_html_end");
-extern const char main_css_start[] asm("_binary_main_css_start");
-extern const char main_css_end[]   asm("_binary_main_css_end");
-extern const char main_js_start[] asm("_binary_main_js_start");
-extern const char main_js_end[]   asm("_binary_main_js_end");
+extern const char index_html_start[] asm("_binary_index_html_gz_start");
+extern const char index_html_end[]   asm("_binary_index_html_gz_end");
+extern const char conf_html_start[] asm("_binary_conf_html_gz_start");
+extern const char conf_html_end[]   asm("_binary_conf_html_gz_end");
+extern const char main_css_start[] asm("_binary_main_css_gz_start");
+extern const char main_css_end[]   asm("_binary_main_css_gz_end");
+extern const char main_js_start[] asm("_binary_main_js_gz_start");
+extern const char main_js_end[]   asm("_binary_main_js_gz_end");
 
 
-#define SCRATCH_BUFSIZE (1024)
+#define SCRATCH_BUFSIZE (512)
+#define CHUNK_BUFSIZE (512)
 struct http_server_context {
 	char scratch[SCRATCH_BUFSIZE];
+	char chunk[CHUNK_BUFSIZE];
+	struct history_bucket hist[HISTORY_LEN];
 } http_server_context;
 
+#define HTTP_WS_MAX_CLIENTS	4
+#define HTTP_WS_PERIOD_MS	250		// max update rate of a sensor per client
+#define HTTP_RECV_RETRIES	3		// receive timeouts in a row before giving up on a body
+
+static httpd_handle_t http_server;
+static uint32_t http_boot_id;	// keeps ETags of dynamic data unique across reboots
+static int http_ws_fds[HTTP_WS_MAX_CLIENTS];
+static int http_ws_pending;		// push work queued but not yet run
+
+/* Gzipped static file, see pack.py */
+struct http_asset {
+	const char *start;
+	const char *end;
+	const char *type;
+	const char *etag;
+};
 
-static esp_err_t http_index_html_handler(httpd_req_t *req) {
-	httpd_resp_send_chunk(req, hdr_html_start, hdr_html_end-hdr_html_start);
-	httpd_resp_send_chunk(req, index_html_start, index_html_end-index_html_start);
-	httpd_resp_send_chunk(req, NULL, 0);
-	return ESP_OK;
-}
+static const struct http_asset http_index_html = {
+	index_html_start, index_html_end, "text/html", HTTP_ETAG_INDEX_HTML
+};
+static const struct http_asset http_conf_html = {
+	conf_html_start, conf_html_end, "text/html", HTTP_ETAG_CONF_HTML
+};
+static const struct http_asset http_main_css = {
+	main_css_start, main_css_end, "text/css", HTTP_ETAG_MAIN_CSS
+};
+static const struct http_asset http_main_js = {
+	main_js_start, main_js_end, "application/javascript", HTTP_ETAG_MAIN_JS
+};
 
-static esp_err_t http_conf_html_handler(httpd_req_t *req) {
-	httpd_resp_send_chunk(req, hdr_html_start, hdr_html_end-hdr_html_start);
-	httpd_resp_send_chunk(req, conf_html_start, conf_html_end-conf_html_start);
-	httpd_resp_send_chunk(req, NULL, 0);
-	return ESP_OK;
+/* Checks If-None-Match against the given strong ETag */
+static int http_etag_match(httpd_req_t *req, const char *etag) {
+	char tmp[64];
+	size_t len = httpd_req_get_hdr_value_len(req, "If-None-Match");
+	if (len == 0 || len >= sizeof(tmp)) return 0;
+	if (httpd_req_get_hdr_value_str(req, "If-None-Match", tmp, sizeof(tmp)) != ESP_OK) return 0;
+	return strstr(tmp, etag) != NULL;
 }
 
-static esp_err_t http_main_css_handler(httpd_req_t *req) {
-	httpd_resp_set_type(req, "text/css");
+static esp_err_t http_asset_handler(httpd_req_t *req) {
+	const struct http_asset *a = req->user_ctx;
 
-	httpd_resp_send_chunk(req, main_css_start, main_css_end-main_css_start);
-	httpd_resp_send_chunk(req, NULL, 0);
-	return ESP_OK;
+	httpd_resp_set_hdr(req, "ETag", a->etag);
+	httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+	if (http_etag_match(req, a->etag)) {
+		httpd_resp_set_status(req, "304 Not Modified");
+		return httpd_resp_send(req, NULL, 0);
+	}
+
+	httpd_resp_set_type(req, a->type);
+	httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+	return httpd_resp_send(req, a->start, a->end-a->start);
 }
 
-static esp_err_t http_main_js_handler(httpd_req_t *req) {
-	httpd_resp_set_type(req, "application/javascript");
+static int http_chunk_flush(void *ctx, const char *buf, size_t len) {
+	return httpd_resp_send_chunk(ctx, buf, len) != ESP_OK;
+}
 
-	httpd_resp_send_chunk(req, main_js_start, main_js_end-main_js_start);
-	httpd_resp_send_chunk(req, NULL, 0);
-	return ESP_OK;
+/* Formats an address in network byte order, empty for 0 */
+static const char *http_ip_fmt(char ip[16], uint32_t a) {
+	if (a == 0) ip[0] = '\0';
+	else snprintf(ip, 16, "%lu.%lu.%lu.%lu", (unsigned long) a & 0xFF,
+			(unsigned long)(a >> 8) & 0xFF, (unsigned long)(a >> 16) & 0xFF,
+			(unsigned long)(a >> 24) & 0xFF);
+	return ip;
 }
 
 static esp_err_t http_conf_handler(httpd_req_t *req)
 {
+	uint32_t begin = stats_begin();
 	httpd_resp_set_type(req, "application/json");
-	cJSON *root = cJSON_CreateObject();
 
-	cJSON_AddStringToObject(root, "ifx_host", conf.influx.host);
-	cJSON_AddStringToObject(root, "ifx_db", conf.influx.db);
-	cJSON_AddStringToObject(root, "ifx_pfx", conf.influx.pfx);
-	cJSON_AddNumberToObject(root, "ifx_int", conf.influx.interval_s);
+	struct jsonw w;
+	jsonw_init(&w, http_server_context.chunk, sizeof(http_server_context.chunk),
+			http_chunk_flush, req);
+	jsonw_obj_open(&w, NULL);
+
+	const struct conf *c = conf_get();
+	jsonw_str(&w, "ifx_host", c->influx.host);
+	jsonw_str(&w, "ifx_db", c->influx.db);
+	jsonw_str(&w, "ifx_pfx", c->influx.pfx);
+	jsonw_num(&w, "ifx_int", c->influx.interval_s);
+	jsonw_int(&w, "ifx_max", CONF_MAX_IFX_CLIENTS);
+
+	char ip[16];
+	jsonw_str(&w, "net_ip", http_ip_fmt(ip, c->net.ip));
+	jsonw_str(&w, "net_gw", http_ip_fmt(ip, c->net.gw));
+	jsonw_str(&w, "net_mask", http_ip_fmt(ip, c->net.mask));
+	jsonw_str(&w, "net_dns", http_ip_fmt(ip, c->net.dns));
+	jsonw_bool(&w, "pwr_low", c->power.low);
+	jsonw_int(&w, "pwr_scan", c->power.scan_s);
+	jsonw_bool(&w, "gsp_on", c->gossip.on);
+	jsonw_int(&w, "rly_mode", c->relay.mode);
+	jsonw_int(&w, "rly_chan", c->relay.channel);
+	jsonw_str(&w, "fwd_host", c->fwd.host);
+	jsonw_int(&w, "fwd_port", c->fwd.port);
+	jsonw_int(&w, "fwd_rate", c->fwd.rate_ms);
+	jsonw_bool(&w, "ifx_bin", c->bin.on);
+	jsonw_int(&w, "ifx_bin_port", c->bin.port);
+	jsonw_str(&w, "log_host", c->syslog.host);
+	jsonw_int(&w, "log_port", c->syslog.port);
+
+	char uuids[CONF_FWD_UUIDS * 5 + 1] = "";
+	int u, ulen = 0;
+	for (u=0; u<CONF_FWD_UUIDS && c->fwd.uuids[u] != 0; u++) {
+		ulen += snprintf(uuids + ulen, sizeof(uuids) - ulen, "%s%04x",
+				u ? "," : "", c->fwd.uuids[u]);
+	}
+	jsonw_str(&w, "fwd_uuids", uuids);
 
-	cJSON *ifx_clients = cJSON_CreateArray();
-	cJSON_AddItemToObject(root, "ifx_clients", ifx_clients);
+	jsonw_arr_open(&w, "ifx_clients");
 
 	int i;
 	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
-		if (conf.influx.clients[i].addr == 0) continue;
-		cJSON *cli = cJSON_CreateObject();
-		cJSON_AddItemToArray(ifx_clients, cli);
+		if (c->clients[i].addr == 0) continue;
+		jsonw_obj_open(&w, NULL);
 
-		cJSON_AddStringToObject(cli, "name", conf.influx.clients[i].name);
+		jsonw_str(&w, "name", c->clients[i].name);
 
 		char tmp[32];
-		snprintf(tmp, sizeof(tmp), "%012llx", conf.influx.clients[i].addr);
-		cJSON_AddStringToObject(cli, "addr", tmp);
+		snprintf(tmp, sizeof(tmp), "%012llx", c->clients[i].addr);
+		jsonw_str(&w, "addr", tmp);
+
+		jsonw_num(&w, "t", bt_result_get_t(i));
+		jsonw_num(&w, "h", bt_result_get_h(i));
+		jsonw_num(&w, "rssi", bt_result_get_rssi(i));
+		jsonw_num(&w, "adv", bt_result_get_adv_rate(i));
+		jsonw_obj_close(&w);
+	}
+
+	conf_put(c);
+
+	jsonw_arr_close(&w);
+	jsonw_obj_close(&w);
+	esp_err_t err = ESP_FAIL;
+	if (jsonw_finish(&w) == 0) err = httpd_resp_send_chunk(req, NULL, 0);
+	stats_end(STATS_HTTP_CONF, begin);
+	return err;
+}
 
-		cJSON_AddNumberToObject(cli, "t", bt_result_get_t(i));
-		cJSON_AddNumberToObject(cli, "h", bt_result_get_h(i));
+static esp_err_t http_readings_handler(httpd_req_t *req)
+{
+	/* Taken before reading the values, a concurrent change only makes the tag stale */
+	char etag[40];
+	snprintf(etag, sizeof(etag), "\"%08lx-%lx-%lx\"", http_boot_id,
+			conf_version, bt_results_generation());
+
+	httpd_resp_set_hdr(req, "ETag", etag);
+	httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+	if (http_etag_match(req, etag)) {
+		httpd_resp_set_status(req, "304 Not Modified");
+		return httpd_resp_send(req, NULL, 0);
 	}
 
-	const char *str = cJSON_Print(root);
-	httpd_resp_sendstr(req, str);
-	free((void *)str);
-	cJSON_Delete(root);
-	return ESP_OK;
+	httpd_resp_set_type(req, "application/json");
+
+	struct jsonw w;
+	jsonw_init(&w, http_server_context.chunk, sizeof(http_server_context.chunk),
+			http_chunk_flush, req);
+	jsonw_arr_open(&w, NULL);
+
+	const struct conf *c = conf_get();
+	int i;
+	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
+		if (c->clients[i].addr == 0) continue;
+		jsonw_obj_open(&w, NULL);
+
+		char tmp[32];
+		snprintf(tmp, sizeof(tmp), "%012llx", c->clients[i].addr);
+		jsonw_str(&w, "addr", tmp);
+
+		jsonw_num(&w, "t", bt_result_get_t(i));
+		jsonw_num(&w, "h", bt_result_get_h(i));
+		jsonw_obj_close(&w);
+	}
+
+	conf_put(c);
+
+	jsonw_arr_close(&w);
+	if (jsonw_finish(&w)) return ESP_FAIL;
+	return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/* Sensors heard nearby that are not configured yet */
+static esp_err_t http_scan_handler(httpd_req_t *req)
+{
+	struct bt_scan_result res[BT_SCAN_SIZE];
+	const struct conf *c = conf_get();
+	int n = bt_scan_get(c, res, BT_SCAN_SIZE);
+	conf_put(c);
+
+	httpd_resp_set_type(req, "application/json");
+	httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+	struct jsonw w;
+	jsonw_init(&w, http_server_context.chunk, sizeof(http_server_context.chunk),
+			http_chunk_flush, req);
+	jsonw_arr_open(&w, NULL);
+
+	int i;
+	for (i=0; i<n; i++) {
+		jsonw_obj_open(&w, NULL);
+
+		char tmp[32];
+		snprintf(tmp, sizeof(tmp), "%012llx", res[i].addr);
+		jsonw_str(&w, "addr", tmp);
+
+		jsonw_num(&w, "t", res[i].t);
+		jsonw_num(&w, "h", res[i].h);
+		jsonw_int(&w, "rssi", res[i].rssi);
+		jsonw_int(&w, "age", res[i].age_s);
+		jsonw_obj_close(&w);
+	}
+
+	jsonw_arr_close(&w);
+	if (jsonw_finish(&w)) return ESP_FAIL;
+	return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/* Formats one sensor's current reading as a compact JSON message */
+static size_t http_ws_format(const struct conf *c, int i, char *buf, size_t size) {
+	char addr[16];
+	snprintf(addr, sizeof(addr), "%012llx", c->clients[i].addr);
+
+	struct jsonw w;
+	jsonw_init(&w, buf, size, NULL, NULL);
+	jsonw_obj_open(&w, NULL);
+	jsonw_str(&w, "addr", addr);
+	jsonw_num(&w, "t", bt_result_get_t(i));
+	jsonw_num(&w, "h", bt_result_get_h(i));
+	jsonw_num(&w, "rssi", bt_result_get_rssi(i));
+	jsonw_num(&w, "adv", bt_result_get_adv_rate(i));
+	jsonw_obj_close(&w);
+	if (w.err || w.depth != 0) return 0;
+	return w.len;
+}
+
+static void http_ws_send(int slot, char *msg, size_t len) {
+	int fd = http_ws_fds[slot];
+	if (httpd_ws_get_fd_info(http_server, fd) != HTTPD_WS_CLIENT_WEBSOCKET) {
+		http_ws_fds[slot] = -1;
+		return;
+	}
+
+	httpd_ws_frame_t frame = {
+		.final = true,
+		.type = HTTPD_WS_TYPE_TEXT,
+		.payload = (uint8_t *) msg,
+		.len = len,
+	};
+	if (httpd_ws_send_frame_async(http_server, fd, &frame) != ESP_OK) {
+		http_ws_fds[slot] = -1;
+	}
+}
+
+/* Runs on the httpd task: sends sensors in mask to clients (all if slot < 0) */
+static void http_ws_push_mask(int slot, const uint32_t mask[BT_DIRTY_WORDS]) {
+	char msg[160];
+	int i, n;
+	const struct conf *c = conf_get();
+	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
+		if (!(mask[i/32] & (1u << (i%32)))) continue;
+		if (c->clients[i].addr == 0) continue;
+
+		size_t len = http_ws_format(c, i, msg, sizeof(msg));
+		if (len == 0) continue;
+
+		for (n=0; n<HTTP_WS_MAX_CLIENTS; n++) {
+			if (slot >= 0 && n != slot) continue;
+			if (http_ws_fds[n] < 0) continue;
+			http_ws_send(n, msg, len);
+		}
+	}
+	conf_put(c);
+}
+
+static void http_ws_push(void *arg) {
+	http_ws_pending = 0;
+
+	uint32_t dirty[BT_DIRTY_WORDS];
+	bt_results_take_dirty(dirty);
+	http_ws_push_mask(-1, dirty);
+}
+
+static void http_ws_push_full(void *arg) {
+	int slot = (int)(intptr_t) arg;
+	uint32_t all[BT_DIRTY_WORDS];
+	memset(all, 0xFF, sizeof(all));
+	http_ws_push_mask(slot, all);
+}
+
+static void http_ws_timer_cb(void *arg) {
+	int c;
+	for (c=0; c<HTTP_WS_MAX_CLIENTS; c++) {
+		if (http_ws_fds[c] >= 0) break;
+	}
+	if (c == HTTP_WS_MAX_CLIENTS || http_ws_pending) return;
+
+	http_ws_pending = 1;
+	if (httpd_queue_work(http_server, http_ws_push, NULL) != ESP_OK)
+		http_ws_pending = 0;
 }
 
-static cJSON* http_post_json(httpd_req_t *req) {
-	int total_len = req->content_len;
-	int cur_len = 0;
-	int received = 0;
-	if (total_len >= SCRATCH_BUFSIZE) {
-		/* Respond with 500 Internal Server Error */
-		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Content too long");
-		return NULL;
+static esp_err_t http_ws_handler(httpd_req_t *req) {
+	if (req->method == HTTP_GET) {
+		int fd = httpd_req_to_sockfd(req);
+		int c;
+		for (c=0; c<HTTP_WS_MAX_CLIENTS; c++) {
+			if (http_ws_fds[c] < 0 ||
+					httpd_ws_get_fd_info(http_server, http_ws_fds[c]) != HTTPD_WS_CLIENT_WEBSOCKET) {
+				http_ws_fds[c] = fd;
+				// the handshake completes after we return, so send the snapshot later
+				httpd_queue_work(http_server, http_ws_push_full, (void *)(intptr_t) c);
+				return ESP_OK;
+			}
+		}
+		ESP_LOGW("HTTP", "Too many websocket clients");
+		return ESP_FAIL;
+	}
+
+	/* Nothing is expected from clients, just drain the frame */
+	httpd_ws_frame_t frame = { 0 };
+	esp_err_t err = httpd_ws_recv_frame(req, &frame, 0);
+	if (err != ESP_OK) return err;
+	while (frame.len > 0) {
+		uint8_t tmp[32];
+		size_t n = frame.len < sizeof(tmp) ? frame.len : sizeof(tmp);
+		frame.payload = tmp;
+		err = httpd_ws_recv_frame(req, &frame, n);
+		if (err != ESP_OK) return err;
+		frame.len -= n;
 	}
-	while (cur_len < total_len) {
-		received = httpd_req_recv(req, http_server_context.scratch + cur_len, total_len);
+	return ESP_OK;
+}
+
+/*
+ * Feeds the request body to the streaming JSON parser one scratch buffer at a
+ * time, so the body size is not limited by memory. The callback may store a
+ * reason in err before rejecting a value; it is sent back with the 400.
+ */
+static esp_err_t http_recv_json(httpd_req_t *req, jsonr_cb_t cb, void *ctx, const char *err) {
+	struct jsonr r;
+	jsonr_init(&r, cb, ctx);
+
+	size_t remaining = req->content_len;
+	int timeouts = 0;
+	while (remaining > 0) {
+		int received = httpd_req_recv(req, http_server_context.scratch,
+				MIN(remaining, sizeof(http_server_context.scratch)));
+		/* A stalled client would otherwise keep the only server task */
+		if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+			if (++timeouts < HTTP_RECV_RETRIES) continue;
+			httpd_resp_send_err(req, HTTPD_408_REQ_TIMEOUT, "Request timeout");
+			return ESP_FAIL;
+		}
+		timeouts = 0;
 		if (received <= 0) {
 			/* Respond with 500 Internal Server Error */
 			httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Internal error");
-			return NULL;
+			return ESP_FAIL;
 		}
-		cur_len += received;
+		remaining -= received;
+		/* The server discards whatever is left of the body */
+		if (jsonr_feed(&r, http_server_context.scratch, received)) break;
 	}
-	http_server_context.scratch[total_len] = '\0';
 
-	cJSON *root = cJSON_Parse(http_server_context.scratch);
-	if (root == NULL) {
-		httpd_resp_send_err(req,  HTTPD_400_BAD_REQUEST, "Invalid JSON");
-		return NULL;
+	if (jsonr_finish(&r)) {
+		httpd_resp_send_err(req,  HTTPD_400_BAD_REQUEST, err[0] != '\0' ? err : r.msg);
+		return ESP_FAIL;
 	}
+	return ESP_OK;
+}
+
+/* Copies a string value if it fits, returns nonzero otherwise */
+static int http_json_str(char *dst, size_t size, enum jsonr_type type, const char *val) {
+	if (type != JSONR_STR || strlen(val) >= size) return 1;
+	strcpy(dst, val);
+	return 0;
+}
 
-	return root;
+/* Parses a dotted IPv4 address, an empty string is 0 */
+static int http_json_ip(uint32_t *dst, enum jsonr_type type, const char *val) {
+	unsigned a, b, c, d;
+	char end;
+	if (type != JSONR_STR) return 1;
+	if (val[0] == '\0') {
+		*dst = 0;
+		return 0;
+	}
+	if (sscanf(val, "%u.%u.%u.%u%c", &a, &b, &c, &d, &end) != 4 ||
+			a > 255 || b > 255 || c > 255 || d > 255) return 1;
+	*dst = a | (b << 8) | (c << 16) | ((uint32_t) d << 24);
+	return 0;
 }
 
-static esp_err_t http_cjson_get_str(httpd_req_t *req, const cJSON *obj, const char *name, char *str, int maxlen) {
-	const cJSON *it = cJSON_GetObjectItemCaseSensitive(obj, name);
-	if (it == NULL) return ESP_OK;
+struct http_conf_parse {
+	struct conf *c;
+	int in_clients;
+	int n_clients;			// sensors stored so far
+	char err[40];
+};
 
-	if (cJSON_IsString(it)) { // includes NULL check
-		if (strlen(it->valuestring) < maxlen-1) {
-			strcpy(str, it->valuestring);
-			return ESP_OK;
-		}
+/* Parses a comma separated list of 16-bit hex UUIDs, e.g. "fe95,181a" */
+static int http_json_uuids(uint16_t *dst, int max, enum jsonr_type type, const char *val) {
+	if (type != JSONR_STR) return 1;
+	int n = 0;
+	while (*val != '\0') {
+		char *end;
+		unsigned long u = strtoul(val, &end, 16);
+		if (end == val || u == 0 || u > 0xFFFF || n >= max) return 1;
+		dst[n++] = u;
+		while (*end == ' ') end++;
+		if (*end == ',') end++;
+		else if (*end != '\0') return 1;
+		while (*end == ' ') end++;
+		val = end;
 	}
+	while (n < max) dst[n++] = 0;
+	return 0;
+}
 
-	char tmp[32];
-	snprintf(tmp, sizeof(tmp), "Invalid field %s", name);
-	httpd_resp_send_err(req,  HTTPD_400_BAD_REQUEST, tmp);
-	return ESP_FAIL;
+static int http_conf_reject(struct http_conf_parse *p, const char *field) {
+	snprintf(p->err, sizeof(p->err), "Invalid field %s", field);
+	return 1;
 }
 
-static esp_err_t http_cjson_get_num(httpd_req_t *req, const cJSON *obj, const char *name, int *ret) {
-	const cJSON *it = cJSON_GetObjectItemCaseSensitive(obj, name);
-	if (it == NULL) return ESP_OK;
+/* Applies one value of a PUT /api/conf.json body to the draft as it arrives */
+static int http_conf_field(void *ctx, int depth, enum jsonr_type type,
+		const char *key, const char *val) {
+	struct http_conf_parse *p = ctx;
+	struct conf *c = p->c;
 
-	if (cJSON_IsNumber(it)) { // includes NULL check
-		*ret = it->valueint;
-		return ESP_OK;
+	if (depth == 0) {
+		if (type == JSONR_OBJ || type == JSONR_END) return 0;
+		strcpy(p->err, "Invalid JSON");
+		return 1;
+	}
+
+	if (depth == 1) {
+		if (type == JSONR_END) {
+			p->in_clients = 0;
+		} else if (strcmp(key, "ifx_host") == 0) {
+			if (http_json_str(c->influx.host, sizeof(c->influx.host), type, val))
+				return http_conf_reject(p, key);
+		} else if (strcmp(key, "ifx_db") == 0) {
+			if (http_json_str(c->influx.db, sizeof(c->influx.db), type, val))
+				return http_conf_reject(p, key);
+		} else if (strcmp(key, "ifx_pfx") == 0) {
+			if (http_json_str(c->influx.pfx, sizeof(c->influx.pfx), type, val))
+				return http_conf_reject(p, key);
+		} else if (strcmp(key, "ifx_int") == 0) {
+			double v = type == JSONR_NUM ? strtod(val, NULL) : -1;
+			if (v < 0 || v > 0xFFFF) return http_conf_reject(p, key);
+			c->influx.interval_s = v;
+		} else if (strncmp(key, "net_", 4) == 0) {
+			uint32_t *a = NULL;
+			if (strcmp(key, "net_ip") == 0) a = &c->net.ip;
+			else if (strcmp(key, "net_gw") == 0) a = &c->net.gw;
+			else if (strcmp(key, "net_mask") == 0) a = &c->net.mask;
+			else if (strcmp(key, "net_dns") == 0) a = &c->net.dns;
+			if (a && http_json_ip(a, type, val)) return http_conf_reject(p, key);
+		} else if (strcmp(key, "pwr_low") == 0) {
+			if (type != JSONR_BOOL) return http_conf_reject(p, key);
+			c->power.low = val[0] == 't';
+		} else if (strcmp(key, "pwr_scan") == 0) {
+			double v = type == JSONR_NUM ? strtod(val, NULL) : -1;
+			if (v < 0 || v > 0xFF) return http_conf_reject(p, key);
+			c->power.scan_s = v;
+		} else if (strcmp(key, "gsp_on") == 0) {
+			if (type != JSONR_BOOL) return http_conf_reject(p, key);
+			c->gossip.on = val[0] == 't';
+		} else if (strcmp(key, "rly_mode") == 0) {
+			double v = type == JSONR_NUM ? strtod(val, NULL) : -1;
+			if (v < RELAY_OFF || v > RELAY_GATEWAY) return http_conf_reject(p, key);
+			c->relay.mode = v;
+		} else if (strcmp(key, "rly_chan") == 0) {
+			double v = type == JSONR_NUM ? strtod(val, NULL) : -1;
+			if (v < 0 || v > 13) return http_conf_reject(p, key);
+			c->relay.channel = v;
+		} else if (strcmp(key, "ifx_bin") == 0) {
+			if (type != JSONR_BOOL) return http_conf_reject(p, key);
+			c->bin.on = val[0] == 't';
+		} else if (strcmp(key, "ifx_bin_port") == 0) {
+			double v = type == JSONR_NUM ? strtod(val, NULL) : -1;
+			if (v < 0 || v > 0xFFFF) return http_conf_reject(p, key);
+			c->bin.port = v;
+		} else if (strcmp(key, "fwd_host") == 0) {
+			if (http_json_str(c->fwd.host, sizeof(c->fwd.host), type, val))
+				return http_conf_reject(p, key);
+		} else if (strcmp(key, "fwd_port") == 0 || strcmp(key, "fwd_rate") == 0) {
+			double v = type == JSONR_NUM ? strtod(val, NULL) : -1;
+			if (v < 0 || v > 0xFFFF) return http_conf_reject(p, key);
+			if (key[4] == 'p') c->fwd.port = v;
+			else c->fwd.rate_ms = v;
+		} else if (strcmp(key, "fwd_uuids") == 0) {
+			if (http_json_uuids(c->fwd.uuids, CONF_FWD_UUIDS, type, val))
+				return http_conf_reject(p, key);
+		} else if (strcmp(key, "log_host") == 0) {
+			if (http_json_str(c->syslog.host, sizeof(c->syslog.host), type, val))
+				return http_conf_reject(p, key);
+		} else if (strcmp(key, "log_port") == 0) {
+			double v = type == JSONR_NUM ? strtod(val, NULL) : -1;
+			if (v < 0 || v > 0xFFFF) return http_conf_reject(p, key);
+			c->syslog.port = v;
+		} else if (strcmp(key, "ifx_clients") == 0) {
+			if (type != JSONR_ARR) return http_conf_reject(p, "clients");
+			p->in_clients = 1;
+		}
+		return 0;
+	}
+
+	/* Unknown members are skipped with everything inside them */
+	if (!p->in_clients) return 0;
+
+	if (depth == 2) {
+		if (type == JSONR_END) {
+			p->n_clients++;
+			return 0;
+		}
+		if (type != JSONR_OBJ) return http_conf_reject(p, "clients");
+		if (p->n_clients >= CONF_MAX_IFX_CLIENTS) {
+			strcpy(p->err, "Too many clients");
+			return 1;
+		}
+		memset(&c->clients[p->n_clients], 0, sizeof(c->clients[0]));
+		return 0;
 	}
 
-	char tmp[32];
-	snprintf(tmp, sizeof(tmp), "Invalid field %s", name);
-	httpd_resp_send_err(req,  HTTPD_400_BAD_REQUEST, tmp);
-	return ESP_FAIL;
+	if (depth == 3) {
+		struct conf_influx_client *cli = &c->clients[p->n_clients];
+		if (strcmp(key, "name") == 0) {
+			if (http_json_str(cli->name, sizeof(cli->name), type, val))
+				return http_conf_reject(p, key);
+		} else if (strcmp(key, "addr") == 0) {
+			if (type != JSONR_STR) return http_conf_reject(p, key);
+			cli->addr = strtoull(val, NULL, 16);
+		}
+	}
+	return 0;
 }
 
+/*
+ * The body is parsed into a private copy, so other writers are not held up
+ * while it arrives. If one of them commits meanwhile, the request fails with
+ * 409 rather than undoing that change.
+ */
 static esp_err_t http_conf_put(httpd_req_t *req) {
-	cJSON *root = http_post_json(req);
-	if (root == NULL) return ESP_FAIL;
+	struct http_conf_parse p = { 0 };
+	p.c = malloc(sizeof(*p.c));
+	if (p.c == NULL) {
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+		return ESP_FAIL;
+	}
+	uint32_t ver = __atomic_load_n(&conf_version, __ATOMIC_ACQUIRE);
+	const struct conf *cur = conf_get();
+	*p.c = *cur;
+	conf_put(cur);
+
+	/* Values go straight into the copy, a bad body discards all of it */
+	if (http_recv_json(req, http_conf_field, &p, p.err) != ESP_OK) {
+		free(p.c);
+		return ESP_FAIL;
+	}
 
+	if (p.c->net.ip != 0 && p.c->net.mask == 0) {
+		free(p.c);
+		httpd_resp_send_err(req,  HTTPD_400_BAD_REQUEST, "Invalid field net_mask");
+		return ESP_FAIL;
+	}
 
-	esp_err_t err = http_cjson_get_str(req, root, "ifx_host", conf.influx.host, sizeof(conf.influx.host));
-	if (err != ESP_OK) return err;
+	int i;
+	for (i=p.n_clients; i<CONF_MAX_IFX_CLIENTS; i++) {
+		p.c->clients[i].name[0] = '\0';
+		p.c->clients[i].addr = 0;
+	}
 
-	err = http_cjson_get_str(req, root, "ifx_db", conf.influx.db, sizeof(conf.influx.db));
-	if (err != ESP_OK) return err;
+	struct conf *c = conf_edit();
+	if (__atomic_load_n(&conf_version, __ATOMIC_ACQUIRE) != ver) {
+		conf_abort(c);
+		free(p.c);
+		httpd_resp_set_status(req, "409 Conflict");
+		httpd_resp_sendstr(req, "Configuration changed, reload");
+		return ESP_OK;
+	}
+	*c = *p.c;
+	free(p.c);
+	conf_commit(c);
+	bt_results_clear();
+	httpd_resp_sendstr(req, "OK");
+	return ESP_OK;
+}
 
-	err = http_cjson_get_str(req, root, "ifx_pfx", conf.influx.pfx, sizeof(conf.influx.pfx));
-	if (err != ESP_OK) return err;
+/* Parses 12 hex digits of a sensor MAC, returns the number of characters used */
+static int http_addr_parse(const char *p, uint64_t *addr) {
+	int n = 0;
+	*addr = 0;
+	while (n < 12) {
+		char c = p[n];
+		int v;
+		if (c >= '0' && c <= '9') v = c - '0';
+		else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+		else break;
+		*addr = (*addr << 4) | v;
+		n++;
+	}
+	return n;
+}
 
-	int tmp = conf.influx.interval_s;
-	err = http_cjson_get_num(req, root, "ifx_int", &tmp);
-	if (err != ESP_OK) return err;
-	if (tmp < 0 || tmp > 0xFFFF) return ESP_FAIL;
-	conf.influx.interval_s = tmp;
-
-	int i = 0;
-	const cJSON *clients = cJSON_GetObjectItemCaseSensitive(root, "ifx_clients");
-	if (clients != NULL) {
-		if (!cJSON_IsArray(clients)) {
-			httpd_resp_send_err(req,  HTTPD_400_BAD_REQUEST, "Invalid field clients");
-			return ESP_FAIL;
-		}
+/* Parses the sensor MAC from /api/sensors/<mac> */
+static esp_err_t http_sensor_addr(httpd_req_t *req, uint64_t *addr) {
+	const char *p = req->uri + strlen("/api/sensors/");
+	int n = http_addr_parse(p, addr);
+	if (n != 12 || (p[n] != '\0' && p[n] != '?') || *addr == 0) {
+		httpd_resp_send_err(req,  HTTPD_400_BAD_REQUEST, "Invalid address");
+		return ESP_FAIL;
+	}
+	return ESP_OK;
+}
 
-		const cJSON *cli;
-		cJSON_ArrayForEach(cli, clients) {
-			if (i >= CONF_MAX_IFX_CLIENTS) {
-				httpd_resp_send_err(req,  HTTPD_400_BAD_REQUEST, "Too many clients");
-				return ESP_FAIL;
-			}
+static int http_sensor_find(const struct conf *c, uint64_t addr) {
+	int i;
+	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
+		if (c->clients[i].addr == addr) return i;
+	}
+	return -1;
+}
+
+struct http_sensor_parse {
+	char *name;
+	char err[24];
+};
 
-			err = http_cjson_get_str(req, cli, "name", conf.influx.clients[i].name, CONF_IFX_CLI_NAME_LEN);
-			if (err != ESP_OK) return err;
+static int http_sensor_field(void *ctx, int depth, enum jsonr_type type,
+		const char *key, const char *val) {
+	struct http_sensor_parse *p = ctx;
+	if (depth == 0) {
+		if (type == JSONR_OBJ || type == JSONR_END) return 0;
+		strcpy(p->err, "Invalid JSON");
+		return 1;
+	}
+	if (depth == 1 && strcmp(key, "name") == 0 &&
+			http_json_str(p->name, CONF_IFX_CLI_NAME_LEN, type, val)) {
+		strcpy(p->err, "Invalid field name");
+		return 1;
+	}
+	return 0;
+}
 
-			char tmp[32];
-			err = http_cjson_get_str(req, cli, "addr", tmp, sizeof(tmp));
-			if (err != ESP_OK) return err;
+/* Reads the mandatory "name" of a sensor request body */
+static esp_err_t http_sensor_name(httpd_req_t *req, char *name) {
+	struct http_sensor_parse p = { .name = name };
+	name[0] = '\0';
+	if (http_recv_json(req, http_sensor_field, &p, p.err) != ESP_OK) return ESP_FAIL;
+	if (name[0] == '\0') {
+		httpd_resp_send_err(req,  HTTPD_400_BAD_REQUEST, "Invalid field name");
+		return ESP_FAIL;
+	}
+	return ESP_OK;
+}
 
-			sscanf(tmp, "%llx", &conf.influx.clients[i].addr);
-			i++;
-		}
+/* POST /api/sensors/<mac> {"name": ...}: adds a sensor */
+static esp_err_t http_sensor_post(httpd_req_t *req) {
+	uint64_t addr;
+	char name[CONF_IFX_CLI_NAME_LEN];
+	if (http_sensor_addr(req, &addr) != ESP_OK) return ESP_FAIL;
+	if (http_sensor_name(req, name) != ESP_OK) return ESP_FAIL;
+
+	struct conf *c = conf_edit();
+	if (http_sensor_find(c, addr) >= 0) {
+		conf_abort(c);
+		httpd_resp_set_status(req, "409 Conflict");
+		httpd_resp_sendstr(req, "Sensor exists");
+		return ESP_OK;
 	}
+	int i = http_sensor_find(c, 0);
+	if (i < 0) {
+		conf_abort(c);
+		httpd_resp_send_err(req,  HTTPD_400_BAD_REQUEST, "Too many clients");
+		return ESP_FAIL;
+	}
+
+	strcpy(c->clients[i].name, name);
+	c->clients[i].addr = addr;
+	conf_commit(c);
+	bt_result_clear(i);
+	httpd_resp_sendstr(req, "OK");
+	return ESP_OK;
+}
 
-	for (; i<CONF_MAX_IFX_CLIENTS; i++) {
-		conf.influx.clients[i].name[0] = '\0';
-		conf.influx.clients[i].addr = 0;
+/* PATCH /api/sensors/<mac> {"name": ...}: renames a sensor */
+static esp_err_t http_sensor_patch(httpd_req_t *req) {
+	uint64_t addr;
+	char name[CONF_IFX_CLI_NAME_LEN];
+	if (http_sensor_addr(req, &addr) != ESP_OK) return ESP_FAIL;
+	if (http_sensor_name(req, name) != ESP_OK) return ESP_FAIL;
+
+	struct conf *c = conf_edit();
+	int i = http_sensor_find(c, addr);
+	if (i < 0) {
+		conf_abort(c);
+		httpd_resp_send_err(req,  HTTPD_404_NOT_FOUND, "No such sensor");
+		return ESP_FAIL;
 	}
 
-	bt_results_clear();
-	conf_store();
+	if (strcmp(name, c->clients[i].name) != 0) {
+		strcpy(c->clients[i].name, name);
+		conf_commit(c);
+	} else {
+		conf_abort(c);
+	}
+	httpd_resp_sendstr(req, "OK");
+	return ESP_OK;
+}
+
+/* DELETE /api/sensors/<mac>: removes a sensor */
+static esp_err_t http_sensor_delete(httpd_req_t *req) {
+	uint64_t addr;
+	if (http_sensor_addr(req, &addr) != ESP_OK) return ESP_FAIL;
+
+	struct conf *c = conf_edit();
+	int i = http_sensor_find(c, addr);
+	if (i < 0) {
+		conf_abort(c);
+		httpd_resp_send_err(req,  HTTPD_404_NOT_FOUND, "No such sensor");
+		return ESP_FAIL;
+	}
+
+	c->clients[i].addr = 0;
+	c->clients[i].name[0] = '\0';
+	conf_commit(c);
+	bt_result_clear(i);
 	httpd_resp_sendstr(req, "OK");
 	return ESP_OK;
 }
 
+static float http_hist_val(int16_t v) {
+	return v == HISTORY_NONE ? NAN : v / 10.0f;
+}
+
+/*
+ * GET /api/history?mac=<mac>&points=<n>[&fmt=bin]: recent readings of a
+ * sensor as min/max buckets, oldest first. The binary form is a header of
+ * bucket_s, age_s (uint32) and count (uint16, plus 2 reserved bytes) followed
+ * by count times t_min, t_max, h_min, h_max as int16 in 0.1 units, all little
+ * endian; -32768 marks buckets without readings.
+ */
+static esp_err_t http_history_handler(httpd_req_t *req)
+{
+	char query[64], val[16];
+	uint64_t addr = 0;
+	int points = 100, bin = 0;
+	if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+		if (httpd_query_key_value(query, "mac", val, sizeof(val)) == ESP_OK &&
+				(http_addr_parse(val, &addr) != 12 || val[12] != '\0')) addr = 0;
+		if (httpd_query_key_value(query, "points", val, sizeof(val)) == ESP_OK)
+			points = atoi(val);
+		if (httpd_query_key_value(query, "fmt", val, sizeof(val)) == ESP_OK)
+			bin = strcmp(val, "bin") == 0;
+	}
+	if (addr == 0) {
+		httpd_resp_send_err(req,  HTTPD_400_BAD_REQUEST, "Invalid address");
+		return ESP_FAIL;
+	}
+	if (points < 1) points = 1;
+	if (points > HISTORY_LEN) points = HISTORY_LEN;
+
+	struct history_bucket *b = http_server_context.hist;
+	uint32_t bucket_s = HISTORY_STEP_S, age_s = 0;
+	int n = history_get(addr, b, points, &bucket_s, &age_s);
+
+	httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+	if (bin) {
+		/* Both the ESP32 and the wire format are little endian */
+		struct {
+			uint32_t bucket_s;
+			uint32_t age_s;
+			uint16_t count;
+			uint16_t reserved;
+		} hdr = { bucket_s, age_s, n, 0 };
+		_Static_assert(sizeof(hdr) == 12, "history header must be packed");
+		_Static_assert(sizeof(struct history_bucket) == 8, "history bucket must be packed");
+
+		httpd_resp_set_type(req, "application/octet-stream");
+		if (httpd_resp_send_chunk(req, (const char *) &hdr, sizeof(hdr)) != ESP_OK) return ESP_FAIL;
+		if (httpd_resp_send_chunk(req, (const char *) b, n * sizeof(*b)) != ESP_OK) return ESP_FAIL;
+		return httpd_resp_send_chunk(req, NULL, 0);
+	}
+
+	httpd_resp_set_type(req, "application/json");
+
+	struct jsonw w;
+	jsonw_init(&w, http_server_context.chunk, sizeof(http_server_context.chunk),
+			http_chunk_flush, req);
+	jsonw_obj_open(&w, NULL);
+	jsonw_int(&w, "bucket", bucket_s);
+	jsonw_int(&w, "age", age_s);
+
+	/* [[min, max], ...] per quantity */
+	int i;
+	jsonw_arr_open(&w, "t");
+	for (i=0; i<n; i++) {
+		jsonw_arr_open(&w, NULL);
+		jsonw_num(&w, NULL, http_hist_val(b[i].t_min));
+		jsonw_num(&w, NULL, http_hist_val(b[i].t_max));
+		jsonw_arr_close(&w);
+	}
+	jsonw_arr_close(&w);
+	jsonw_arr_open(&w, "h");
+	for (i=0; i<n; i++) {
+		jsonw_arr_open(&w, NULL);
+		jsonw_num(&w, NULL, http_hist_val(b[i].h_min));
+		jsonw_num(&w, NULL, http_hist_val(b[i].h_max));
+		jsonw_arr_close(&w);
+	}
+	jsonw_arr_close(&w);
+
+	jsonw_obj_close(&w);
+	if (jsonw_finish(&w)) return ESP_FAIL;
+	return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/* Latency histograms, see stats.h; buckets are counts per log2 microsecond range */
+static esp_err_t http_stats_handler(httpd_req_t *req) {
+	httpd_resp_set_type(req, "application/json");
+	httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+	struct jsonw w;
+	jsonw_init(&w, http_server_context.chunk, sizeof(http_server_context.chunk),
+			http_chunk_flush, req);
+	jsonw_obj_open(&w, NULL);
+
+	int id, i;
+	for (id=0; id<STATS_COUNT; id++) {
+		struct stats_hist h;
+		stats_get(id, &h);
+		jsonw_obj_open(&w, stats_name(id));
+		jsonw_int(&w, "n", h.count);
+		jsonw_int(&w, "p50", stats_pct(&h, 50));
+		jsonw_int(&w, "p90", stats_pct(&h, 90));
+		jsonw_int(&w, "p99", stats_pct(&h, 99));
+		jsonw_int(&w, "max", h.max_us);
+		jsonw_arr_open(&w, "buckets");
+		for (i=0; i<STATS_BUCKETS; i++) jsonw_int(&w, NULL, h.bucket[i]);
+		jsonw_arr_close(&w);
+		jsonw_obj_close(&w);
+	}
+
+	jsonw_obj_close(&w);
+	if (jsonw_finish(&w)) return ESP_FAIL;
+	return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static esp_err_t http_stats_delete(httpd_req_t *req) {
+	stats_reset();
+	httpd_resp_set_status(req, "204 No Content");
+	return httpd_resp_send(req, NULL, 0);
+}
+
 static const httpd_uri_t http_uris[] = {
 	{
 		.uri = "/",
 		.method = HTTP_GET,
-		.handler = http_index_html_handler,
+		.handler = http_asset_handler,
+		.user_ctx = (void *) &http_index_html,
 	}, {
 		.uri = "/conf.html",
 		.method = HTTP_GET,
-		.handler = http_conf_html_handler,
+		.handler = http_asset_handler,
+		.user_ctx = (void *) &http_conf_html,
 	}, {
 		.uri = "/main.css",
 		.method = HTTP_GET,
-		.handler = http_main_css_handler,
+		.handler = http_asset_handler,
+		.user_ctx = (void *) &http_main_css,
 	}, {
 		.uri = "/main.js",
 		.method = HTTP_GET,
-		.handler = http_main_js_handler,
+		.handler = http_asset_handler,
+		.user_ctx = (void *) &http_main_js,
 	}, {
 		.uri = "/api/conf.json",
 		.method = HTTP_GET,
@@ -258,18 +948,71 @@ static const httpd_uri_t http_uris[] = {
 		.uri = "/api/conf.json",
 		.method = HTTP_PUT,
 		.handler = http_conf_put,
+	}, {
+		.uri = "/api/sensors/*",
+		.method = HTTP_POST,
+		.handler = http_sensor_post,
+	}, {
+		.uri = "/api/sensors/*",
+		.method = HTTP_PATCH,
+		.handler = http_sensor_patch,
+	}, {
+		.uri = "/api/sensors/*",
+		.method = HTTP_DELETE,
+		.handler = http_sensor_delete,
+	}, {
+		.uri = "/api/scan.json",
+		.method = HTTP_GET,
+		.handler = http_scan_handler,
+	}, {
+		.uri = "/api/history",
+		.method = HTTP_GET,
+		.handler = http_history_handler,
+	}, {
+		.uri = "/api/readings.json",
+		.method = HTTP_GET,
+		.handler = http_readings_handler,
+	}, {
+		.uri = "/api/stats.json",
+		.method = HTTP_GET,
+		.handler = http_stats_handler,
+	}, {
+		.uri = "/api/stats.json",
+		.method = HTTP_DELETE,
+		.handler = http_stats_delete,
+	}, {
+		.uri = "/api/live",
+		.method = HTTP_GET,
+		.handler = http_ws_handler,
+		.is_websocket = true,
 	}, {}
 };
 
 void http_init() {
-	httpd_handle_t server = NULL;
 	httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+	config.max_uri_handlers = sizeof(http_uris) / sizeof(http_uris[0]) - 1;
+	config.uri_match_fn = httpd_uri_match_wildcard;
+	config.stack_size = task_layout[TASK_HTTPD].stack;
+	config.task_priority = task_layout[TASK_HTTPD].prio;
+	config.core_id = task_layout[TASK_HTTPD].core;
+
+	int c;
+	for (c=0; c<HTTP_WS_MAX_CLIENTS; c++) http_ws_fds[c] = -1;
+	http_boot_id = esp_random();
 
 	ESP_LOGI("HTTP", "Starting HTTP Server");
-	ESP_ERROR_CHECK(httpd_start(&server, &config));
+	ESP_ERROR_CHECK(httpd_start(&http_server, &config));
 
 	const httpd_uri_t *u = http_uris;
 	while (u->handler) {
-		httpd_register_uri_handler(server, u++);
+		httpd_register_uri_handler(http_server, u++);
 	}
+
+	const esp_timer_create_args_t timer_args = {
+		.callback = http_ws_timer_cb,
+		.name = "ws_push",
+	};
+	esp_timer_handle_t timer;
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer));
+	ESP_ERROR_CHECK(esp_timer_start_periodic(timer, HTTP_WS_PERIOD_MS * 1000));
 }
@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+#
+# pack.py
+#
+# Build-time packing of the embedded web assets: concatenates the parts of
+# each asset, gzips it and emits a header with a content-derived ETag.
+#
+# Usage: pack.py <outdir> <name>=<part>[+<part>...] ...
+#
+# Copyright 2019 Anti Sullin
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import gzip
+import hashlib
+import os
+import re
+import sys
+
+
+def main():
+    outdir = sys.argv[1]
+    os.makedirs(outdir, exist_ok=True)
+
+    defs = []
+    for arg in sys.argv[2:]:
+        name, parts = arg.split('=', 1)
+        data = b''
+        for part in parts.split('+'):
+            with open(part, 'rb') as f:
+                data += f.read()
+
+        # mtime=0 keeps the output reproducible so the ETag only follows content
+        gz = gzip.compress(data, 9, mtime=0)
+        with open(os.path.join(outdir, name + '.gz'), 'wb') as f:
+            f.write(gz)
+
+        sym = re.sub(r'[^A-Za-z0-9]', '_', name).upper()
+        etag = hashlib.sha256(gz).hexdigest()[:16]
+        defs.append('#define HTTP_ETAG_%s "\\"%s\\""\n' % (sym, etag))
+
+    hdr = ('/* Generated by pack.py, do not edit */\n'
+           '#ifndef HTTP_ASSETS_H_\n#define HTTP_ASSETS_H_\n\n' +
+           ''.join(defs) +
+           '\n#endif /* HTTP_ASSETS_H_ */\n')
+
+    with open(os.path.join(outdir, 'http_assets.h'), 'w') as f:
+        f.write(hdr)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,212 @@
+/*
+ * ifxbin.c
+ *
+ * Compact binary alternative to the line protocol reports
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Instead of repeating the database, MAC and name of every sensor in every
+ * point, the proxy announces its sensor table now and then and refers to the
+ * sensors by index in between. tools/ifxbin_recv.py expands the frames back
+ * to the line protocol influx.c would have sent.
+ *
+ * Every datagram starts with, multi-byte fields little endian:
+ *   'H' 'B' version type proxy_mac[6] table(u32)
+ * table is a CRC of the announced settings; the receiver drops data frames
+ * of a table it has not seen announced.
+ *
+ * IFXBIN_ANNOUNCE, split over several datagrams if needed:
+ *   db_len db pfx_len pfx n, n times: index mac[6] name_len name
+ * IFXBIN_DATA, one per poll cycle:
+ *   time(u32, unix s, 0 if unknown) n, n times:
+ *   index flags t(i16, 0.1 degC) h(u16, 0.1 %) rssi(i8) adv_rate(u8)
+ */
+
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+//#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_mac.h"
+#include "esp_rom_crc.h"
+#include "conf.h"
+#include "influx.h"
+#include "spool.h"
+#include "ifxbin.h"
+
+#define IFXBIN_VERSION		1
+#define IFXBIN_ANNOUNCE		1
+#define IFXBIN_DATA			2
+#define IFXBIN_HDR_LEN		14
+#define IFXBIN_DATA_HDR		5
+#define IFXBIN_ENTRY_LEN	8
+#define IFXBIN_BUF_LEN		1400
+#define IFXBIN_ANNOUNCE_S	60
+#define IFXBIN_TIME_VALID	1577836800	// 2020-01-01, earlier means no SNTP yet
+
+#define IFXBIN_F_T			0x01
+#define IFXBIN_F_H			0x02
+#define IFXBIN_F_RSSI		0x04
+
+/* Readings of the current poll cycle, kept to spool them if sending fails */
+static struct {
+	uint64_t addr;
+	float t;
+	float h;
+} ifxbin_pend[CONF_MAX_IFX_CLIENTS];
+static int ifxbin_n;
+
+static uint8_t ifxbin_data[IFXBIN_HDR_LEN + IFXBIN_DATA_HDR +
+		CONF_MAX_IFX_CLIENTS * IFXBIN_ENTRY_LEN];
+static uint8_t ifxbin_buf[IFXBIN_BUF_LEN];
+
+_Static_assert(CONF_MAX_IFX_CLIENTS <= 255, "sensor index and count are one byte");
+
+static uint32_t ifxbin_table;		// last announced, valid if ifxbin_announced != 0
+static TickType_t ifxbin_announced;
+
+static void ifxbin_le16(uint8_t *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static int ifxbin_hdr(uint8_t *b, uint8_t type, const uint8_t *mac, uint32_t table) {
+	b[0] = 'H';
+	b[1] = 'B';
+	b[2] = IFXBIN_VERSION;
+	b[3] = type;
+	memcpy(b + 4, mac, 6);
+	ifxbin_le16(b + 10, table);
+	ifxbin_le16(b + 12, table >> 16);
+	return IFXBIN_HDR_LEN;
+}
+
+static uint32_t ifxbin_table_id(const struct conf *c) {
+	uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *) c->influx.db, sizeof(c->influx.db));
+	crc = esp_rom_crc32_le(crc, (const uint8_t *) c->influx.pfx, sizeof(c->influx.pfx));
+	return esp_rom_crc32_le(crc, (const uint8_t *) c->clients, sizeof(c->clients));
+}
+
+static int ifxbin_put_str(uint8_t *b, int len, const char *s, size_t size) {
+	int n = strnlen(s, size);
+	b[len++] = n;
+	memcpy(b + len, s, n);
+	return len + n;
+}
+
+/*
+ * Returns nonzero if some part of the table could not be sent. The
+ * configuration is pinned per datagram and never while sending; if it
+ * changed in between, the table is stale and the announce is given up.
+ */
+static int ifxbin_announce(const uint8_t *mac, uint32_t table, uint16_t port) {
+	int i = 0;
+	do {
+		const struct conf *c = conf_get();
+		if (ifxbin_table_id(c) != table) {
+			conf_put(c);
+			return -1;
+		}
+		uint8_t *b = ifxbin_buf;
+		int len = ifxbin_hdr(b, IFXBIN_ANNOUNCE, mac, table);
+		len = ifxbin_put_str(b, len, c->influx.db, sizeof(c->influx.db));
+		len = ifxbin_put_str(b, len, c->influx.pfx, sizeof(c->influx.pfx));
+		int n_ofs = len++;
+		int n = 0;
+		for (; i<CONF_MAX_IFX_CLIENTS; i++) {
+			const struct conf_influx_client *cli = &c->clients[i];
+			if (cli->addr == 0 || cli->name[0] == '\0') continue;
+			if (len + 8 + CONF_IFX_CLI_NAME_LEN > IFXBIN_BUF_LEN) break;
+			b[len++] = i;
+			int k;
+			for (k=0; k<6; k++) b[len++] = cli->addr >> (40 - 8*k);
+			len = ifxbin_put_str(b, len, cli->name, sizeof(cli->name));
+			n++;
+		}
+		b[n_ofs] = n;
+		uint32_t dest = influx_dest(c);
+		conf_put(c);
+		if (influx_send_bin(dest, b, len, port)) return -1;
+	} while (i < CONF_MAX_IFX_CLIENTS);
+	return 0;
+}
+
+void ifxbin_add(int i, uint64_t addr, float t, float h, float rssi, int adv_rate) {
+	if (isnan(t) && isnan(h)) return;
+	if (ifxbin_n >= CONF_MAX_IFX_CLIENTS) return;
+
+	uint8_t *p = ifxbin_data + IFXBIN_HDR_LEN + IFXBIN_DATA_HDR + ifxbin_n * IFXBIN_ENTRY_LEN;
+	p[0] = i;
+	p[1] = (isnan(t) ? 0 : IFXBIN_F_T) | (isnan(h) ? 0 : IFXBIN_F_H) |
+			(isnan(rssi) ? 0 : IFXBIN_F_RSSI);
+	ifxbin_le16(p + 2, isnan(t) ? 0 : (int16_t) lroundf(t * 10));
+	ifxbin_le16(p + 4, isnan(h) ? 0 : (uint16_t) lroundf(h * 10));
+	p[6] = isnan(rssi) ? 0 : (int8_t) lroundf(rssi);
+	p[7] = adv_rate > UINT8_MAX ? UINT8_MAX : adv_rate;
+
+	ifxbin_pend[ifxbin_n].addr = addr;
+	ifxbin_pend[ifxbin_n].t = t;
+	ifxbin_pend[ifxbin_n].h = h;
+	ifxbin_n++;
+}
+
+/* Sends the readings of this poll cycle, spooling them if that fails */
+void ifxbin_flush() {
+	if (ifxbin_n == 0) return;
+
+	uint8_t mac[6];
+	esp_read_mac(mac, ESP_MAC_WIFI_STA);
+	TickType_t now = xTaskGetTickCount();
+
+	const struct conf *c = conf_get();
+	uint16_t port = c->bin.port ? c->bin.port : IFXBIN_PORT_DEFAULT;
+	uint32_t table = ifxbin_table_id(c);
+	uint32_t dest = influx_dest(c);
+	conf_put(c);
+
+	int err = 0;
+	if (ifxbin_announced == 0 || table != ifxbin_table ||
+			now - ifxbin_announced >= IFXBIN_ANNOUNCE_S * 1000 / portTICK_PERIOD_MS) {
+		err = ifxbin_announce(mac, table, port);
+		if (!err) {
+			ifxbin_table = table;
+			ifxbin_announced = now | 1;
+		}
+	}
+
+	if (!err) {
+		time_t t = time(NULL);
+		uint8_t *b = ifxbin_data;
+		int len = ifxbin_hdr(b, IFXBIN_DATA, mac, table);
+		uint32_t ts = t >= IFXBIN_TIME_VALID ? t : 0;
+		ifxbin_le16(b + len, ts);
+		ifxbin_le16(b + len + 2, ts >> 16);
+		b[len + 4] = ifxbin_n;
+		len += IFXBIN_DATA_HDR + ifxbin_n * IFXBIN_ENTRY_LEN;
+		err = influx_send_bin(dest, b, len, port);
+	}
+
+	if (err) {
+		int i;
+		for (i=0; i<ifxbin_n; i++) spool_add(ifxbin_pend[i].addr, ifxbin_pend[i].t, ifxbin_pend[i].h);
+	}
+	ifxbin_n = 0;
+}
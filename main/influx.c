@@ -29,12 +29,19 @@
 #include "lwip/sys.h"
 #include "lwip/netdb.h"
 #include "esp_bt_defs.h"
+#include "esp_mac.h"
 #include "conf.h"
 #include "influx.h"
+#include "wifi.h"
+#include "stats.h"
 
 #define PORT			8089
 
-char buf[128];
+#define INFLUX_LINE		256
+
+static char proxy_buf[640];		// poller task only
+
+static uint32_t influx_send_errors;
 
 static int influx_escape(char *b, int len, const char *s) {
 	while (*s != '\0') {
@@ -54,64 +61,159 @@ static int influx_escape(char *b, int len, const char *s) {
 	return 0;
 }
 
-static void influx_send(const char *buf) {
-	ESP_LOGV("IFX", "Send: [%s]", buf);
+/*
+ * Address of the Influx host, INADDR_NONE if it does not parse. Resolved
+ * while the configuration is pinned, so the pin is released before sending.
+ */
+uint32_t influx_dest(const struct conf *c) {
+	return inet_addr(c->influx.host);
+}
 
+/* Returns nonzero if the datagram could not be sent */
+static int influx_send_to(uint32_t dest, const void *buf, size_t len, uint16_t port) {
+	uint32_t begin = stats_begin();
 	struct sockaddr_in dest_addr;
 	int addr_family;
 	int ip_protocol;
+	int res = -1;
 
-	dest_addr.sin_addr.s_addr = inet_addr(conf.influx.host);
+	dest_addr.sin_addr.s_addr = dest;
 	if (dest_addr.sin_addr.s_addr == INADDR_NONE) {
-		ESP_LOGE("IFX", "Unable to parse address %s", conf.influx.host);
-		return;
+		ESP_LOGE("IFX", "Unable to parse the Influx host address");
+		influx_send_errors++;
+		goto out;
 	}
 	dest_addr.sin_family = AF_INET;
-	dest_addr.sin_port = htons(PORT);
+	dest_addr.sin_port = htons(port);
 	addr_family = AF_INET;
 	ip_protocol = IPPROTO_IP;
 
 	int sock = socket(addr_family, SOCK_DGRAM, ip_protocol);
 	if (sock < 0) {
 		ESP_LOGE("IFX", "Unable to create socket: errno %d", errno);
-		return;
+		influx_send_errors++;
+		goto out;
 	}
 
-	int err = sendto(sock, buf, strlen(buf), 0,
+	int err = sendto(sock, buf, len, 0,
 			(struct sockaddr *)&dest_addr, sizeof(dest_addr));
 	if (err < 0) {
 		ESP_LOGE("IFX", "Unable to send data");
+		influx_send_errors++;
+	} else {
+		wifi_report_sent();
 	}
 	close(sock);
+	res = err < 0;
+out:
+	/* Failures are timed too, they are the slow cases */
+	stats_end(STATS_INFLUX_SEND, begin);
+	return res;
+}
+
+static int influx_send(uint32_t dest, const char *buf, int len) {
+	ESP_LOGV("IFX", "Send: [%s]", buf);
+	return influx_send_to(dest, buf, len, PORT);
 }
 
-void influx_report(esp_bd_addr_t sensor, const char *name, float temp, float hyg) {
+/* Sends a binary frame to the Influx host, see ifxbin.c */
+int influx_send_bin(uint32_t dest, const void *buf, size_t len, uint16_t port) {
+	return influx_send_to(dest, buf, len, port);
+}
+
+/*
+ * Formats a reading into buf, returns its length or 0 if there is nothing
+ * to send. time is the unix time of the reading, 0 to let the server
+ * assign it.
+ */
+static int influx_format(const struct conf *c, char *buf, size_t size, esp_bd_addr_t sensor,
+		const char *name, float temp, float hyg, float rssi, int adv_rate, uint32_t time) {
 	char namebuf[32];
-	if (isnan(temp) && isnan(hyg)) return;
-	if (influx_escape(namebuf, sizeof(namebuf), name)) return;
+	if (isnan(temp) && isnan(hyg)) return 0;
+	if (influx_escape(namebuf, sizeof(namebuf), name)) return 0;
 
 	const char* spacer = "";
-	if (conf.influx.pfx[0] != '\0') {
+	if (c->influx.pfx[0] != '\0') {
 		spacer = ",";
 	}
 
-	int len = snprintf(buf, sizeof(buf), "%s,type=bt,id=%02x%02x%02x%02x%02x%02x,name=%s%s%s ",
-			conf.influx.db,
+	int len = snprintf(buf, size, "%s,type=bt,id=%02x%02x%02x%02x%02x%02x,name=%s%s%s ",
+			c->influx.db,
 			sensor[0], sensor[1], sensor[2], sensor[3],
 			sensor[4], sensor[5],
-			name, spacer, conf.influx.pfx);
-	if (len >= sizeof(buf)) return;
+			namebuf, spacer, c->influx.pfx);
+	if (len >= (int) size) return 0;
 
 	const char *sep="";
 	if (!isnan(temp)) {
-		len += snprintf(buf+len, sizeof(buf)-len, "temperature=%.1f", temp);
-		if (len >= sizeof(buf)) return;
+		len += snprintf(buf+len, size-len, "temperature=%.1f", temp);
+		if (len >= (int) size) return 0;
 		sep=",";
 	}
-	if (!isnan(temp)) {
-		len += snprintf(buf+len, sizeof(buf)-len, "%shumidity=%.1f", sep, hyg);
-		if (len >= sizeof(buf)) return;
+	if (!isnan(hyg)) {
+		len += snprintf(buf+len, size-len, "%shumidity=%.1f", sep, hyg);
+		if (len >= (int) size) return 0;
+		sep=",";
+	}
+	if (!isnan(rssi)) {
+		len += snprintf(buf+len, size-len, "%srssi=%.1f,adv_rate=%di", sep, rssi, adv_rate);
+		if (len >= (int) size) return 0;
+	}
+	if (time != 0) {
+		/* UDP listeners default to nanosecond precision */
+		len += snprintf(buf+len, size-len, " %lu000000000", (unsigned long) time);
+		if (len >= (int) size) return 0;
 	}
+	return len;
+}
+
+static int influx_format_proxy(const struct conf *c, const char *fields) {
+	uint8_t mac[6];
+	esp_read_mac(mac, ESP_MAC_WIFI_STA);
+
+	const char* spacer = "";
+	if (c->influx.pfx[0] != '\0') {
+		spacer = ",";
+	}
+
+	int len = snprintf(proxy_buf, sizeof(proxy_buf), "%s,type=proxy,id=%02x%02x%02x%02x%02x%02x%s%s %s",
+			c->influx.db,
+			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+			spacer, c->influx.pfx, fields);
+	return len < (int) sizeof(proxy_buf) ? len : 0;
+}
+
+/* The pin is only held to format the line, not while it is sent */
+static int influx_report_time(esp_bd_addr_t sensor, const char *name, float temp, float hyg,
+		float rssi, int adv_rate, uint32_t time) {
+	char line[INFLUX_LINE];
+	const struct conf *c = conf_get();
+	int len = influx_format(c, line, sizeof(line), sensor, name, temp, hyg, rssi, adv_rate, time);
+	uint32_t dest = influx_dest(c);
+	conf_put(c);
+	return len ? influx_send(dest, line, len) : 0;
+}
+
+/* Returns nonzero if the reading could not be sent */
+int influx_report(esp_bd_addr_t sensor, const char *name, float temp, float hyg,
+		float rssi, int adv_rate) {
+	return influx_report_time(sensor, name, temp, hyg, rssi, adv_rate, 0);
+}
+
+/* Reports an earlier reading with its original time */
+int influx_report_at(esp_bd_addr_t sensor, const char *name, float temp, float hyg,
+		uint32_t time) {
+	return influx_report_time(sensor, name, temp, hyg, NAN, 0, time);
+}
+
+void influx_report_proxy(const char *fields) {
+	const struct conf *c = conf_get();
+	int len = influx_format_proxy(c, fields);
+	uint32_t dest = influx_dest(c);
+	conf_put(c);
+	if (len) influx_send(dest, proxy_buf, len);
+}
 
-	influx_send(buf);
+uint32_t influx_get_send_errors() {
+	return influx_send_errors;
 }
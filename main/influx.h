@@ -21,9 +21,19 @@
 #ifndef MAIN_INFLUX_H_
 #define MAIN_INFLUX_H_
 
+#include <stdint.h>
+#include <stddef.h>
 #include "esp_bt_defs.h"
+#include "conf.h"
 
-void influx_report(esp_bd_addr_t sensor, const char *name, float temp, float hyg);
+int influx_report(esp_bd_addr_t sensor, const char *name, float temp, float hyg,
+		float rssi, int adv_rate);
+int influx_report_at(esp_bd_addr_t sensor, const char *name, float temp, float hyg,
+		uint32_t time);
+void influx_report_proxy(const char *fields);
+uint32_t influx_dest(const struct conf *c);
+int influx_send_bin(uint32_t dest, const void *buf, size_t len, uint16_t port);
+uint32_t influx_get_send_errors();
 
 
 #endif /* MAIN_INFLUX_H_ */
@@ -0,0 +1,465 @@
+/*
+ * json.c
+ *
+ * Streaming JSON writer and reader
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "json.h"
+
+void jsonw_init(struct jsonw *w, char *buf, size_t size, jsonw_flush_t flush, void *ctx) {
+	memset(w, 0, sizeof(*w));
+	w->buf = buf;
+	w->size = size;
+	w->flush = flush;
+	w->ctx = ctx;
+}
+
+static void jsonw_drain(struct jsonw *w) {
+	if (w->len == 0 || w->err) return;
+	if (w->flush == NULL || w->flush(w->ctx, w->buf, w->len)) w->err = 1;
+	w->len = 0;
+}
+
+static void jsonw_write(struct jsonw *w, const char *s, size_t len) {
+	while (len > 0 && !w->err) {
+		if (w->len == w->size) jsonw_drain(w);
+		size_t n = w->size - w->len;
+		if (n > len) n = len;
+		memcpy(w->buf + w->len, s, n);
+		w->len += n;
+		s += n;
+		len -= n;
+	}
+}
+
+static void jsonw_putc(struct jsonw *w, char c) {
+	jsonw_write(w, &c, 1);
+}
+
+/* Same escaping rules as cJSON */
+static void jsonw_string(struct jsonw *w, const char *s) {
+	jsonw_putc(w, '"');
+	const char *run = s;
+	for (; *s != '\0'; s++) {
+		unsigned char c = *s;
+		if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+		jsonw_write(w, run, s - run);
+		run = s + 1;
+
+		char esc[8];
+		switch (c) {
+		case '"':  strcpy(esc, "\\\""); break;
+		case '\\': strcpy(esc, "\\\\"); break;
+		case '\b': strcpy(esc, "\\b"); break;
+		case '\f': strcpy(esc, "\\f"); break;
+		case '\n': strcpy(esc, "\\n"); break;
+		case '\r': strcpy(esc, "\\r"); break;
+		case '\t': strcpy(esc, "\\t"); break;
+		default: snprintf(esc, sizeof(esc), "\\u%04x", c); break;
+		}
+		jsonw_write(w, esc, strlen(esc));
+	}
+	jsonw_write(w, run, s - run);
+	jsonw_putc(w, '"');
+}
+
+/* Separator and key of the next member */
+static void jsonw_member(struct jsonw *w, const char *key) {
+	uint32_t bit = 1u << w->depth;
+	if (w->nonempty & bit) jsonw_putc(w, ',');
+	w->nonempty |= bit;
+	if (key) {
+		jsonw_string(w, key);
+		jsonw_putc(w, ':');
+	}
+}
+
+static void jsonw_open(struct jsonw *w, const char *key, char c) {
+	jsonw_member(w, key);
+	jsonw_putc(w, c);
+	if (w->depth + 1 >= JSONW_MAX_DEPTH) {
+		w->err = 1;
+		return;
+	}
+	w->depth++;
+	w->nonempty &= ~(1u << w->depth);
+}
+
+static void jsonw_close(struct jsonw *w, char c) {
+	if (w->depth == 0) {
+		w->err = 1;
+		return;
+	}
+	w->depth--;
+	jsonw_putc(w, c);
+}
+
+void jsonw_obj_open(struct jsonw *w, const char *key) {
+	jsonw_open(w, key, '{');
+}
+
+void jsonw_obj_close(struct jsonw *w) {
+	jsonw_close(w, '}');
+}
+
+void jsonw_arr_open(struct jsonw *w, const char *key) {
+	jsonw_open(w, key, '[');
+}
+
+void jsonw_arr_close(struct jsonw *w) {
+	jsonw_close(w, ']');
+}
+
+void jsonw_str(struct jsonw *w, const char *key, const char *val) {
+	jsonw_member(w, key);
+	jsonw_string(w, val ? val : "");
+}
+
+/* cJSON takes %1.15g if it reads back within rounding error */
+static int jsonw_same(double a, double b) {
+	double max = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
+	return fabs(a - b) <= max * DBL_EPSILON;
+}
+
+/* Same number formatting as cJSON, NaN and infinities become null */
+void jsonw_num(struct jsonw *w, const char *key, double val) {
+	char tmp[32];
+	jsonw_member(w, key);
+
+	if (isnan(val) || isinf(val)) {
+		strcpy(tmp, "null");
+	} else if (fabs(val) < INT32_MAX && val == (double)(int)val) {
+		snprintf(tmp, sizeof(tmp), "%d", (int)val);
+	} else {
+		snprintf(tmp, sizeof(tmp), "%1.15g", val);
+		if (!jsonw_same(strtod(tmp, NULL), val))
+			snprintf(tmp, sizeof(tmp), "%1.17g", val);
+	}
+	jsonw_write(w, tmp, strlen(tmp));
+}
+
+void jsonw_int(struct jsonw *w, const char *key, long long val) {
+	char tmp[24];
+	jsonw_member(w, key);
+	snprintf(tmp, sizeof(tmp), "%lld", val);
+	jsonw_write(w, tmp, strlen(tmp));
+}
+
+void jsonw_bool(struct jsonw *w, const char *key, int val) {
+	jsonw_member(w, key);
+	if (val) jsonw_write(w, "true", 4);
+	else jsonw_write(w, "false", 5);
+}
+
+/* Flushes the remaining output, returns 0 if everything was written */
+int jsonw_finish(struct jsonw *w) {
+	if (w->depth != 0) w->err = 1;
+	/* Without a flush callback the output stays in the buffer */
+	if (w->flush != NULL) jsonw_drain(w);
+	return w->err;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+enum {
+	JSONR_S_VALUE,			// value expected
+	JSONR_S_VALUE_OR_END,	// first array member or ]
+	JSONR_S_KEY,			// member name expected
+	JSONR_S_KEY_OR_END,		// first member name or }
+	JSONR_S_COLON,
+	JSONR_S_NEXT,			// , or closing bracket expected
+	JSONR_S_STR,
+	JSONR_S_ESC,
+	JSONR_S_UNI,
+	JSONR_S_NUM,
+	JSONR_S_LIT,			// true, false or null
+	JSONR_S_DONE,
+};
+
+void jsonr_init(struct jsonr *r, jsonr_cb_t cb, void *ctx) {
+	memset(r, 0, sizeof(*r));
+	r->cb = cb;
+	r->ctx = ctx;
+	r->state = JSONR_S_VALUE;
+}
+
+static void jsonr_fail(struct jsonr *r, const char *msg) {
+	if (r->err) return;
+	r->err = 1;
+	r->msg = msg;
+}
+
+static int jsonr_in_arr(struct jsonr *r) {
+	return r->depth > 0 && (r->arr & (1u << (r->depth - 1)));
+}
+
+static void jsonr_emit(struct jsonr *r, enum jsonr_type type, const char *val) {
+	const char *key = jsonr_in_arr(r) || r->depth == 0 ? NULL : r->key;
+	if (r->cb(r->ctx, r->depth, type, type == JSONR_END ? NULL : key, val)) {
+		jsonr_fail(r, "Rejected");
+	}
+}
+
+/* After a complete value: the parent decides what may follow */
+static void jsonr_value_done(struct jsonr *r) {
+	r->state = r->depth == 0 ? JSONR_S_DONE : JSONR_S_NEXT;
+}
+
+static void jsonr_open(struct jsonr *r, int arr) {
+	if (r->depth >= JSONR_MAX_DEPTH) {
+		jsonr_fail(r, "Nested too deep");
+		return;
+	}
+	jsonr_emit(r, arr ? JSONR_ARR : JSONR_OBJ, NULL);
+	if (arr) r->arr |= 1u << r->depth;
+	else r->arr &= ~(1u << r->depth);
+	r->depth++;
+	r->state = arr ? JSONR_S_VALUE_OR_END : JSONR_S_KEY_OR_END;
+}
+
+static void jsonr_close(struct jsonr *r, int arr) {
+	if (r->depth == 0 || jsonr_in_arr(r) != arr) {
+		jsonr_fail(r, "Unexpected bracket");
+		return;
+	}
+	r->depth--;
+	jsonr_emit(r, JSONR_END, NULL);
+	jsonr_value_done(r);
+}
+
+static void jsonr_tok_add(struct jsonr *r, char c) {
+	if (r->tok_len >= JSONR_TOK_LEN - 1) {
+		jsonr_fail(r, "Value too long");
+		return;
+	}
+	r->tok[r->tok_len++] = c;
+	r->tok[r->tok_len] = '\0';
+}
+
+static void jsonr_str_done(struct jsonr *r) {
+	if (r->str_key) {
+		memcpy(r->key, r->tok, r->tok_len + 1);
+		r->state = JSONR_S_COLON;
+		return;
+	}
+	jsonr_emit(r, JSONR_STR, r->tok);
+	jsonr_value_done(r);
+}
+
+static void jsonr_scalar_done(struct jsonr *r) {
+	if (r->state == JSONR_S_NUM) {
+		char *end;
+		strtod(r->tok, &end);
+		if (*end != '\0') jsonr_fail(r, "Invalid number");
+		else jsonr_emit(r, JSONR_NUM, r->tok);
+	} else if (strcmp(r->tok, "true") == 0 || strcmp(r->tok, "false") == 0) {
+		jsonr_emit(r, JSONR_BOOL, r->tok);
+	} else if (strcmp(r->tok, "null") == 0) {
+		jsonr_emit(r, JSONR_NULL, NULL);
+	} else {
+		jsonr_fail(r, "Invalid literal");
+	}
+	jsonr_value_done(r);
+}
+
+static void jsonr_utf8(struct jsonr *r, unsigned int u) {
+	if (u < 0x80) {
+		jsonr_tok_add(r, u);
+	} else if (u < 0x800) {
+		jsonr_tok_add(r, 0xC0 | (u >> 6));
+		jsonr_tok_add(r, 0x80 | (u & 0x3F));
+	} else if (u < 0x10000) {
+		jsonr_tok_add(r, 0xE0 | (u >> 12));
+		jsonr_tok_add(r, 0x80 | ((u >> 6) & 0x3F));
+		jsonr_tok_add(r, 0x80 | (u & 0x3F));
+	} else {
+		jsonr_tok_add(r, 0xF0 | (u >> 18));
+		jsonr_tok_add(r, 0x80 | ((u >> 12) & 0x3F));
+		jsonr_tok_add(r, 0x80 | ((u >> 6) & 0x3F));
+		jsonr_tok_add(r, 0x80 | (u & 0x3F));
+	}
+}
+
+/* A complete \uXXXX; characters above U+FFFF come as a surrogate pair */
+static void jsonr_uni(struct jsonr *r) {
+	unsigned int u = r->uni;
+	if (r->uni_hi) {
+		if (u < 0xDC00 || u > 0xDFFF) jsonr_fail(r, "Invalid escape");
+		else jsonr_utf8(r, 0x10000 + ((r->uni_hi - 0xD800) << 10) + (u - 0xDC00));
+		r->uni_hi = 0;
+	} else if (u >= 0xD800 && u <= 0xDBFF) {
+		r->uni_hi = u;
+	} else if (u == 0 || (u >= 0xDC00 && u <= 0xDFFF)) {
+		jsonr_fail(r, "Invalid escape");	// a NUL would cut the value short
+	} else {
+		jsonr_utf8(r, u);
+	}
+}
+
+/* Handles one input character, returns 0 if it has to be fed again */
+static int jsonr_char(struct jsonr *r, char c) {
+	int ws = (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+
+	switch (r->state) {
+	case JSONR_S_VALUE_OR_END:
+		if (c == ']') {
+			jsonr_close(r, 1);
+			return 1;
+		}
+		/* fall through */
+	case JSONR_S_VALUE:
+		if (ws) return 1;
+		r->tok_len = 0;
+		r->tok[0] = '\0';
+		if (c == '{') jsonr_open(r, 0);
+		else if (c == '[') jsonr_open(r, 1);
+		else if (c == '"') {
+			r->str_key = 0;
+			r->state = JSONR_S_STR;
+		} else if (c == '-' || (c >= '0' && c <= '9')) {
+			r->state = JSONR_S_NUM;
+			jsonr_tok_add(r, c);
+		} else if (c >= 'a' && c <= 'z') {
+			r->state = JSONR_S_LIT;
+			jsonr_tok_add(r, c);
+		} else jsonr_fail(r, "Value expected");
+		return 1;
+
+	case JSONR_S_KEY_OR_END:
+		if (c == '}') {
+			jsonr_close(r, 0);
+			return 1;
+		}
+		/* fall through */
+	case JSONR_S_KEY:
+		if (ws) return 1;
+		if (c != '"') {
+			jsonr_fail(r, "Member name expected");
+			return 1;
+		}
+		r->tok_len = 0;
+		r->tok[0] = '\0';
+		r->str_key = 1;
+		r->state = JSONR_S_STR;
+		return 1;
+
+	case JSONR_S_COLON:
+		if (ws) return 1;
+		if (c == ':') r->state = JSONR_S_VALUE;
+		else jsonr_fail(r, "Colon expected");
+		return 1;
+
+	case JSONR_S_NEXT:
+		if (ws) return 1;
+		if (c == ',') r->state = jsonr_in_arr(r) ? JSONR_S_VALUE : JSONR_S_KEY;
+		else if (c == '}') jsonr_close(r, 0);
+		else if (c == ']') jsonr_close(r, 1);
+		else jsonr_fail(r, "Comma expected");
+		return 1;
+
+	case JSONR_S_STR:
+		if (r->uni_hi && c != '\\') jsonr_fail(r, "Invalid escape");
+		else if (c == '"') jsonr_str_done(r);
+		else if (c == '\\') r->state = JSONR_S_ESC;
+		else if ((unsigned char) c < 0x20) jsonr_fail(r, "Control character in string");
+		else jsonr_tok_add(r, c);
+		return 1;
+
+	case JSONR_S_ESC:
+		r->state = JSONR_S_STR;
+		if (r->uni_hi && c != 'u') c = 0;	// only the low surrogate may follow
+		switch (c) {
+		case '"': case '\\': case '/': jsonr_tok_add(r, c); break;
+		case 'b': jsonr_tok_add(r, '\b'); break;
+		case 'f': jsonr_tok_add(r, '\f'); break;
+		case 'n': jsonr_tok_add(r, '\n'); break;
+		case 'r': jsonr_tok_add(r, '\r'); break;
+		case 't': jsonr_tok_add(r, '\t'); break;
+		case 'u':
+			r->uni = 0;
+			r->uni_cnt = 0;
+			r->state = JSONR_S_UNI;
+			break;
+		default: jsonr_fail(r, "Invalid escape");
+		}
+		return 1;
+
+	case JSONR_S_UNI: {
+		int v;
+		if (c >= '0' && c <= '9') v = c - '0';
+		else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+		else {
+			jsonr_fail(r, "Invalid escape");
+			return 1;
+		}
+		r->uni = (r->uni << 4) | v;
+		if (++r->uni_cnt == 4) {
+			jsonr_uni(r);
+			r->state = JSONR_S_STR;
+		}
+		return 1;
+	}
+
+	case JSONR_S_NUM:
+		if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' ||
+				c == '+' || c == '-') {
+			jsonr_tok_add(r, c);
+			return 1;
+		}
+		jsonr_scalar_done(r);
+		return 0;
+
+	case JSONR_S_LIT:
+		if (c >= 'a' && c <= 'z') {
+			jsonr_tok_add(r, c);
+			return 1;
+		}
+		jsonr_scalar_done(r);
+		return 0;
+
+	case JSONR_S_DONE:
+		if (!ws) jsonr_fail(r, "Trailing data");
+		return 1;
+	}
+	return 1;
+}
+
+/* Parses the next piece of input, returns nonzero once an error occurred */
+int jsonr_feed(struct jsonr *r, const char *buf, size_t len) {
+	size_t i = 0;
+	while (i < len && !r->err) {
+		if (jsonr_char(r, buf[i])) i++;
+	}
+	return r->err;
+}
+
+/* Ends the input, returns nonzero unless it was one complete value */
+int jsonr_finish(struct jsonr *r) {
+	if (r->err) return r->err;
+	/* A scalar ends with the input only at the root, inside it is cut short */
+	if (r->depth == 0 && (r->state == JSONR_S_NUM || r->state == JSONR_S_LIT))
+		jsonr_scalar_done(r);
+	if (!r->err && r->state != JSONR_S_DONE) jsonr_fail(r, "Unexpected end of input");
+	return r->err;
+}
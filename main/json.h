@@ -0,0 +1,109 @@
+/*
+ * json.h
+ *
+ * Streaming JSON writer and reader
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MAIN_JSON_H_
+#define MAIN_JSON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define JSONW_MAX_DEPTH		16
+
+/* Called whenever the buffer fills up; returns 0 on success */
+typedef int (*jsonw_flush_t)(void *ctx, const char *buf, size_t len);
+
+/*
+ * Writes compact JSON into a caller-provided buffer, handing it to the flush
+ * callback whenever it fills up. Nothing is allocated, so the output size
+ * does not affect memory use. Errors are sticky and reported by jsonw_finish.
+ * A NULL key is used for array members and the root value. Without a flush
+ * callback the output must fit the buffer; w->len is then its length.
+ */
+struct jsonw {
+	char *buf;
+	size_t size;
+	size_t len;
+	jsonw_flush_t flush;
+	void *ctx;
+	uint32_t nonempty;	// bit per depth: container already has members
+	uint8_t depth;
+	int err;
+};
+
+void jsonw_init(struct jsonw *w, char *buf, size_t size, jsonw_flush_t flush, void *ctx);
+void jsonw_obj_open(struct jsonw *w, const char *key);
+void jsonw_obj_close(struct jsonw *w);
+void jsonw_arr_open(struct jsonw *w, const char *key);
+void jsonw_arr_close(struct jsonw *w);
+void jsonw_str(struct jsonw *w, const char *key, const char *val);
+void jsonw_num(struct jsonw *w, const char *key, double val);
+void jsonw_int(struct jsonw *w, const char *key, long long val);
+void jsonw_bool(struct jsonw *w, const char *key, int val);
+int jsonw_finish(struct jsonw *w);
+
+#define JSONR_MAX_DEPTH		16
+#define JSONR_TOK_LEN		64	// longest key or scalar value accepted
+
+enum jsonr_type {
+	JSONR_OBJ,		// object opens
+	JSONR_ARR,		// array opens
+	JSONR_END,		// object or array closes, key is NULL
+	JSONR_STR,
+	JSONR_NUM,		// val is the number as written
+	JSONR_BOOL,		// val is "true" or "false"
+	JSONR_NULL,
+};
+
+/*
+ * Called for every value as soon as it is complete. depth is 0 for the root
+ * value and the same for a container's open and END events, key is the
+ * member name or NULL for array members. Returns 0 to continue parsing.
+ */
+typedef int (*jsonr_cb_t)(void *ctx, int depth, enum jsonr_type type,
+		const char *key, const char *val);
+
+/*
+ * Incremental JSON parser: input can be fed in pieces of any size and only
+ * the current key and scalar are buffered, so memory use does not depend on
+ * the document size. Strings are unescaped to UTF-8 before the callback.
+ * Errors are sticky; err is set and msg says what went wrong.
+ */
+struct jsonr {
+	jsonr_cb_t cb;
+	void *ctx;
+	uint32_t arr;		// bit per depth: container is an array
+	uint8_t depth;
+	uint8_t state;
+	uint8_t str_key;	// string being read is a member name
+	uint8_t tok_len;
+	uint8_t uni_cnt;
+	uint16_t uni;
+	uint16_t uni_hi;	// high surrogate waiting for the low one
+	char key[JSONR_TOK_LEN];
+	char tok[JSONR_TOK_LEN];
+	int err;
+	const char *msg;
+};
+
+void jsonr_init(struct jsonr *r, jsonr_cb_t cb, void *ctx);
+int jsonr_feed(struct jsonr *r, const char *buf, size_t len);
+int jsonr_finish(struct jsonr *r);
+
+#endif /* MAIN_JSON_H_ */
@@ -0,0 +1,299 @@
+/*
+ * logbuf.c
+ *
+ * Non-blocking log output
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * ESP_LOGx output is formatted on the caller's stack and queued in a ring
+ * instead of being written to the UART there, so logging from the BT
+ * callback costs microseconds instead of the milliseconds a line takes at
+ * 115200 baud. A low priority task writes the lines to the console and, if
+ * configured, sends each as an RFC 5424 syslog datagram.
+ *
+ * The ring takes any number of writers without a lock: a writer reserves
+ * space by advancing head with a compare-and-swap, copies its line and then
+ * publishes the record header. Records are 4-byte aligned:
+ *
+ *   hdr (u32: LOGBUF_READY | level << 16 | len) | text[len] | padding
+ *
+ * The reader stops at the first unpublished header and zeroes what it has
+ * consumed, so a stale word is never taken for a header. Lines that do not
+ * fit are dropped and counted, never waited for.
+ *
+ * Each tag gets CONFIG_HYG_LOG_RATE lines per second. Tags are tracked in a
+ * small direct-mapped table; a tag taking over a slot starts a new second.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+//#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_mac.h"
+#include "lwip/sockets.h"
+#include "sdkconfig.h"
+#include "conf.h"
+#include "wifi.h"
+#include "tasks.h"
+#include "logbuf.h"
+
+#define LOGBUF_SIZE		CONFIG_HYG_LOG_BUF
+#define LOGBUF_LINE		160			// longer lines are cut
+#define LOGBUF_READY	0x80000000
+#define LOGBUF_TAGS		32
+#define LOGBUF_DRAIN_MS	20
+#define LOGBUF_SYSLOG_PORT	514
+#define LOGBUF_FACILITY	16			// local0
+
+_Static_assert((LOGBUF_SIZE & (LOGBUF_SIZE - 1)) == 0, "CONFIG_HYG_LOG_BUF must be a power of two");
+
+static uint8_t logbuf_ring[LOGBUF_SIZE] __attribute__((aligned(4)));
+static uint32_t logbuf_head;		// reserved up to, free running
+static uint32_t logbuf_tail;		// consumed up to
+static SemaphoreHandle_t logbuf_reader;	// the task and logbuf_flush()
+static struct logbuf_stats logbuf_stats;
+
+static struct logbuf_tag {
+	uint32_t hash;
+	uint32_t sec;
+	uint32_t n;
+} logbuf_tags[LOGBUF_TAGS];
+
+static int logbuf_sock = -1;
+static char logbuf_host[16];	// syslog HOSTNAME, from the MAC
+
+/*
+ * Finds the level and tag of a formatted ESP_LOGx line:
+ * [color] L (timestamp) TAG: message. Returns the level letter, 0 for
+ * other output.
+ */
+static char logbuf_parse(const char *s, const char **tag, int *tag_len) {
+	if (*s == '\033') {
+		s = strchr(s, 'm');
+		if (s == NULL) return 0;
+		s++;
+	}
+	char level = *s;
+	if (strchr("EWIDV", level) == NULL || s[1] != ' ' || s[2] != '(') return 0;
+	s = strchr(s, ')');
+	if (s == NULL || s[1] != ' ') return 0;
+	s += 2;
+	const char *end = strstr(s, ": ");
+	if (end == NULL) return 0;
+	*tag = s;
+	*tag_len = end - s;
+	return level;
+}
+
+/* Counts the line against its tag's budget, returns nonzero to drop it */
+static int logbuf_limited(const char *tag, int len) {
+	if (CONFIG_HYG_LOG_RATE == 0) return 0;
+
+	uint32_t hash = 2166136261u;	// FNV-1a
+	int i;
+	for (i=0; i<len; i++) hash = (hash ^ (uint8_t) tag[i]) * 16777619u;
+
+	struct logbuf_tag *t = &logbuf_tags[hash % LOGBUF_TAGS];
+	uint32_t sec = xTaskGetTickCount() / configTICK_RATE_HZ;
+	if (__atomic_load_n(&t->hash, __ATOMIC_RELAXED) != hash ||
+			__atomic_load_n(&t->sec, __ATOMIC_RELAXED) != sec) {
+		/* Racing writers may both restart the second, which only lets a line more through */
+		__atomic_store_n(&t->n, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->sec, sec, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->hash, hash, __ATOMIC_RELAXED);
+	}
+	return __atomic_fetch_add(&t->n, 1, __ATOMIC_RELAXED) >= CONFIG_HYG_LOG_RATE;
+}
+
+static void logbuf_copy_in(uint32_t pos, const char *src, uint32_t len) {
+	uint32_t ofs = pos & (LOGBUF_SIZE - 1);
+	uint32_t n = len < LOGBUF_SIZE - ofs ? len : LOGBUF_SIZE - ofs;
+	memcpy(logbuf_ring + ofs, src, n);
+	memcpy(logbuf_ring, src + n, len - n);
+}
+
+static void logbuf_copy_out(char *dst, uint32_t pos, uint32_t len) {
+	uint32_t ofs = pos & (LOGBUF_SIZE - 1);
+	uint32_t n = len < LOGBUF_SIZE - ofs ? len : LOGBUF_SIZE - ofs;
+	memcpy(dst, logbuf_ring + ofs, n);
+	memcpy(dst + n, logbuf_ring, len - n);
+}
+
+static void logbuf_zero(uint32_t pos, uint32_t len) {
+	uint32_t ofs = pos & (LOGBUF_SIZE - 1);
+	uint32_t n = len < LOGBUF_SIZE - ofs ? len : LOGBUF_SIZE - ofs;
+	memset(logbuf_ring + ofs, 0, n);
+	memset(logbuf_ring, 0, len - n);
+}
+
+/* Installed with esp_log_set_vprintf(), runs in the logging task */
+static int logbuf_vprintf(const char *fmt, va_list args) {
+	char line[LOGBUF_LINE];
+	int len = vsnprintf(line, sizeof(line), fmt, args);
+	if (len < 0) return len;
+	int ret = len;
+	if (len >= sizeof(line)) {
+		len = sizeof(line) - 1;
+		line[len - 1] = '\n';
+	}
+
+	const char *tag = "";
+	int tag_len = 0;
+	char level = logbuf_parse(line, &tag, &tag_len);
+	if (level && logbuf_limited(tag, tag_len)) {
+		__atomic_fetch_add(&logbuf_stats.limited, 1, __ATOMIC_RELAXED);
+		return ret;
+	}
+
+	uint32_t need = 4 + ((len + 3) & ~3);
+	uint32_t head = __atomic_load_n(&logbuf_head, __ATOMIC_RELAXED);
+	do {
+		uint32_t tail = __atomic_load_n(&logbuf_tail, __ATOMIC_ACQUIRE);
+		if (head + need - tail > LOGBUF_SIZE) {
+			__atomic_fetch_add(&logbuf_stats.dropped, 1, __ATOMIC_RELAXED);
+			return ret;
+		}
+	} while (!__atomic_compare_exchange_n(&logbuf_head, &head, head + need, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	logbuf_copy_in(head + 4, line, len);
+	uint32_t hdr = LOGBUF_READY | (uint32_t) (uint8_t) level << 16 | len;
+	__atomic_store_n((uint32_t *) (logbuf_ring + (head & (LOGBUF_SIZE - 1))), hdr,
+			__ATOMIC_RELEASE);
+	return ret;
+}
+
+static int logbuf_severity(char level) {
+	switch (level) {
+	case 'E': return 3;
+	case 'W': return 4;
+	case 'I': return 6;
+	default: return 7;
+	}
+}
+
+/* Sends one line as <PRI>1 - HOST TAG - - - MSG, without color codes */
+static void logbuf_syslog(char level, const char *line, int len) {
+	const struct conf *c = conf_get();
+	struct sockaddr_in dest = {
+		.sin_family = AF_INET,
+		.sin_port = htons(c->syslog.port ? c->syslog.port : LOGBUF_SYSLOG_PORT),
+	};
+	dest.sin_addr.s_addr = c->syslog.host[0] ? inet_addr(c->syslog.host) : INADDR_NONE;
+	conf_put(c);
+	if (dest.sin_addr.s_addr == INADDR_NONE || !wifi_wait_conn(0)) return;
+
+	if (logbuf_sock < 0) {
+		logbuf_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+		if (logbuf_sock < 0) {
+			logbuf_stats.syslog_err++;
+			return;
+		}
+	}
+
+	const char *tag = "-", *msg = line;
+	int tag_len = 1;
+	if (level) {
+		logbuf_parse(line, &tag, &tag_len);
+		msg = tag + tag_len + 2;
+	}
+	int msg_len = line + len - msg;
+	while (msg_len > 0 && (msg[msg_len-1] == '\n' || msg[msg_len-1] == '\r')) msg_len--;
+	if (msg_len > 4 && memcmp(msg + msg_len - 4, "\033[0m", 4) == 0) msg_len -= 4;
+
+	char buf[LOGBUF_LINE + 64];
+	int n = snprintf(buf, sizeof(buf), "<%d>1 - %s %.*s - - - %.*s",
+			LOGBUF_FACILITY * 8 + logbuf_severity(level), logbuf_host,
+			tag_len, tag, msg_len, msg);
+	if (n >= sizeof(buf)) n = sizeof(buf) - 1;
+	if (sendto(logbuf_sock, buf, n, 0, (struct sockaddr *) &dest, sizeof(dest)) < 0)
+		logbuf_stats.syslog_err++;
+}
+
+/* Writes out everything published so far; returns the lines written */
+static int logbuf_drain(int syslog) {
+	char line[LOGBUF_LINE];
+	int n = 0;
+
+	xSemaphoreTake(logbuf_reader, portMAX_DELAY);
+	uint32_t tail = logbuf_tail;
+	while (1) {
+		uint32_t *hp = (uint32_t *) (logbuf_ring + (tail & (LOGBUF_SIZE - 1)));
+		uint32_t hdr = __atomic_load_n(hp, __ATOMIC_ACQUIRE);
+		if (!(hdr & LOGBUF_READY)) break;
+
+		uint32_t len = hdr & 0xFFFF;
+		uint32_t need = 4 + ((len + 3) & ~3);
+		logbuf_copy_out(line, tail + 4, len);
+		logbuf_zero(tail, need);
+		tail += need;
+		__atomic_store_n(&logbuf_tail, tail, __ATOMIC_RELEASE);
+
+		fwrite(line, 1, len, stdout);
+		if (syslog) logbuf_syslog((hdr >> 16) & 0xFF, line, len);
+		n++;
+	}
+	xSemaphoreGive(logbuf_reader);
+
+	logbuf_stats.lines += n;
+	return n;
+}
+
+static void logbuf_task(void *arg) {
+	uint32_t lost = 0;
+	while (1) {
+		vTaskDelay(LOGBUF_DRAIN_MS / portTICK_PERIOD_MS);
+		if (logbuf_drain(1)) fflush(stdout);
+
+		uint32_t now = __atomic_load_n(&logbuf_stats.dropped, __ATOMIC_RELAXED) +
+				__atomic_load_n(&logbuf_stats.limited, __ATOMIC_RELAXED);
+		if (now - lost >= 100) {
+			ESP_LOGW("LOG", "%lu lines dropped, %lu over the rate limit",
+					(unsigned long) logbuf_stats.dropped, (unsigned long) logbuf_stats.limited);
+			lost = now;
+		}
+	}
+}
+
+/* Writes pending lines to the console, also registered for esp_restart() */
+void logbuf_flush() {
+	if (logbuf_reader == NULL) return;
+	logbuf_drain(0);
+	fflush(stdout);
+}
+
+void logbuf_stats_get(struct logbuf_stats *s) {
+	*s = logbuf_stats;
+}
+
+void logbuf_init() {
+	uint8_t mac[6];
+	esp_read_mac(mac, ESP_MAC_WIFI_STA);
+	snprintf(logbuf_host, sizeof(logbuf_host), "hyg-%02x%02x%02x", mac[3], mac[4], mac[5]);
+
+	logbuf_reader = xSemaphoreCreateMutex();
+	if (task_create(TASK_LOG, logbuf_task, NULL, NULL) != pdPASS) return;
+	esp_register_shutdown_handler(logbuf_flush);
+	esp_log_set_vprintf(logbuf_vprintf);
+}
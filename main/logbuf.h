@@ -0,0 +1,37 @@
+/*
+ * logbuf.h
+ *
+ * Non-blocking log output
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MAIN_LOGBUF_H_
+#define MAIN_LOGBUF_H_
+
+#include <stdint.h>
+
+struct logbuf_stats {
+	uint32_t lines;			// written out
+	uint32_t dropped;		// ring full
+	uint32_t limited;		// over CONFIG_HYG_LOG_RATE
+	uint32_t syslog_err;
+};
+
+void logbuf_init();
+void logbuf_flush();
+void logbuf_stats_get(struct logbuf_stats *s);
+
+#endif /* MAIN_LOGBUF_H_ */
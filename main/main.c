@@ -35,6 +35,13 @@
 #include "wifi.h"
 #include "bt.h"
 #include "poller.h"
+#include "history.h"
+#include "spool.h"
+#include "gossip.h"
+#include "relay.h"
+#include "fwd.h"
+#include "soak.h"
+#include "logbuf.h"
 
 static void initialize_nvs(void)
 {
@@ -50,9 +57,18 @@ void app_main(void)
 {
 	initialize_nvs();
 	conf_init();
+	logbuf_init();
+	history_init();
 	led_init();
 	wifi_init();
+	spool_init();
+	gossip_init();
+	relay_init();
+	fwd_init();
 	bt_init();
+#if CONFIG_HYG_SOAK
+	soak_init();
+#endif
 	cli_init();
 	http_init();
 	poller_init();
@@ -17,7 +17,21 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+
+/*
+ * Each proxy reports at its own phase of the interval, derived from its MAC,
+ * so a fleet that boots at the same instant after a power cut does not hit
+ * the access point and the Influx listener all at once. Once SNTP has set
+ * the clock the phase is kept against the wall clock, before that against
+ * the uptime. Every deadline is moved to the nearest slot of the current
+ * clock, so the schedule follows the clock without skipping a report.
+ *
+ * Line protocol datagrams are also spread over the first
+ * CONFIG_HYG_REPORT_SPREAD percent of the interval instead of going out
+ * back to back. Batched output (binary reports, relay, spool) is not paced.
+ */
 #include <string.h>
+#include <sys/time.h>
 
 //#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
 #include "esp_log.h"
@@ -25,14 +39,33 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_bt_defs.h"
+#include "esp_mac.h"
+#include "sdkconfig.h"
 #include "bt.h"
 #include "influx.h"
 #include "conf.h"
+#include "telemetry.h"
+#include "history.h"
+#include "spool.h"
+#include "wifi.h"
+#include "gossip.h"
+#include "relay.h"
+#include "ifxbin.h"
+#include "tasks.h"
+#include "stats.h"
 #include "poller.h"
 
 static TaskHandle_t s_vcs_task_hdl = NULL;
+static uint32_t poller_missed;
+static uint32_t poller_phase;		// hash of the MAC, modulo the interval is the offset
 
+#ifndef POLL_INTERVAL_MIN_S		// lowered by the simulator
 #define POLL_INTERVAL_MIN_S	30
+#endif
+#define POLL_INTERVAL_IDLE_S	60	// history only, without Influx
+#define POLL_SCAN_DEFAULT_S		20	// BLE scan burst before each report in low power
+#define POLL_TIME_VALID			1577836800	// 2020-01-01, earlier means no SNTP yet
+#define POLL_SLEW				8			// move at most 1/8 interval per report into the slot
 
 static void int64_to_bdaddr(esp_bd_addr_t adr, uint64_t i) {
 	adr[0] = (i>>40) & 0xFF;
@@ -43,34 +76,196 @@ static void int64_to_bdaddr(esp_bd_addr_t adr, uint64_t i) {
 	adr[5] = (i>>0) & 0xFF;
 }
 
+/*
+ * Deadline of the report after the one due at last, moved towards the
+ * proxy's slot: phase modulo the interval past its start, on the wall clock
+ * tv once SNTP has set it and on the tick count now before. When SNTP sets
+ * the clock the slot moves by up to half an interval; it is reached over
+ * the next few reports so that no interval stretches or shrinks enough to
+ * look like a missing or extra report.
+ */
+TickType_t poller_next(TickType_t last, uint32_t interval, uint32_t phase,
+		TickType_t now, const struct timeval *tv) {
+	TickType_t next = last + interval;
+
+	int64_t at_ms;
+	if (tv->tv_sec >= POLL_TIME_VALID) at_ms = (int64_t) tv->tv_sec * 1000 + tv->tv_usec / 1000;
+	else at_ms = (int64_t) now * portTICK_PERIOD_MS;
+	at_ms += (int64_t) (int32_t) (next - now) * portTICK_PERIOD_MS;
+
+	int64_t period = (int64_t) interval * portTICK_PERIOD_MS;
+	int64_t ofs = phase % period;
+	/* Floor division, the uptime basis is below ofs right after boot */
+	int64_t d = at_ms - ofs + period / 2;
+	int64_t k = d / period - (d % period < 0);
+	int64_t shift = k * period + ofs - at_ms;
+	int64_t slew = period / POLL_SLEW;
+	if (shift > slew) shift = slew;
+	if (shift < -slew) shift = -slew;
+	return next + shift / (int64_t) portTICK_PERIOD_MS;
+}
+
+/* Sensors that get a reading sent each interval, at most */
+static int poller_count(const struct conf *c) {
+	int i, n = 0;
+	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
+		if (c->clients[i].addr != 0 && c->clients[i].name[0] != '\0') n++;
+	}
+	return n;
+}
+
+/*
+ * Nonzero if slot i no longer holds addr. Readings are taken without the
+ * configuration pinned, so a sensor list saved meanwhile may have reset the
+ * slot and handed it to another sensor.
+ */
+static int poller_moved(int i, uint64_t addr, uint32_t ver) {
+	if (__atomic_load_n(&conf_version, __ATOMIC_SEQ_CST) == ver) return 0;
+	const struct conf *c = conf_get();
+	int moved = c->clients[i].addr != addr;
+	conf_put(c);
+	return moved;
+}
+
 static void poller_task(void *arg) {
 	TickType_t xLastWakeTime = xTaskGetTickCount();
+	int power_low = -1;
+	conf_watch(xTaskGetCurrentTaskHandle());
 	while(1) {
-		if (conf.influx.interval_s < POLL_INTERVAL_MIN_S ||
-				conf.influx.db[0] == '\0' ||
-				conf.influx.host[0] == '\0') {
-			vTaskDelay(1000/portTICK_PERIOD_MS);
-			xLastWakeTime = xTaskGetTickCount();
-			continue;
+		const struct conf *c = conf_get();
+		uint16_t interval_s = c->influx.interval_s;
+		/* Edges report through the gateway, which has the Influx settings */
+		int edge = relay_mode() == RELAY_EDGE;
+		int report = (edge || (c->influx.db[0] != '\0' && c->influx.host[0] != '\0')) &&
+				interval_s >= POLL_INTERVAL_MIN_S;
+		int bin = c->bin.on != 0;
+		int low = c->power.low != 0;
+		uint32_t scan_s = c->power.scan_s ? c->power.scan_s : POLL_SCAN_DEFAULT_S;
+		conf_put(c);
+
+		if (low != power_low) {
+			power_low = low;
+			wifi_set_power_save(low);
+			bt_set_low_power(low);
+		}
+
+		/* Without Influx only the history is kept, the readings are left alone */
+		if (!report) interval_s = POLL_INTERVAL_IDLE_S;
+
+		uint32_t interval = interval_s * 1000 / portTICK_PERIOD_MS;
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		TickType_t next = poller_next(xLastWakeTime, interval, poller_phase,
+				xTaskGetTickCount(), &tv);
+		if (low) {
+			/* Scan just long enough before the report to catch every sensor */
+			TickType_t lead = scan_s * 1000 / portTICK_PERIOD_MS;
+			if (lead >= next - xLastWakeTime) lead = next - xLastWakeTime - 1;
+			TickType_t burst = xLastWakeTime;
+			vTaskDelayUntil(&burst, next - xLastWakeTime - lead);
+			bt_scan_burst(scan_s);
+		}
+		if (report) {
+			vTaskDelayUntil( &xLastWakeTime, next - xLastWakeTime);
+		} else {
+			/* A new Influx target is picked up as soon as it is saved */
+			TickType_t now = xTaskGetTickCount();
+			if ((int32_t) (next - now) > 0 && ulTaskNotifyTake(pdTRUE, next - now)) {
+				xLastWakeTime = xTaskGetTickCount();
+				continue;
+			}
+			xLastWakeTime = next;
+		}
+
+		/* After a sweep overran whole intervals, skip them rather than catch up */
+		TickType_t late = xTaskGetTickCount() - xLastWakeTime;
+		stats_add(STATS_POLL_LATE, late * portTICK_PERIOD_MS * 1000);
+		if (late >= interval) {
+			poller_missed += late / interval;
+			xLastWakeTime += late / interval * interval;
 		}
 
-		uint32_t interval = conf.influx.interval_s * 1000 / portTICK_PERIOD_MS;
-		vTaskDelayUntil( &xLastWakeTime, interval);
+		/* Readings that cannot be sent now are kept in flash and sent later */
+		int online = wifi_wait_conn(0);
 
+		c = conf_get();
+		int n = poller_count(c), sent = 0;
+		conf_put(c);
+		TickType_t start = xTaskGetTickCount();
+		uint32_t spread = report && online && !bin && !edge ?
+				interval * CONFIG_HYG_REPORT_SPREAD / 100 : 0;
 		int i;
 		for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
-			const struct conf_influx_client *cli = &conf.influx.clients[i];
-			if (cli->addr == 0 || cli->name[0] == '\0') continue;
+			/* Pinned only for the copy, result locks and sends may block */
+			uint32_t ver = __atomic_load_n(&conf_version, __ATOMIC_SEQ_CST);
+			c = conf_get();
+			struct conf_influx_client cli = c->clients[i];
+			conf_put(c);
+			if (cli.addr == 0 || cli.name[0] == '\0') continue;
+			if (!report) {
+				float t = bt_result_get_t(i);
+				float h = bt_result_get_h(i);
+				if (!poller_moved(i, cli.addr, ver)) history_push(cli.addr, t, h);
+				continue;
+			}
 			esp_bd_addr_t adr;
-			int64_to_bdaddr(adr, cli->addr);
+			int64_to_bdaddr(adr, cli.addr);
 			float t = bt_result_get_clear_t(i);
 			float h = bt_result_get_clear_h(i);
-			influx_report(adr, cli->name, t, h);
+			float rssi = bt_result_get_rssi(i);
+			int adv_rate = bt_result_get_adv_rate(i);
+			if (poller_moved(i, cli.addr, ver)) continue;
+			history_push(cli.addr, t, h);
+			if (edge) {
+				relay_add(cli.addr, t, h, rssi);
+				continue;
+			}
+			/* Where proxies overlap, only the one hearing the sensor best reports it */
+			if (!gossip_should_report(i)) continue;
+			if (!online) {
+				spool_add(cli.addr, t, h);
+			} else if (bin) {
+				ifxbin_add(i, cli.addr, t, h, rssi, adv_rate);
+			} else if (influx_report(adr, cli.name, t, h, rssi, adv_rate)) {
+				spool_add(cli.addr, t, h);
+			}
+
+			if (spread && ++sent < n) {
+				TickType_t due = start + (uint64_t) spread * sent / n;
+				TickType_t wait = due - xTaskGetTickCount();
+				if ((int32_t) wait > 0) vTaskDelay(wait);
+			}
+		}
+		if (edge) {
+			relay_flush();
+			continue;
 		}
+		ifxbin_flush();
+		spool_flush();
+
+		if (report) telemetry_report();
 	}
 }
 
 
+/* Report intervals skipped since boot */
+uint32_t poller_get_missed() {
+	return poller_missed;
+}
+
 void poller_init() {
-	xTaskCreate(poller_task, "pollT", 4096, NULL, 5, &s_vcs_task_hdl);
+	uint8_t mac[6];
+	esp_read_mac(mac, ESP_MAC_WIFI_STA);
+	uint64_t h = 0;
+	int i;
+	for (i=0; i<6; i++) h = (h << 8) | mac[i];
+	/* MurmurHash3 finalizer, neighbouring MACs get unrelated phases */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	poller_phase = h;
+
+	task_create(TASK_POLL, poller_task, NULL, &s_vcs_task_hdl);
 }
@@ -21,7 +21,14 @@
 #ifndef MAIN_POLLER_H_
 #define MAIN_POLLER_H_
 
+#include <stdint.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+
 void poller_init();
+uint32_t poller_get_missed();
+TickType_t poller_next(TickType_t last, uint32_t interval, uint32_t phase,
+		TickType_t now, const struct timeval *tv);
 
 
 
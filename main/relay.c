@@ -0,0 +1,377 @@
+/*
+ * relay.c
+ *
+ * ESP-NOW relay from proxies without WiFi to a connected gateway proxy
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * An edge sends the readings of each poll cycle in batches, every frame is
+ * acknowledged by the gateway. Until a gateway has answered, frames are
+ * broadcast; with no channel configured the edge moves to the next channel
+ * after RELAY_HOP_AFTER unanswered frames, until it finds the gateway's.
+ */
+
+#include <string.h>
+#include <math.h>
+
+//#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "esp_wifi.h"
+#include "esp_now.h"
+#include "esp_timer.h"
+#include "conf.h"
+#include "bt.h"
+#include "wifi.h"
+#include "tasks.h"
+#include "relay.h"
+
+#define RELAY_MAGIC		0x5248		// "HR"
+#define RELAY_VERSION	1
+#define RELAY_DATA		1
+#define RELAY_ACK		2
+#define RELAY_ACK_MS	100
+#define RELAY_TRIES		3
+#define RELAY_HOP_AFTER	2			// unanswered frames before the next channel
+#define RELAY_CHANNELS	13
+#define RELAY_EDGE_AGE	(600000 / portTICK_PERIOD_MS)
+
+struct relay_hdr {
+	uint16_t magic;
+	uint8_t version;
+	uint8_t type;			// RELAY_DATA or RELAY_ACK
+	uint16_t seq;
+	uint8_t n;				// entries following
+	uint8_t reserved;
+	uint16_t rtt_ms;		// edge statistics, for the gateway to show
+	uint16_t lost;
+} __attribute__((packed));
+
+struct relay_entry {
+	uint8_t addr[6];
+	int16_t t;				// 0.1 degC, INT16_MIN if none
+	uint16_t h;				// 0.1 %, UINT16_MAX if none
+	int8_t rssi;
+	uint8_t reserved;
+} __attribute__((packed));
+
+#define RELAY_BATCH		((ESP_NOW_MAX_DATA_LEN - sizeof(struct relay_hdr)) / sizeof(struct relay_entry))
+
+static const uint8_t relay_bcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+static int relay_role;
+static struct relay_stats relay_stats;
+
+/* Edge: readings of the current poll cycle and the gateway link */
+static struct relay_entry relay_pend[CONF_MAX_IFX_CLIENTS];
+static int relay_npend;
+static uint16_t relay_seq;
+static uint8_t relay_chan;
+static int relay_chan_auto;
+static int relay_misses;			// consecutive unanswered frames
+static uint8_t relay_gw[6];
+static volatile int relay_gw_state;	// 0: unknown, 1: answered, 2: peer added
+static volatile uint16_t relay_ack_seq;
+static SemaphoreHandle_t relay_ack_sem;
+
+/* Gateway: frames are handled in a task, not in the WiFi task */
+struct relay_msg {
+	uint8_t src[6];
+	uint8_t len;
+	uint8_t data[ESP_NOW_MAX_DATA_LEN];
+};
+
+struct relay_edge {
+	uint8_t mac[6];
+	uint16_t seq;
+	uint32_t frames;
+	uint32_t gaps;
+	uint16_t edge_lost;
+	uint16_t rtt_ms;
+	TickType_t seen;			// 0 if unused
+};
+
+static struct relay_edge relay_edges[RELAY_EDGES];
+static SemaphoreHandle_t relay_mutex;
+static QueueHandle_t relay_queue;
+
+static uint64_t relay_mac_to_u64(const uint8_t *m) {
+	uint64_t a = 0;
+	int i;
+	for (i=0; i<6; i++) a = (a << 8) | m[i];
+	return a;
+}
+
+static void relay_add_peer(const uint8_t *mac) {
+	if (esp_now_is_peer_exist(mac)) return;
+	esp_now_peer_info_t peer = { 0 };
+	memcpy(peer.peer_addr, mac, 6);
+	peer.channel = 0;			// whatever the interface is on
+	peer.ifidx = WIFI_IF_STA;
+	esp_err_t err = esp_now_add_peer(&peer);
+	if (err != ESP_OK) ESP_LOGW("RLY", "Unable to add peer: %s", esp_err_to_name(err));
+}
+
+static void relay_recv_cb(const esp_now_recv_info_t *info, const uint8_t *data, int len) {
+	if (len < sizeof(struct relay_hdr)) return;
+	struct relay_hdr hdr;
+	memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.magic != RELAY_MAGIC || hdr.version != RELAY_VERSION) return;
+
+	if (relay_role == RELAY_EDGE && hdr.type == RELAY_ACK) {
+		if (relay_gw_state == 0) {
+			memcpy(relay_gw, info->src_addr, 6);
+			relay_gw_state = 1;
+		}
+		relay_ack_seq = hdr.seq;
+		xSemaphoreGive(relay_ack_sem);
+	} else if (relay_role == RELAY_GATEWAY && hdr.type == RELAY_DATA) {
+		struct relay_msg m;
+		memcpy(m.src, info->src_addr, 6);
+		m.len = len;
+		memcpy(m.data, data, len);
+		if (!xQueueSend(relay_queue, &m, 0)) ESP_LOGW("RLY", "Queue full");
+	}
+}
+
+/*
+ * Edge
+ */
+
+void relay_add(uint64_t addr, float t, float h, float rssi) {
+	if (isnan(t) && isnan(h)) return;
+	if (relay_npend >= CONF_MAX_IFX_CLIENTS) return;
+	struct relay_entry *e = &relay_pend[relay_npend++];
+	int i;
+	for (i=0; i<6; i++) e->addr[i] = addr >> (40 - 8*i);
+	e->t = isnan(t) ? INT16_MIN : lroundf(t * 10);
+	e->h = isnan(h) ? UINT16_MAX : lroundf(h * 10);
+	e->rssi = isnan(rssi) ? 0 : lroundf(rssi);
+	e->reserved = 0;
+}
+
+static void relay_hop() {
+	relay_chan = relay_chan % RELAY_CHANNELS + 1;
+	esp_wifi_set_channel(relay_chan, WIFI_SECOND_CHAN_NONE);
+	ESP_LOGI("RLY", "Looking for the gateway on channel %d", relay_chan);
+}
+
+/* Returns nonzero if the gateway did not acknowledge the frame */
+static int relay_send(const uint8_t *buf, int len, uint16_t seq) {
+	int tries;
+	for (tries=0; tries<RELAY_TRIES; tries++) {
+		if (relay_gw_state == 1) {
+			relay_add_peer(relay_gw);
+			relay_gw_state = 2;
+		}
+		const uint8_t *dst = relay_gw_state == 2 ? relay_gw : relay_bcast;
+
+		xSemaphoreTake(relay_ack_sem, 0);
+		int64_t start = esp_timer_get_time();
+		if (esp_now_send(dst, buf, len) != ESP_OK) continue;
+		while (xSemaphoreTake(relay_ack_sem, RELAY_ACK_MS / portTICK_PERIOD_MS)) {
+			if (relay_ack_seq != seq) continue;
+			relay_stats.rtt_ms = (esp_timer_get_time() - start) / 1000;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Sends the readings collected since the last call, called by the poller */
+void relay_flush() {
+	uint8_t buf[ESP_NOW_MAX_DATA_LEN];
+	int done = 0;
+	while (done < relay_npend) {
+		int n = relay_npend - done;
+		if (n > RELAY_BATCH) n = RELAY_BATCH;
+
+		struct relay_hdr hdr = {
+			.magic = RELAY_MAGIC,
+			.version = RELAY_VERSION,
+			.type = RELAY_DATA,
+			.seq = ++relay_seq,
+			.n = n,
+			.rtt_ms = relay_stats.rtt_ms > UINT16_MAX ? UINT16_MAX : relay_stats.rtt_ms,
+			.lost = relay_stats.lost,
+		};
+		memcpy(buf, &hdr, sizeof(hdr));
+		memcpy(buf + sizeof(hdr), &relay_pend[done], n * sizeof(struct relay_entry));
+
+		if (relay_send(buf, sizeof(hdr) + n * sizeof(struct relay_entry), hdr.seq) == 0) {
+			relay_stats.frames++;
+			relay_misses = 0;
+			done += n;
+			continue;
+		}
+
+		/* The rest of this cycle is dropped, the next one has newer readings */
+		relay_stats.lost++;
+		ESP_LOGW("RLY", "No answer from the gateway");
+		if (++relay_misses >= RELAY_HOP_AFTER) {
+			relay_misses = 0;
+			if (relay_gw_state == 2) esp_now_del_peer(relay_gw);
+			relay_gw_state = 0;
+			if (relay_chan_auto) relay_hop();
+		}
+		break;
+	}
+	relay_npend = 0;
+}
+
+/*
+ * Gateway
+ */
+
+static struct relay_edge *relay_edge_find(const uint8_t *mac, TickType_t now) {
+	struct relay_edge *e = NULL;
+	int i;
+	for (i=0; i<RELAY_EDGES; i++) {
+		struct relay_edge *it = &relay_edges[i];
+		if (it->seen != 0 && memcmp(it->mac, mac, 6) == 0) return it;
+		if (e == NULL || it->seen == 0 || (e->seen != 0 && now - it->seen > now - e->seen))
+			e = it;
+	}
+	memset(e, 0, sizeof(*e));
+	memcpy(e->mac, mac, 6);
+	return e;
+}
+
+static void relay_gw_frame(const struct relay_msg *m) {
+	struct relay_hdr hdr;
+	memcpy(&hdr, m->data, sizeof(hdr));
+	if (m->len != sizeof(hdr) + hdr.n * sizeof(struct relay_entry)) return;
+
+	/* Acknowledged first, so the round trip does not include the processing */
+	struct relay_hdr ack = {
+		.magic = RELAY_MAGIC,
+		.version = RELAY_VERSION,
+		.type = RELAY_ACK,
+		.seq = hdr.seq,
+	};
+	relay_add_peer(m->src);
+	esp_now_send(m->src, (const uint8_t *) &ack, sizeof(ack));
+
+	TickType_t now = xTaskGetTickCount();
+	xSemaphoreTake(relay_mutex, portMAX_DELAY);
+	struct relay_edge *e = relay_edge_find(m->src, now);
+	/* A repeated frame means the acknowledgement was lost, it is applied again */
+	if (e->seen != 0 && hdr.seq != e->seq) {
+		uint16_t gap = hdr.seq - e->seq - 1;
+		if (gap < 0x8000) e->gaps += gap;
+	}
+	if (e->seen == 0 || hdr.seq != e->seq) e->frames++;
+	e->seq = hdr.seq;
+	e->edge_lost = hdr.lost;
+	e->rtt_ms = hdr.rtt_ms;
+	e->seen = now | 1;
+	xSemaphoreGive(relay_mutex);
+
+	int i;
+	for (i=0; i<hdr.n; i++) {
+		struct relay_entry r;
+		memcpy(&r, m->data + sizeof(hdr) + i * sizeof(r), sizeof(r));
+		bt_relay_reading(relay_mac_to_u64(r.addr),
+				r.t == INT16_MIN ? NAN : r.t / 10.0f,
+				r.h == UINT16_MAX ? NAN : r.h / 10.0f, r.rssi);
+	}
+}
+
+static void relay_task(void *arg) {
+	static struct relay_msg m;
+	while (1) {
+		if (xQueueReceive(relay_queue, &m, portMAX_DELAY)) relay_gw_frame(&m);
+	}
+}
+
+int relay_edges_get(struct relay_edge_info *res, int max) {
+	if (relay_role != RELAY_GATEWAY) return 0;
+	TickType_t now = xTaskGetTickCount();
+	int i, n = 0;
+	xSemaphoreTake(relay_mutex, portMAX_DELAY);
+	for (i=0; i<RELAY_EDGES && n<max; i++) {
+		const struct relay_edge *e = &relay_edges[i];
+		if (e->seen == 0) continue;
+		res[n].addr = relay_mac_to_u64(e->mac);
+		res[n].frames = e->frames;
+		res[n].gaps = e->gaps;
+		res[n].edge_lost = e->edge_lost;
+		res[n].rtt_ms = e->rtt_ms;
+		res[n].age_s = (now - e->seen) * portTICK_PERIOD_MS / 1000;
+		n++;
+	}
+	xSemaphoreGive(relay_mutex);
+	return n;
+}
+
+void relay_stats_get(struct relay_stats *s) {
+	if (relay_role != RELAY_GATEWAY) {
+		*s = relay_stats;
+		return;
+	}
+	memset(s, 0, sizeof(*s));
+	TickType_t now = xTaskGetTickCount();
+	int i;
+	xSemaphoreTake(relay_mutex, portMAX_DELAY);
+	for (i=0; i<RELAY_EDGES; i++) {
+		const struct relay_edge *e = &relay_edges[i];
+		if (e->seen == 0) continue;
+		s->frames += e->frames;
+		s->lost += e->gaps;
+		if (now - e->seen >= RELAY_EDGE_AGE) continue;
+		s->edges++;
+		if (e->rtt_ms > s->rtt_ms) s->rtt_ms = e->rtt_ms;
+	}
+	xSemaphoreGive(relay_mutex);
+}
+
+int relay_mode() {
+	return relay_role;
+}
+
+/* The mode is read once, changing it needs a restart */
+void relay_init() {
+	const struct conf *c = conf_get();
+	relay_role = c->relay.mode;
+	relay_chan = c->relay.channel;
+	conf_put(c);
+	if (relay_role != RELAY_EDGE && relay_role != RELAY_GATEWAY) {
+		relay_role = RELAY_OFF;
+		return;
+	}
+
+	if (relay_role == RELAY_EDGE) {
+		/* Joining an AP would move the radio off the gateway's channel */
+		wifi_disconnect();
+		relay_ack_sem = xSemaphoreCreateBinary();
+		relay_chan_auto = relay_chan == 0 || relay_chan > RELAY_CHANNELS;
+		if (relay_chan_auto) relay_chan = 1;
+		esp_wifi_set_channel(relay_chan, WIFI_SECOND_CHAN_NONE);
+	} else {
+		relay_mutex = xSemaphoreCreateMutex();
+		relay_queue = xQueueCreate(4, sizeof(struct relay_msg));
+		task_create(TASK_RELAY, relay_task, NULL, NULL);
+	}
+
+	ESP_ERROR_CHECK(esp_now_init());
+	ESP_ERROR_CHECK(esp_now_register_recv_cb(relay_recv_cb));
+	relay_add_peer(relay_bcast);
+	ESP_LOGI("RLY", "ESP-NOW %s", relay_role == RELAY_EDGE ? "edge" : "gateway");
+}
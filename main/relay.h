@@ -0,0 +1,57 @@
+/*
+ * relay.h
+ *
+ * ESP-NOW relay from proxies without WiFi to a connected gateway proxy
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MAIN_RELAY_H_
+#define MAIN_RELAY_H_
+
+#include <stdint.h>
+
+#define RELAY_OFF		0
+#define RELAY_EDGE		1		// sends its readings to a gateway
+#define RELAY_GATEWAY	2		// reports readings of edges with its own
+
+#define RELAY_EDGES		8		// edges tracked by a gateway
+
+/* Link counters; on a gateway summed over the edges heard */
+struct relay_stats {
+	uint32_t frames;		// edge: acknowledged, gateway: received
+	uint32_t lost;			// edge: unacknowledged, gateway: gaps in the sequence
+	uint32_t rtt_ms;		// last round trip, gateway: worst of the edges
+	uint32_t edges;			// gateway: edges heard within the last 10 minutes
+};
+
+/* One edge as seen by the gateway */
+struct relay_edge_info {
+	uint64_t addr;
+	uint32_t frames;		// received
+	uint32_t gaps;			// missing from the sequence
+	uint32_t edge_lost;		// unacknowledged, as counted by the edge
+	uint32_t rtt_ms;		// round trip measured by the edge
+	uint32_t age_s;
+};
+
+void relay_init();
+int relay_mode();
+void relay_add(uint64_t addr, float t, float h, float rssi);
+void relay_flush();
+void relay_stats_get(struct relay_stats *s);
+int relay_edges_get(struct relay_edge_info *res, int max);
+
+#endif /* MAIN_RELAY_H_ */
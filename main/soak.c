@@ -0,0 +1,139 @@
+/*
+ * soak.c
+ *
+ * Synthetic sensors for QEMU soak runs
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Only built with CONFIG_HYG_SOAK. Configures CONFIG_HYG_SOAK_SENSORS
+ * sensors reporting to CONFIG_HYG_SOAK_SINK and plays the Bluetooth
+ * controller for them: every sensor advertises a MiBeacon temperature and
+ * humidity object each CONFIG_HYG_SOAK_ADV_MS. The readings walk slowly so
+ * consecutive reports differ. The heap is logged every SOAK_LOG_S.
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_HYG_SOAK
+
+#include <stdio.h>
+#include <string.h>
+
+//#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_gap_ble_api.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "conf.h"
+#include "poller.h"
+#include "tasks.h"
+#include "soak.h"
+
+#define SOAK_LOG_S		60
+
+void gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param);
+
+static esp_ble_gap_cb_param_t soak_param;
+
+/* Written once; a configuration changed from the web UI is kept */
+static void soak_configure() {
+	struct conf *c = conf_edit();
+	if (strcmp(c->influx.db, SOAK_DB) == 0) {
+		conf_abort(c);
+		return;
+	}
+	memset(c->clients, 0, sizeof(c->clients));
+	strlcpy(c->influx.host, CONFIG_HYG_SOAK_SINK, sizeof(c->influx.host));
+	strlcpy(c->influx.db, SOAK_DB, sizeof(c->influx.db));
+	c->influx.interval_s = CONFIG_HYG_SOAK_INTERVAL_S;
+	int i;
+	for (i=0; i<CONFIG_HYG_SOAK_SENSORS; i++) {
+		c->clients[i].addr = SOAK_ADDR_BASE + i;
+		snprintf(c->clients[i].name, sizeof(c->clients[i].name), "soak%d", i);
+	}
+	conf_commit(c);
+	ESP_LOGI("SOAK", "Configured %d sensors", CONFIG_HYG_SOAK_SENSORS);
+}
+
+static void soak_adv(int i, uint8_t seq) {
+	esp_ble_gap_cb_param_t *p = &soak_param;
+	uint64_t addr = SOAK_ADDR_BASE + i;
+	int16_t t = 200 + i + seq % 50;
+	uint16_t h = 400 + seq % 100;
+	int k;
+
+	memset(p, 0, sizeof(*p));
+	p->scan_rst.search_evt = ESP_GAP_SEARCH_INQ_RES_EVT;
+	for (k=0; k<6; k++) p->scan_rst.bda[k] = addr >> (8 * (5 - k));
+	p->scan_rst.rssi = -50 - i % 40;
+
+	uint8_t *a = p->scan_rst.ble_adv;
+	*a++ = 21;					// service data
+	*a++ = ESP_BLE_AD_TYPE_SERVICE_DATA;
+	*a++ = 0x95;				// UUID 0xFE95
+	*a++ = 0xFE;
+	*a++ = 0x50;				// frame control: object included
+	*a++ = 0x20;
+	*a++ = 0x5B;				// product id
+	*a++ = 0x05;
+	*a++ = seq;					// frame counter
+	for (k=0; k<6; k++) *a++ = p->scan_rst.bda[5 - k];
+	*a++ = 0x0D;				// temperature and humidity
+	*a++ = 0x10;
+	*a++ = 4;
+	*a++ = t;
+	*a++ = t >> 8;
+	*a++ = h;
+	*a++ = h >> 8;
+	p->scan_rst.adv_data_len = a - p->scan_rst.ble_adv;
+
+	gap_cb(ESP_GAP_BLE_SCAN_RESULT_EVT, p);
+}
+
+static void soak_task(void *arg) {
+	TickType_t wake = xTaskGetTickCount();
+	TickType_t step = CONFIG_HYG_SOAK_ADV_MS / CONFIG_HYG_SOAK_SENSORS / portTICK_PERIOD_MS;
+	TickType_t logged = wake;
+	uint32_t n = 0;
+	if (step == 0) step = 1;
+
+	while (1) {
+		vTaskDelayUntil(&wake, step);
+		int i = n % CONFIG_HYG_SOAK_SENSORS;
+		soak_adv(i, n / CONFIG_HYG_SOAK_SENSORS);
+		n++;
+
+		if (wake - logged >= SOAK_LOG_S * 1000 / portTICK_PERIOD_MS) {
+			logged = wake;
+			ESP_LOGI("SOAK", "heap free %u min %lu largest %u, missed %lu",
+					heap_caps_get_free_size(MALLOC_CAP_8BIT),
+					esp_get_minimum_free_heap_size(),
+					heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+					poller_get_missed());
+		}
+	}
+}
+
+void soak_init() {
+	soak_configure();
+	task_create(TASK_SOAK, soak_task, NULL, NULL);
+}
+
+#endif /* CONFIG_HYG_SOAK */
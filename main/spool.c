@@ -0,0 +1,180 @@
+/*
+ * spool.c
+ *
+ * Flash buffer for readings that could not be sent
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+//#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_partition.h"
+#include "conf.h"
+#include "influx.h"
+#include "wifi.h"
+#include "tslog.h"
+#include "tasks.h"
+#include "spool.h"
+
+#define SPOOL_PARTITION		"tslog"
+#define SPOOL_TIME_VALID	1577836800	// 2020-01-01, earlier means no SNTP yet
+#define SPOOL_RETRY_MS		10000
+#define SPOOL_PACE_MS		20			// between replayed frames
+
+static const esp_partition_t *spool_part;
+static struct tslog spool_log;
+static SemaphoreHandle_t spool_mutex;
+static int spool_ok;
+
+/* Records of the current poll cycle, written as one frame */
+static struct tslog_rec spool_pend[TSLOG_FRAME_RECS];
+static int spool_npend;
+static uint32_t spool_time;
+
+static int spool_read(void *ctx, uint32_t off, void *buf, size_t len) {
+	return esp_partition_read(spool_part, off, buf, len) != ESP_OK;
+}
+
+static int spool_write(void *ctx, uint32_t off, const void *buf, size_t len) {
+	return esp_partition_write(spool_part, off, buf, len) != ESP_OK;
+}
+
+static int spool_erase(void *ctx, uint32_t off) {
+	return esp_partition_erase_range(spool_part, off, TSLOG_SECTOR) != ESP_OK;
+}
+
+static struct tslog_flash spool_flash = {
+	.read = spool_read,
+	.write = spool_write,
+	.erase = spool_erase,
+};
+
+static int16_t spool_val(float v) {
+	if (isnan(v)) return TSLOG_NONE;
+	return lroundf(v * 10);
+}
+
+static float spool_float(int16_t v) {
+	return v == TSLOG_NONE ? NAN : v / 10.0f;
+}
+
+/* Copies the current name of a sensor, returns nonzero if it was removed since */
+static int spool_name(uint64_t addr, char *name) {
+	const struct conf *c = conf_get();
+	int j;
+	for (j=0; j<CONF_MAX_IFX_CLIENTS; j++) {
+		if (c->clients[j].addr == addr) break;
+	}
+	int err = j == CONF_MAX_IFX_CLIENTS || c->clients[j].name[0] == '\0';
+	if (!err) memcpy(name, c->clients[j].name, CONF_IFX_CLI_NAME_LEN);
+	conf_put(c);
+	return err;
+}
+
+/* Sends one frame, returns nonzero if the server could not be reached */
+static int spool_replay(uint32_t time, const struct tslog_rec *recs, int n) {
+	int i, err = 0;
+	for (i=0; i<n && !err; i++) {
+		/* Sensors removed since are dropped */
+		char name[CONF_IFX_CLI_NAME_LEN];
+		if (spool_name(recs[i].addr, name)) continue;
+
+		uint64_t a = recs[i].addr;
+		esp_bd_addr_t adr = { a>>40, a>>32, a>>24, a>>16, a>>8, a };
+		err = influx_report_at(adr, name,
+				spool_float(recs[i].t), spool_float(recs[i].h), time);
+	}
+	return err;
+}
+
+static void spool_task(void *arg) {
+	static struct tslog_rec recs[TSLOG_FRAME_RECS];
+	while (1) {
+		if (!wifi_wait_conn(SPOOL_RETRY_MS)) continue;
+
+		struct tslog_pos pos;
+		uint32_t time;
+		xSemaphoreTake(spool_mutex, portMAX_DELAY);
+		int n = tslog_read(&spool_log, &pos, &time, recs);
+		xSemaphoreGive(spool_mutex);
+
+		if (n <= 0 || spool_replay(time, recs, n)) {
+			vTaskDelay(SPOOL_RETRY_MS / portTICK_PERIOD_MS);
+			continue;
+		}
+
+		xSemaphoreTake(spool_mutex, portMAX_DELAY);
+		tslog_ack(&spool_log, &pos);
+		xSemaphoreGive(spool_mutex);
+		vTaskDelay(SPOOL_PACE_MS / portTICK_PERIOD_MS);
+	}
+}
+
+void spool_init() {
+	spool_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+			ESP_PARTITION_SUBTYPE_ANY, SPOOL_PARTITION);
+	if (spool_part == NULL) {
+		ESP_LOGW("SPOOL", "No %s partition, readings are not buffered", SPOOL_PARTITION);
+		return;
+	}
+
+	spool_mutex = xSemaphoreCreateMutex();
+	spool_flash.size = spool_part->size / TSLOG_SECTOR * TSLOG_SECTOR;
+	if (tslog_mount(&spool_log, &spool_flash)) {
+		ESP_LOGE("SPOOL", "Log unreadable, erasing");
+		esp_partition_erase_range(spool_part, 0, spool_flash.size);
+		if (tslog_mount(&spool_log, &spool_flash)) return;
+	}
+	spool_ok = 1;
+
+	task_create(TASK_SPOOL, spool_task, NULL, NULL);
+	ESP_LOGI("SPOOL", "Initialized, %lu KB", (unsigned long) spool_flash.size / 1024);
+}
+
+/* Buffers a reading that could not be sent; needs the wall clock time */
+void spool_add(uint64_t addr, float t, float h) {
+	if (!spool_ok || (isnan(t) && isnan(h))) return;
+	time_t now = time(NULL);
+	if (now < SPOOL_TIME_VALID) return;
+
+	if (spool_npend == 0) spool_time = now;
+	spool_pend[spool_npend].addr = addr;
+	spool_pend[spool_npend].t = spool_val(t);
+	spool_pend[spool_npend].h = spool_val(h);
+	if (++spool_npend == TSLOG_FRAME_RECS) spool_flush();
+}
+
+/* Ends a poll cycle */
+void spool_flush() {
+	if (spool_npend == 0) return;
+	xSemaphoreTake(spool_mutex, portMAX_DELAY);
+	if (tslog_append(&spool_log, spool_time, spool_pend, spool_npend)) {
+		ESP_LOGE("SPOOL", "Write failed");
+	}
+	xSemaphoreGive(spool_mutex);
+	spool_npend = 0;
+}
+
+uint32_t spool_get_dropped() {
+	return spool_ok ? spool_log.dropped : 0;
+}
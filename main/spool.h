@@ -0,0 +1,31 @@
+/*
+ * spool.h
+ *
+ * Flash buffer for readings that could not be sent
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MAIN_SPOOL_H_
+#define MAIN_SPOOL_H_
+
+#include <stdint.h>
+
+void spool_init();
+void spool_add(uint64_t addr, float t, float h);
+void spool_flush();
+uint32_t spool_get_dropped();
+
+#endif /* MAIN_SPOOL_H_ */
@@ -0,0 +1,96 @@
+/*
+ * stats.c
+ *
+ * Hot path latency histograms
+ *
+ * Every sample is a few relaxed atomic adds, so the measured paths take no
+ * lock and never block on a reader. Sections are timed with the CPU cycle
+ * counter, which is per core; the measured tasks are pinned (see tasks.c)
+ * and the clock is fixed, as power management is off. A reset racing a
+ * writer may leave that one sample counted in some fields only.
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sdkconfig.h"
+#include "stats.h"
+
+static struct stats_hist stats_hist[STATS_COUNT];
+
+static const char *stats_names[STATS_COUNT] = {
+	[STATS_GAP_CB] = "gap_cb",
+	[STATS_BT_LOCK] = "bt_lock",
+	[STATS_INFLUX_SEND] = "influx_send",
+	[STATS_HTTP_CONF] = "http_conf",
+	[STATS_POLL_LATE] = "poll_late",
+};
+
+void stats_add(enum stats_id id, uint32_t us) {
+	struct stats_hist *h = &stats_hist[id];
+	int b = us == 0 ? 0 : 32 - __builtin_clz(us);
+	if (b >= STATS_BUCKETS) b = STATS_BUCKETS - 1;
+
+	__atomic_fetch_add(&h->bucket[b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	uint32_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&h->max_us, &max, us, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void stats_end(enum stats_id id, uint32_t begin) {
+	uint32_t cycles = esp_cpu_get_cycle_count() - begin;	// wraps after 26 s at 160 MHz
+	stats_add(id, cycles / CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+}
+
+void stats_get(enum stats_id id, struct stats_hist *h) {
+	const struct stats_hist *s = &stats_hist[id];
+	int i;
+	h->count = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+	h->max_us = __atomic_load_n(&s->max_us, __ATOMIC_RELAXED);
+	for (i=0; i<STATS_BUCKETS; i++) {
+		h->bucket[i] = __atomic_load_n(&s->bucket[i], __ATOMIC_RELAXED);
+	}
+}
+
+/* Upper bound of the bucket holding the given percentile, capped by the maximum */
+uint32_t stats_pct(const struct stats_hist *h, int pct) {
+	uint32_t total = 0;
+	int i;
+	for (i=0; i<STATS_BUCKETS; i++) total += h->bucket[i];
+	if (total == 0) return 0;
+
+	uint64_t want = ((uint64_t) total * pct + 99) / 100;
+	uint32_t seen = 0;
+	for (i=0; i<STATS_BUCKETS-1; i++) {
+		seen += h->bucket[i];
+		if (seen >= want) break;
+	}
+	uint32_t top = i == 0 ? 0 : (1UL << i) - 1;
+	return i == STATS_BUCKETS-1 || top > h->max_us ? h->max_us : top;
+}
+
+const char *stats_name(enum stats_id id) {
+	return stats_names[id];
+}
+
+void stats_reset() {
+	int id, i;
+	for (id=0; id<STATS_COUNT; id++) {
+		struct stats_hist *h = &stats_hist[id];
+		__atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&h->max_us, 0, __ATOMIC_RELAXED);
+		for (i=0; i<STATS_BUCKETS; i++) __atomic_store_n(&h->bucket[i], 0, __ATOMIC_RELAXED);
+	}
+}
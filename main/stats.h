@@ -0,0 +1,57 @@
+/*
+ * stats.h
+ *
+ * Hot path latency histograms
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MAIN_STATS_H_
+#define MAIN_STATS_H_
+
+#include <stdint.h>
+#include "esp_cpu.h"
+
+enum stats_id {
+	STATS_GAP_CB,		// advertisement processing in gap_cb()
+	STATS_BT_LOCK,		// waits for bt_mutex
+	STATS_INFLUX_SEND,	// one datagram to the Influx host
+	STATS_HTTP_CONF,	// GET /api/conf.json
+	STATS_POLL_LATE,	// poller wake-up after its vTaskDelayUntil() deadline, tick resolution
+	STATS_COUNT
+};
+
+/* Bucket 0 counts 0 us, bucket i counts [2^(i-1), 2^i) us, the last one the rest */
+#define STATS_BUCKETS	24
+
+struct stats_hist {
+	uint32_t count;
+	uint32_t max_us;
+	uint32_t bucket[STATS_BUCKETS];
+};
+
+/* Start of a measured section, pass to stats_end() on the same core */
+static inline uint32_t stats_begin() {
+	return esp_cpu_get_cycle_count();
+}
+
+void stats_end(enum stats_id id, uint32_t begin);
+void stats_add(enum stats_id id, uint32_t us);
+void stats_get(enum stats_id id, struct stats_hist *h);
+uint32_t stats_pct(const struct stats_hist *h, int pct);
+const char *stats_name(enum stats_id id);
+void stats_reset();
+
+#endif /* MAIN_STATS_H_ */
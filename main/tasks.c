@@ -0,0 +1,87 @@
+/*
+ * tasks.c
+ *
+ * Core affinity, priority and stack size of the firmware tasks
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Scan results are handled in Bluedroid's BTC task, which runs at priority
+ * 19 on TASK_CORE_BLE next to the controller. Everything that talks to the
+ * network runs on the other core at CONFIG_HYG_PRIO_* (at most 17, under
+ * the lwIP task), so neither reports nor web UI traffic can delay a scan
+ * result. Among those the poller comes first, then the background senders,
+ * then the HTTP server, spooling to flash and log output last.
+ *
+ * Stack sizes are in bytes. task_check_stacks() warns when a task's high
+ * water mark comes within CONFIG_HYG_STACK_MARGIN of its size; the `tasks`
+ * console command lists them all.
+ */
+
+//#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "tasks.h"
+
+#if !CONFIG_FREERTOS_UNICORE && CONFIG_BT_BLUEDROID_PINNED_TO_CORE != CONFIG_HYG_CORE_BLE
+#warning "Bluedroid is pinned to another core than CONFIG_HYG_CORE_BLE"
+#endif
+
+const struct task_layout task_layout[TASK_COUNT] = {
+	[TASK_POLL]		= { "pollT",	4096, CONFIG_HYG_PRIO_POLL,		TASK_CORE_NET },
+	[TASK_HTTPD]	= { "httpd",	4096, CONFIG_HYG_PRIO_HTTPD,	TASK_CORE_NET },
+	[TASK_FWD]		= { "fwdT",		3072, CONFIG_HYG_PRIO_NET,		TASK_CORE_NET },
+	[TASK_GOSSIP]	= { "gossipT",	3072, CONFIG_HYG_PRIO_NET,		TASK_CORE_NET },
+	[TASK_RELAY]	= { "relayT",	3072, CONFIG_HYG_PRIO_POLL,		TASK_CORE_NET },
+	[TASK_SPOOL]	= { "spoolT",	3072, CONFIG_HYG_PRIO_SPOOL,	TASK_CORE_NET },
+	[TASK_SOAK]		= { "soakT",	3072, CONFIG_HYG_PRIO_POLL,		TASK_CORE_BLE },
+	[TASK_LOG]		= { "logT",		3072, CONFIG_HYG_PRIO_LOG,		TASK_CORE_NET },
+	[TASK_BTC]		= { "BTC_TASK",	CONFIG_BT_BTC_TASK_STACK_SIZE,		0, TASK_CORE_BLE },
+	[TASK_BTU]		= { "BTU_TASK",	CONFIG_BT_BTU_TASK_STACK_SIZE,		0, TASK_CORE_BLE },
+	[TASK_TCPIP]	= { "tiT",		CONFIG_LWIP_TCPIP_TASK_STACK_SIZE,	0, TASK_CORE_NET },
+	[TASK_MAIN]		= { "main",		CONFIG_ESP_MAIN_TASK_STACK_SIZE,	0, TASK_CORE_NET },
+};
+
+static TaskHandle_t task_hdl[TASK_COUNT];
+
+BaseType_t task_create(enum task_id id, TaskFunction_t fn, void *arg, TaskHandle_t *hdl) {
+	const struct task_layout *t = &task_layout[id];
+	BaseType_t res = xTaskCreatePinnedToCore(fn, t->name, t->stack, arg, t->prio,
+			&task_hdl[id], t->core);
+	if (res != pdPASS) ESP_LOGE("TASK", "Creating %s failed", t->name);
+	else if (hdl) *hdl = task_hdl[id];
+	return res;
+}
+
+/* Least free stack seen so far in bytes, 0 if the task does not run */
+uint32_t task_stack_free(enum task_id id) {
+	if (task_hdl[id] == NULL) task_hdl[id] = xTaskGetHandle(task_layout[id].name);
+	if (task_hdl[id] == NULL) return 0;
+	return uxTaskGetStackHighWaterMark(task_hdl[id]);
+}
+
+/* Warns about tasks short of stack, returns how many are */
+int task_check_stacks() {
+	int id, n = 0;
+	for (id=0; id<TASK_COUNT; id++) {
+		uint32_t left = task_stack_free(id);
+		if (task_hdl[id] == NULL || left >= CONFIG_HYG_STACK_MARGIN) continue;
+		ESP_LOGW("TASK", "%s: %lu of %lu bytes of stack left", task_layout[id].name,
+				(unsigned long) left, (unsigned long) task_layout[id].stack);
+		n++;
+	}
+	return n;
+}
@@ -0,0 +1,67 @@
+/*
+ * tasks.h
+ *
+ * Core affinity, priority and stack size of the firmware tasks
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MAIN_TASKS_H_
+#define MAIN_TASKS_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#if CONFIG_FREERTOS_UNICORE
+#define TASK_CORE_BLE	0
+#define TASK_CORE_NET	0
+#else
+#define TASK_CORE_BLE	CONFIG_HYG_CORE_BLE			// Bluetooth host, scan results
+#define TASK_CORE_NET	(1 - CONFIG_HYG_CORE_BLE)	// network, reporting, HTTP
+#endif
+
+enum task_id {
+	TASK_POLL,
+	TASK_HTTPD,
+	TASK_FWD,
+	TASK_GOSSIP,
+	TASK_RELAY,
+	TASK_SPOOL,
+	TASK_SOAK,
+	TASK_LOG,
+	/* Created by ESP-IDF, listed for the stack check */
+	TASK_BTC,
+	TASK_BTU,
+	TASK_TCPIP,
+	TASK_MAIN,
+	TASK_COUNT
+};
+
+struct task_layout {
+	const char *name;
+	uint32_t stack;			// bytes
+	UBaseType_t prio;		// 0: set by ESP-IDF
+	BaseType_t core;
+};
+
+extern const struct task_layout task_layout[TASK_COUNT];
+
+BaseType_t task_create(enum task_id id, TaskFunction_t fn, void *arg, TaskHandle_t *hdl);
+uint32_t task_stack_free(enum task_id id);
+int task_check_stacks();
+
+#endif /* MAIN_TASKS_H_ */
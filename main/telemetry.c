@@ -0,0 +1,121 @@
+/*
+ * telemetry.c
+ *
+ * Proxy self-telemetry
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+//#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "bt.h"
+#include "influx.h"
+#include "wifi.h"
+#include "spool.h"
+#include "gossip.h"
+#include "relay.h"
+#include "fwd.h"
+#include "poller.h"
+#include "tasks.h"
+#include "logbuf.h"
+#include "telemetry.h"
+
+static struct bt_stats last_stats;
+static TickType_t last_tick;
+
+static float telemetry_rate(uint32_t cur, uint32_t prev, TickType_t ticks) {
+	if (ticks == 0) return 0;
+	return (cur - prev) * (float)configTICK_RATE_HZ / ticks;
+}
+
+/* Called from the poller task once per reporting interval */
+void telemetry_report() {
+	char fields[512];
+	struct bt_stats st;
+	bt_stats_get(&st);
+	struct logbuf_stats log;
+	logbuf_stats_get(&log);
+
+	TickType_t now = xTaskGetTickCount();
+	TickType_t dt = now - last_tick;
+	int first = (last_tick == 0);
+	last_tick = now;
+
+	int len = snprintf(fields, sizeof(fields),
+			"heap_free=%ui,heap_min=%lui,heap_blk=%ui,"
+			"stk_poll=%lui,stk_httpd=%lui,stk_btc=%lui,stk_low=%ui,"
+			"mtx_to=%lui,udp_err=%lui,reconn=%lui,ttfr=%lui,spool_drop=%lui,peers=%lui,missed=%lui,"
+			"log_drop=%lui",
+			heap_caps_get_free_size(MALLOC_CAP_8BIT),
+			esp_get_minimum_free_heap_size(),
+			heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+			task_stack_free(TASK_POLL),
+			task_stack_free(TASK_HTTPD),
+			task_stack_free(TASK_BTC),
+			task_check_stacks(),
+			st.mutex_timeouts,
+			influx_get_send_errors(),
+			wifi_get_reconnects(),
+			wifi_get_ttfr(),
+			spool_get_dropped(),
+			gossip_get_peers(),
+			poller_get_missed(),
+			log.dropped + log.limited);
+	if (len >= sizeof(fields)) return;
+
+	if (!first) {
+		len += snprintf(fields+len, sizeof(fields)-len,
+				",adv_seen=%.1f,adv_match=%.1f,adv_dec=%.1f,scan_duty=%.3f",
+				telemetry_rate(st.adv_seen, last_stats.adv_seen, dt),
+				telemetry_rate(st.adv_matched, last_stats.adv_matched, dt),
+				telemetry_rate(st.adv_decoded, last_stats.adv_decoded, dt),
+				telemetry_rate(st.scan_ms, last_stats.scan_ms, dt) / 1000);
+		if (len >= sizeof(fields)) return;
+	}
+	last_stats = st;
+
+	int8_t rssi;
+	if (wifi_get_rssi(&rssi)) {
+		len += snprintf(fields+len, sizeof(fields)-len, ",rssi=%di", rssi);
+		if (len >= sizeof(fields)) return;
+	}
+
+	struct fwd_stats fs;
+	fwd_stats_get(&fs);
+	if (fs.recs != 0 || fs.drops != 0) {
+		len += snprintf(fields+len, sizeof(fields)-len,
+				",fwd_rec=%lui,fwd_dgram=%lui,fwd_rate_drop=%lui,fwd_drop=%lui",
+				fs.recs, fs.datagrams, fs.rate_drops, fs.drops);
+		if (len >= sizeof(fields)) return;
+	}
+
+	if (relay_mode() == RELAY_GATEWAY) {
+		struct relay_stats rs;
+		relay_stats_get(&rs);
+		len += snprintf(fields+len, sizeof(fields)-len,
+				",rly_edges=%lui,rly_frm=%lui,rly_lost=%lui,rly_rtt=%lui",
+				rs.edges, rs.frames, rs.lost, rs.rtt_ms);
+		if (len >= sizeof(fields)) return;
+	}
+
+	influx_report_proxy(fields);
+}
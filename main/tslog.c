@@ -0,0 +1,429 @@
+/*
+ * tslog.c
+ *
+ * Compressed time-series log in flash
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The log is a ring of flash sectors, each starting with a header carrying a
+ * sequence number; the highest one is written to, the lowest one is replayed
+ * first. Sectors are erased in turn, so wear is even. A sector holds frames,
+ * one per poll cycle:
+ *
+ *   len (u16) | nrec (u8) | flags (u8) | crc32 of payload | payload
+ *
+ * The payload is a bitstream. The frame time is a delta-of-delta against
+ * the previous frame of the sector, like in Facebook's Gorilla. Readings
+ * are fixed point, so they are coded as deltas against the previous reading
+ * of the same sensor in the sector instead of Gorilla's float XOR. Sensors
+ * are named by a full address the first time in a sector and by index
+ * after that. A steady sensor takes about 9 bits per record.
+ *
+ * The payload is written before the header, so a torn frame reads as blank
+ * space with garbage in it; such a sector is left for the next one. The
+ * pending flag is cleared in place once a frame has been replayed.
+ */
+
+#include <string.h>
+
+#include "esp_rom_crc.h"
+#include "tslog.h"
+
+#define TSLOG_MAGIC			0x474c5354	// "TSLG"
+#define TSLOG_F_PENDING		0x01
+
+struct tslog_sect_hdr {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t seq_inv;		// ~seq, catches torn header writes
+	uint32_t reserved;
+};
+
+struct tslog_frame_hdr {
+	uint16_t len;
+	uint8_t nrec;
+	uint8_t flags;
+	uint32_t crc;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+struct tslog_bits {
+	uint8_t *buf;
+	uint32_t size;			// bytes
+	uint32_t pos;			// bits
+	int err;
+};
+
+static void tslog_put(struct tslog_bits *b, uint32_t v, int n) {
+	while (n-- > 0) {
+		if (b->pos >= b->size * 8) {
+			b->err = 1;
+			return;
+		}
+		uint8_t mask = 0x80 >> (b->pos % 8);
+		if ((v >> n) & 1) b->buf[b->pos / 8] |= mask;
+		else b->buf[b->pos / 8] &= ~mask;
+		b->pos++;
+	}
+}
+
+static uint32_t tslog_get(struct tslog_bits *b, int n) {
+	uint32_t v = 0;
+	while (n-- > 0) {
+		if (b->pos >= b->size * 8) {
+			b->err = 1;
+			return 0;
+		}
+		v = (v << 1) | ((b->buf[b->pos / 8] >> (7 - b->pos % 8)) & 1);
+		b->pos++;
+	}
+	return v;
+}
+
+static int32_t tslog_get_signed(struct tslog_bits *b, int n) {
+	uint32_t v = tslog_get(b, n);
+	if (n < 32 && (v & (1u << (n - 1)))) v |= ~0u << n;
+	return v;
+}
+
+/* Number of leading one bits, up to max */
+static int tslog_get_prefix(struct tslog_bits *b, int max) {
+	int n = 0;
+	while (n < max && tslog_get(b, 1)) n++;
+	return n;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void tslog_codec_reset(struct tslog_codec *c, uint32_t sect, uint32_t seq) {
+	c->sect = sect;
+	c->seq = seq;
+	c->off = sizeof(struct tslog_sect_hdr);
+	c->prev_time = 0;
+	c->prev_dt = 0;
+	c->nframes = 0;
+	c->ndict = 0;
+}
+
+static void tslog_put_time(struct tslog_codec *c, struct tslog_bits *b, uint32_t time) {
+	if (c->nframes == 0) {
+		tslog_put(b, time, 32);
+	} else {
+		int32_t dt = time - c->prev_time;
+		int32_t dod = dt - c->prev_dt;
+		if (dod == 0) tslog_put(b, 0, 1);
+		else if (dod >= -64 && dod < 64) { tslog_put(b, 0x2, 2); tslog_put(b, dod, 7); }
+		else if (dod >= -256 && dod < 256) { tslog_put(b, 0x6, 3); tslog_put(b, dod, 9); }
+		else if (dod >= -2048 && dod < 2048) { tslog_put(b, 0xE, 4); tslog_put(b, dod, 12); }
+		else { tslog_put(b, 0xF, 4); tslog_put(b, dod, 32); }
+		c->prev_dt = dt;
+	}
+	c->prev_time = time;
+}
+
+static uint32_t tslog_get_time(struct tslog_codec *c, struct tslog_bits *b) {
+	uint32_t time;
+	if (c->nframes == 0) {
+		time = tslog_get(b, 32);
+	} else {
+		static const uint8_t bits[] = { 0, 7, 9, 12, 32 };
+		int32_t dod = 0;
+		int p = tslog_get_prefix(b, 4);
+		if (p > 0) dod = tslog_get_signed(b, bits[p]);
+		c->prev_dt += dod;
+		time = c->prev_time + c->prev_dt;
+	}
+	c->prev_time = time;
+	return time;
+}
+
+static void tslog_put_val(struct tslog_bits *b, int16_t *prev, int16_t v) {
+	if (v == TSLOG_NONE) {
+		tslog_put(b, 0xF, 4);
+		return;
+	}
+	int32_t d = v - *prev;
+	if (d == 0) tslog_put(b, 0, 1);
+	else if (d >= -8 && d < 8) { tslog_put(b, 0x2, 2); tslog_put(b, d, 4); }
+	else if (d >= -128 && d < 128) { tslog_put(b, 0x6, 3); tslog_put(b, d, 8); }
+	else { tslog_put(b, 0xE, 4); tslog_put(b, (uint16_t) v, 16); }
+	*prev = v;
+}
+
+static int16_t tslog_get_val(struct tslog_bits *b, int16_t *prev) {
+	switch (tslog_get_prefix(b, 4)) {
+	case 0: break;
+	case 1: *prev += tslog_get_signed(b, 4); break;
+	case 2: *prev += tslog_get_signed(b, 8); break;
+	case 3: *prev = tslog_get_signed(b, 16); break;
+	default: return TSLOG_NONE;
+	}
+	return *prev;
+}
+
+/* Returns nonzero if the sector has no room for another sensor */
+static int tslog_put_rec(struct tslog_codec *c, struct tslog_bits *b, const struct tslog_rec *r) {
+	int i;
+	for (i=0; i<c->ndict; i++) {
+		if (c->dict[i].addr == r->addr) break;
+	}
+	if (i < c->ndict) {
+		tslog_put(b, 0, 1);
+		tslog_put(b, i, 6);
+	} else {
+		if (c->ndict == TSLOG_DICT) return 1;
+		tslog_put(b, 1, 1);
+		tslog_put(b, r->addr >> 32, 16);
+		tslog_put(b, r->addr, 32);
+		c->dict[i].addr = r->addr;
+		c->dict[i].v[0] = c->dict[i].v[1] = 0;
+		c->ndict++;
+	}
+	tslog_put_val(b, &c->dict[i].v[0], r->t);
+	tslog_put_val(b, &c->dict[i].v[1], r->h);
+	return 0;
+}
+
+static int tslog_get_rec(struct tslog_codec *c, struct tslog_bits *b, struct tslog_rec *r) {
+	int i;
+	if (tslog_get(b, 1)) {
+		if (c->ndict == TSLOG_DICT) return 1;
+		i = c->ndict++;
+		c->dict[i].addr = (uint64_t) tslog_get(b, 16) << 32;
+		c->dict[i].addr |= tslog_get(b, 32);
+		c->dict[i].v[0] = c->dict[i].v[1] = 0;
+	} else {
+		i = tslog_get(b, 6);
+		if (i >= c->ndict) return 1;
+	}
+	r->addr = c->dict[i].addr;
+	r->t = tslog_get_val(b, &c->dict[i].v[0]);
+	r->h = tslog_get_val(b, &c->dict[i].v[1]);
+	return b->err;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static int tslog_sect_seq(struct tslog *l, uint32_t sect, uint32_t *seq) {
+	struct tslog_sect_hdr h;
+	if (l->fl->read(l->fl->ctx, sect * TSLOG_SECTOR, &h, sizeof(h))) return -1;
+	if (h.magic != TSLOG_MAGIC || h.seq != ~h.seq_inv) return -1;
+	*seq = h.seq;
+	return 0;
+}
+
+/* Erases the sector after the current one and starts writing there */
+static int tslog_next_sector(struct tslog *l) {
+	uint32_t sect = (l->wr.sect + 1) % l->nsect;
+	uint32_t seq;
+	if (sect == l->rd.sect && tslog_sect_seq(l, sect, &seq) == 0 && seq == l->rd.seq) {
+		/* Replay has not got past it: the data is lost, replay the next one */
+		l->dropped++;
+		uint32_t next = (sect + 1) % l->nsect;
+		if (tslog_sect_seq(l, next, &seq) == 0) tslog_codec_reset(&l->rd, next, seq);
+	}
+
+	struct tslog_sect_hdr h = {
+		.magic = TSLOG_MAGIC,
+		.seq = l->wr.seq + 1,
+		.seq_inv = ~(l->wr.seq + 1),
+		.reserved = 0xFFFFFFFF,
+	};
+	tslog_codec_reset(&l->wr, sect, h.seq);
+	if (l->fl->erase(l->fl->ctx, sect * TSLOG_SECTOR)) return -1;
+	return l->fl->write(l->fl->ctx, sect * TSLOG_SECTOR, &h, sizeof(h));
+}
+
+/*
+ * Decodes the frame at c->off and advances past it. Returns the number of
+ * records, 0 at the end of the sector's frames and -1 if the frame is bad.
+ * recs may be NULL to only follow the codec state.
+ */
+static int tslog_frame(struct tslog *l, struct tslog_codec *c, uint8_t *flags,
+		uint32_t *time, struct tslog_rec *recs) {
+	struct tslog_frame_hdr fh;
+	uint32_t base = c->sect * TSLOG_SECTOR;
+	if (c->off + sizeof(fh) > TSLOG_SECTOR) return 0;
+	if (l->fl->read(l->fl->ctx, base + c->off, &fh, sizeof(fh))) return -1;
+	if (fh.len == 0xFFFF) return 0;
+	if (fh.len > TSLOG_FRAME_MAX || c->off + sizeof(fh) + fh.len > TSLOG_SECTOR ||
+			fh.nrec == 0 || fh.nrec > TSLOG_FRAME_RECS) return -1;
+	if (l->fl->read(l->fl->ctx, base + c->off + sizeof(fh), l->buf, fh.len)) return -1;
+	if (esp_rom_crc32_le(0, l->buf, fh.len) != fh.crc) return -1;
+
+	struct tslog_bits b = { .buf = l->buf, .size = fh.len };
+	uint32_t t = tslog_get_time(c, &b);
+	int i;
+	for (i=0; i<fh.nrec; i++) {
+		struct tslog_rec r;
+		if (tslog_get_rec(c, &b, &r)) return -1;
+		if (recs) recs[i] = r;
+	}
+
+	c->off += sizeof(fh) + fh.len;
+	c->nframes++;
+	if (flags) *flags = fh.flags;
+	if (time) *time = t;
+	return fh.nrec;
+}
+
+static int tslog_blank(struct tslog *l, uint32_t off, uint32_t len) {
+	while (len > 0) {
+		uint32_t n = len < sizeof(l->buf) ? len : sizeof(l->buf);
+		if (l->fl->read(l->fl->ctx, off, l->buf, n)) return 0;
+		uint32_t i;
+		for (i=0; i<n; i++) {
+			if (l->buf[i] != 0xFF) return 0;
+		}
+		off += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/* Points the replay cursor to the start of the oldest sector */
+static void tslog_rewind(struct tslog *l) {
+	uint32_t i, seq, best = l->wr.sect, best_seq = l->wr.seq;
+	for (i=0; i<l->nsect; i++) {
+		if (tslog_sect_seq(l, i, &seq)) continue;
+		if (seq <= l->wr.seq && seq < best_seq) {
+			best = i;
+			best_seq = seq;
+		}
+	}
+	tslog_codec_reset(&l->rd, best, best_seq);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/* Finds the newest sector and the end of its frames, formats a blank log */
+int tslog_mount(struct tslog *l, const struct tslog_flash *fl) {
+	memset(l, 0, sizeof(*l));
+	l->fl = fl;
+	l->nsect = fl->size / TSLOG_SECTOR;
+	if (l->nsect < 2) return -1;
+
+	uint32_t i, seq;
+	int found = 0;
+	for (i=0; i<l->nsect; i++) {
+		if (tslog_sect_seq(l, i, &seq)) continue;
+		if (!found || seq > l->wr.seq) {
+			l->wr.sect = i;
+			l->wr.seq = seq;
+		}
+		found = 1;
+	}
+
+	if (!found) {
+		l->wr.sect = l->nsect - 1;
+		l->wr.seq = 0;
+		if (tslog_next_sector(l)) return -1;
+	} else {
+		tslog_codec_reset(&l->wr, l->wr.sect, l->wr.seq);
+		while (tslog_frame(l, &l->wr, NULL, NULL, NULL) > 0);
+		/* A torn or corrupt frame: leave the rest of the sector alone */
+		uint32_t base = l->wr.sect * TSLOG_SECTOR;
+		if (!tslog_blank(l, base + l->wr.off, TSLOG_SECTOR - l->wr.off)) {
+			if (tslog_next_sector(l)) return -1;
+		}
+	}
+
+	tslog_rewind(l);
+	return 0;
+}
+
+/* Appends the records of one poll cycle as a frame */
+int tslog_append(struct tslog *l, uint32_t time, const struct tslog_rec *recs, int n) {
+	if (n <= 0 || n > TSLOG_FRAME_RECS) return -1;
+
+	struct tslog_bits b;
+	int i, attempt;
+	for (attempt=0; ; attempt++) {
+		/* A failed attempt leaves the codec state unusable, a new sector resets it */
+		if (attempt > 0 && (attempt > 1 || tslog_next_sector(l))) return -1;
+
+		b = (struct tslog_bits) { .buf = l->buf, .size = sizeof(l->buf) };
+		tslog_put_time(&l->wr, &b, time);
+		for (i=0; i<n && !b.err; i++) {
+			if (tslog_put_rec(&l->wr, &b, &recs[i])) b.err = 1;
+		}
+		if (!b.err && l->wr.off + sizeof(struct tslog_frame_hdr) + (b.pos + 7) / 8 <= TSLOG_SECTOR) break;
+	}
+
+	struct tslog_frame_hdr fh = {
+		.len = (b.pos + 7) / 8,
+		.nrec = n,
+		.flags = 0xFF,
+	};
+	/* Padding bits of the last byte */
+	tslog_put(&b, 0, fh.len * 8 - b.pos);
+	fh.crc = esp_rom_crc32_le(0, l->buf, fh.len);
+
+	uint32_t off = l->wr.sect * TSLOG_SECTOR + l->wr.off;
+	if (l->fl->write(l->fl->ctx, off + sizeof(fh), l->buf, fh.len) ||
+			l->fl->write(l->fl->ctx, off, &fh, sizeof(fh))) {
+		/* The sector may hold a partial frame now */
+		tslog_next_sector(l);
+		return -1;
+	}
+	l->wr.off += sizeof(fh) + fh.len;
+	l->wr.nframes++;
+	return 0;
+}
+
+/*
+ * Decodes the oldest frame not yet acknowledged. Returns the number of
+ * records, 0 if everything has been replayed.
+ */
+int tslog_read(struct tslog *l, struct tslog_pos *pos, uint32_t *time, struct tslog_rec *recs) {
+	while (1) {
+		uint32_t seq;
+		if (tslog_sect_seq(l, l->rd.sect, &seq) || seq != l->rd.seq) {
+			/* Overwritten meanwhile */
+			tslog_rewind(l);
+			continue;
+		}
+
+		pos->sect = l->rd.sect;
+		pos->seq = l->rd.seq;
+		pos->off = l->rd.off;
+
+		uint8_t flags;
+		int n = tslog_frame(l, &l->rd, &flags, time, recs);
+		if (n > 0) {
+			if (flags & TSLOG_F_PENDING) return n;
+			continue;
+		}
+
+		/* Next sector, skipping any with a damaged header */
+		uint32_t sect = l->rd.sect;
+		do {
+			if (sect == l->wr.sect) return 0;
+			sect = (sect + 1) % l->nsect;
+		} while (tslog_sect_seq(l, sect, &seq));
+		tslog_codec_reset(&l->rd, sect, seq);
+	}
+}
+
+/* Marks a frame returned by tslog_read() as replayed */
+int tslog_ack(struct tslog *l, const struct tslog_pos *pos) {
+	uint32_t seq;
+	if (tslog_sect_seq(l, pos->sect, &seq) || seq != pos->seq) return -1;
+
+	uint32_t off = pos->sect * TSLOG_SECTOR + pos->off + offsetof(struct tslog_frame_hdr, flags);
+	uint8_t flags;
+	if (l->fl->read(l->fl->ctx, off, &flags, 1)) return -1;
+	flags &= ~TSLOG_F_PENDING;
+	return l->fl->write(l->fl->ctx, off, &flags, 1);
+}
@@ -0,0 +1,90 @@
+/*
+ * tslog.h
+ *
+ * Compressed time-series log in flash
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MAIN_TSLOG_H_
+#define MAIN_TSLOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TSLOG_SECTOR		4096
+#define TSLOG_FRAME_RECS	32		// records per frame at most
+#define TSLOG_FRAME_MAX		512		// encoded frame size limit
+#define TSLOG_DICT			64		// sensors per sector
+
+#define TSLOG_NONE			INT16_MIN	// value missing
+
+/*
+ * Flash access, offsets are relative to the start of the log. NOR semantics
+ * are assumed: erase sets a sector to 0xFF, writes only clear bits. All
+ * calls return 0 on success.
+ */
+struct tslog_flash {
+	void *ctx;
+	uint32_t size;			// multiple of TSLOG_SECTOR
+	int (*read)(void *ctx, uint32_t off, void *buf, size_t len);
+	int (*write)(void *ctx, uint32_t off, const void *buf, size_t len);
+	int (*erase)(void *ctx, uint32_t off);
+};
+
+struct tslog_rec {
+	uint64_t addr;
+	int16_t t;				// 0.1 units
+	int16_t h;
+};
+
+/* Identifies a frame for tslog_ack() */
+struct tslog_pos {
+	uint32_t sect;
+	uint32_t seq;
+	uint32_t off;
+};
+
+/* Per-sector compression state; every sector decodes on its own */
+struct tslog_codec {
+	uint32_t sect;
+	uint32_t seq;
+	uint32_t off;			// next frame
+	uint32_t prev_time;
+	int32_t prev_dt;
+	uint8_t nframes;
+	uint8_t ndict;
+	struct tslog_dict {
+		uint64_t addr;
+		int16_t v[2];
+	} dict[TSLOG_DICT];
+};
+
+/* Not thread safe, callers serialize access */
+struct tslog {
+	const struct tslog_flash *fl;
+	uint32_t nsect;
+	struct tslog_codec wr;	// sector being appended to
+	struct tslog_codec rd;	// replay cursor
+	uint32_t dropped;		// sectors overwritten before replay
+	uint8_t buf[TSLOG_FRAME_MAX];
+};
+
+int tslog_mount(struct tslog *l, const struct tslog_flash *fl);
+int tslog_append(struct tslog *l, uint32_t time, const struct tslog_rec *recs, int n);
+int tslog_read(struct tslog *l, struct tslog_pos *pos, uint32_t *time, struct tslog_rec *recs);
+int tslog_ack(struct tslog *l, const struct tslog_pos *pos);
+
+#endif /* MAIN_TSLOG_H_ */
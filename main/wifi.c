@@ -25,28 +25,174 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_event.h"
 #include "esp_netif.h"
 #include "esp_wifi.h"
+#include "esp_sntp.h"
+#if CONFIG_HYG_SOAK
+#include "esp_eth.h"
+#endif
+#include "nvs.h"
 #include "io.h"
+#include "conf.h"
 #include "wifi.h"
 
+#define WIFI_BACKOFF_MIN_MS		500
+#define WIFI_BACKOFF_MAX_MS		60000
+#define WIFI_AP_KEY				"wifi_ap"
+#define WIFI_LISTEN_INTERVAL	10		// beacons slept through in low power
+
 int wifi_disconnected = 0;
+static uint32_t wifi_reconnects;
 
 static EventGroupHandle_t wifi_event_group;
 const int WIFI_CONNECTED_BIT = BIT0;
 
+static esp_netif_t *wifi_netif;
+static esp_timer_handle_t wifi_retry_timer;
+static int wifi_attempt;			// failed connects since the last association
+static int wifi_fast = 1;			// next connect goes straight to the cached AP
+
+/* Posted by the retry timer, the connect runs in the default event loop */
+ESP_EVENT_DEFINE_BASE(WIFI_RETRY_EVENT);
+
+/* Last AP connected to; lets a reconnect skip the channel scan */
+static struct wifi_ap {
+	uint8_t bssid[6];
+	uint8_t channel;				// 0 if unknown
+} wifi_ap;
+
+static uint8_t wifi_listen_interval;	// beacons between wakeups, 0: every DTIM
+static uint32_t wifi_down_ms;		// when the link was lost, 0 if up or reported
+static uint32_t wifi_ttfr_ms;
+
+static uint32_t wifi_now_ms() {
+	return esp_timer_get_time() / 1000;
+}
+
+static void wifi_ap_load() {
+	nvs_handle_t hnd;
+	if (nvs_open("storage", NVS_READONLY, &hnd) != ESP_OK) return;
+	size_t len = sizeof(wifi_ap);
+	if (nvs_get_blob(hnd, WIFI_AP_KEY, &wifi_ap, &len) != ESP_OK || len != sizeof(wifi_ap)) {
+		memset(&wifi_ap, 0, sizeof(wifi_ap));
+	}
+	nvs_close(hnd);
+}
+
+/* Stores the AP if it changed, an all-zero AP erases the cache */
+static void wifi_ap_store(const uint8_t *bssid, uint8_t channel) {
+	if (channel == wifi_ap.channel && memcmp(bssid, wifi_ap.bssid, 6) == 0) return;
+	memcpy(wifi_ap.bssid, bssid, 6);
+	wifi_ap.channel = channel;
+
+	nvs_handle_t hnd;
+	if (nvs_open("storage", NVS_READWRITE, &hnd) != ESP_OK) return;
+	if (channel != 0) nvs_set_blob(hnd, WIFI_AP_KEY, &wifi_ap, sizeof(wifi_ap));
+	else nvs_erase_key(hnd, WIFI_AP_KEY);
+	nvs_commit(hnd);
+	nvs_close(hnd);
+}
+
+/*
+ * Static addressing from the configuration, DHCP if none is set. Applied
+ * once associated: setting the address posts IP_EVENT_STA_GOT_IP.
+ */
+static void wifi_apply_ip() {
+	const struct conf *c = conf_get();
+	struct conf_net net = c->net;
+	conf_put(c);
+
+	if (net.ip == 0) {
+		esp_netif_dhcpc_start(wifi_netif);
+		return;
+	}
+
+	esp_netif_dhcpc_stop(wifi_netif);
+	esp_netif_ip_info_t info = {
+		.ip.addr = net.ip,
+		.netmask.addr = net.mask,
+		.gw.addr = net.gw,
+	};
+	esp_netif_set_ip_info(wifi_netif, &info);
+	if (net.dns != 0) {
+		esp_netif_dns_info_t dns = { 0 };
+		dns.ip.u_addr.ip4.addr = net.dns;
+		dns.ip.type = ESP_IPADDR_TYPE_V4;
+		esp_netif_set_dns_info(wifi_netif, ESP_NETIF_DNS_MAIN, &dns);
+	}
+}
+
+/*
+ * Every other attempt, starting with the first, goes straight to the cached
+ * BSSID and channel; the others scan, in case the AP has moved.
+ */
+static void wifi_start_connect() {
+	wifi_config_t cfg;
+	if (esp_wifi_get_config(WIFI_IF_STA, &cfg) == ESP_OK) {
+		int fast = wifi_ap.channel != 0 && wifi_fast;
+		uint8_t channel = fast ? wifi_ap.channel : 0;
+		if (cfg.sta.bssid_set != fast || cfg.sta.channel != channel ||
+				cfg.sta.listen_interval != wifi_listen_interval ||
+				(fast && memcmp(cfg.sta.bssid, wifi_ap.bssid, 6) != 0)) {
+			cfg.sta.bssid_set = fast;
+			if (fast) memcpy(cfg.sta.bssid, wifi_ap.bssid, 6);
+			cfg.sta.channel = channel;
+			cfg.sta.listen_interval = wifi_listen_interval;
+			esp_wifi_set_config(WIFI_IF_STA, &cfg);
+		}
+	}
+	esp_wifi_connect();
+}
+
+/* Runs in the timer task on the Bluetooth core, which must not block */
+static void wifi_retry_cb(void *arg) {
+	if (esp_event_post(WIFI_RETRY_EVENT, 0, NULL, 0, 0) != ESP_OK) {
+		esp_timer_start_once(wifi_retry_timer, WIFI_BACKOFF_MIN_MS * 1000ULL);
+	}
+}
+
+/*
+ * Exponential backoff with jitter over the upper half of the delay, so
+ * proxies that lost the same AP do not all come back at the same moment.
+ */
+static void wifi_retry() {
+	uint32_t ms = WIFI_BACKOFF_MIN_MS << (wifi_attempt < 8 ? wifi_attempt : 8);
+	if (ms > WIFI_BACKOFF_MAX_MS) ms = WIFI_BACKOFF_MAX_MS;
+	ms = ms / 2 + esp_random() % (ms / 2 + 1);
+	wifi_fast = wifi_attempt % 2 == 0;
+	wifi_attempt++;
+
+	ESP_LOGV("WIFI", "retry in %lu ms", (unsigned long) ms);
+	esp_timer_stop(wifi_retry_timer);
+	esp_timer_start_once(wifi_retry_timer, ms * 1000ULL);
+}
+
 
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
 								int32_t event_id, void* event_data)
 {
 	if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
 		ESP_LOGV("WIFI", "started\n");
-		esp_wifi_connect();
+		if (!wifi_disconnected) wifi_start_connect();
+	} else if (event_base == WIFI_RETRY_EVENT) {
+		if (!wifi_disconnected) wifi_start_connect();
+	} else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+		wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *) event_data;
+		wifi_ap_store(event->bssid, event->channel);
+		wifi_attempt = 0;
+		wifi_apply_ip();
 	} else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
 		ESP_LOGV("WIFI", "disconnected\n");
 		led_set(0);
 		xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
-		if (!wifi_disconnected) esp_wifi_connect();
+		if (wifi_down_ms == 0) wifi_down_ms = wifi_now_ms() | 1;
+		if (!wifi_disconnected) {
+			wifi_reconnects++;
+			wifi_retry();
+		}
 	} else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
 		char tmp[20];
 		ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
@@ -57,16 +203,79 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
 	}
 }
 
+#if CONFIG_HYG_SOAK
+/*
+ * Soak builds run in QEMU, where the emulated OpenCores Ethernet MAC stands
+ * in for WiFi and QEMU's user networking hands out the address over DHCP.
+ */
+static void wifi_eth_event_handler(void* arg, esp_event_base_t event_base,
+								int32_t event_id, void* event_data)
+{
+	if (event_base == ETH_EVENT && event_id == ETHERNET_EVENT_DISCONNECTED) {
+		xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+		wifi_reconnects++;
+	} else if (event_base == IP_EVENT && event_id == IP_EVENT_ETH_GOT_IP) {
+		char tmp[20];
+		ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+		ESP_LOGI("WIFI", "eth ip:%s",
+				 esp_ip4addr_ntoa(&event->ip_info.ip, tmp, sizeof(tmp)));
+		xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+	}
+}
+
+static void wifi_init_eth() {
+	esp_netif_config_t netif_cfg = ESP_NETIF_DEFAULT_ETH();
+	wifi_netif = esp_netif_new(&netif_cfg);
+
+	eth_mac_config_t mac_cfg = ETH_MAC_DEFAULT_CONFIG();
+	eth_phy_config_t phy_cfg = ETH_PHY_DEFAULT_CONFIG();
+	phy_cfg.autonego_timeout_ms = 100;
+	esp_eth_mac_t *mac = esp_eth_mac_new_openeth(&mac_cfg);
+	esp_eth_phy_t *phy = esp_eth_phy_new_dp83848(&phy_cfg);
+	esp_eth_config_t eth_cfg = ETH_DEFAULT_CONFIG(mac, phy);
+	esp_eth_handle_t eth;
+	ESP_ERROR_CHECK(esp_eth_driver_install(&eth_cfg, &eth));
+	ESP_ERROR_CHECK(esp_netif_attach(wifi_netif, esp_eth_new_netif_glue(eth)));
+
+	ESP_ERROR_CHECK(
+			esp_event_handler_register(ETH_EVENT, ESP_EVENT_ANY_ID,
+					&wifi_eth_event_handler, NULL));
+	ESP_ERROR_CHECK(
+			esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_GOT_IP,
+					&wifi_eth_event_handler, NULL));
+	ESP_ERROR_CHECK(esp_eth_start(eth));
+
+	ESP_LOGI("WIFI", "Initialized, Ethernet");
+}
+#endif
+
 void wifi_init() {
 	wifi_event_group = xEventGroupCreate();
 
 	ESP_ERROR_CHECK(esp_netif_init());
 
+	/* Wall clock time is needed to timestamp readings buffered in flash */
+	esp_sntp_setoperatingmode(ESP_SNTP_OPMODE_POLL);
+	esp_sntp_setservername(0, "pool.ntp.org");
+	esp_sntp_init();
+
 	ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+#if CONFIG_HYG_SOAK
+	wifi_init_eth();
+#else
+	wifi_netif = esp_netif_create_default_wifi_sta();
 
 	wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
 	ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+	/* The credentials stay in flash, the per-attempt BSSID hints do not */
+	ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+
+	wifi_ap_load();
+	const esp_timer_create_args_t retry_args = {
+		.callback = wifi_retry_cb,
+		.name = "wifi_retry",
+	};
+	ESP_ERROR_CHECK(esp_timer_create(&retry_args, &wifi_retry_timer));
 
 	ESP_ERROR_CHECK(
 			esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
@@ -74,11 +283,15 @@ void wifi_init() {
 	ESP_ERROR_CHECK(
 			esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
 					&wifi_event_handler, NULL));
+	ESP_ERROR_CHECK(
+			esp_event_handler_register(WIFI_RETRY_EVENT, ESP_EVENT_ANY_ID,
+					&wifi_event_handler, NULL));
 
 	ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
 	ESP_ERROR_CHECK(esp_wifi_start());
 
 	ESP_LOGI("WIFI", "Initialized");
+#endif
 }
 
 void wifi_disconnect() {
@@ -88,10 +301,18 @@ void wifi_disconnect() {
 
 void wifi_connect(const char *ssid, const char *pass) {
 	ESP_LOGI("WIFI", "Connecting to SSID:%s", ssid);
+#if CONFIG_HYG_SOAK
+	return;			// Ethernet only, the WiFi driver is not started
+#endif
 
 	esp_wifi_disconnect();
+	esp_timer_stop(wifi_retry_timer);
 
 	wifi_disconnected = 0;
+	wifi_attempt = 0;
+	wifi_fast = 1;
+	static const uint8_t none[6];
+	wifi_ap_store(none, 0);
 
 	wifi_config_t wifi_config = { 0 };
 	strlcpy((char *) wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid));
@@ -99,12 +320,49 @@ void wifi_connect(const char *ssid, const char *pass) {
 		strlcpy((char *) wifi_config.sta.password, pass, sizeof(wifi_config.sta.password));
 	}
 
+	ESP_ERROR_CHECK( esp_wifi_set_storage(WIFI_STORAGE_FLASH) );
 	ESP_ERROR_CHECK( esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
-	ESP_ERROR_CHECK( esp_wifi_connect() );
+	ESP_ERROR_CHECK( esp_wifi_set_storage(WIFI_STORAGE_RAM) );
+	wifi_start_connect();
 }
 
 int wifi_wait_conn(int timeout_ms) {
+	if (wifi_event_group == NULL) return 0;		// logbuf.c starts before wifi_init()
 	int bits = xEventGroupWaitBits(wifi_event_group, WIFI_CONNECTED_BIT,
 			pdFALSE, pdTRUE, timeout_ms / portTICK_PERIOD_MS);
 	return (bits & WIFI_CONNECTED_BIT) != 0;
 }
+
+int wifi_get_rssi(int8_t *rssi) {
+	wifi_ap_record_t ap;
+	if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) return 0;
+	*rssi = ap.rssi;
+	return 1;
+}
+
+uint32_t wifi_get_reconnects() {
+	return wifi_reconnects;
+}
+
+/* Called on every report that reached the network */
+void wifi_report_sent() {
+	uint32_t down = wifi_down_ms;
+	if (down == 0 || !wifi_wait_conn(0)) return;
+	wifi_ttfr_ms = wifi_now_ms() - down;
+	wifi_down_ms = 0;
+}
+
+/*
+ * Modem sleep stays on in both modes, BLE coexistence requires it. Low power
+ * sleeps through WIFI_LISTEN_INTERVAL beacons instead of waking for every
+ * DTIM; the listen interval is negotiated and applies from the next connect.
+ */
+void wifi_set_power_save(int on) {
+	wifi_listen_interval = on ? WIFI_LISTEN_INTERVAL : 0;
+	esp_wifi_set_ps(on ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+}
+
+/* Time from the last link loss to the first report after it, ms */
+uint32_t wifi_get_ttfr() {
+	return wifi_ttfr_ms;
+}
@@ -21,9 +21,17 @@
 #ifndef MAIN_WIFI_H_
 #define MAIN_WIFI_H_
 
+#include <stdint.h>
+
 void wifi_init();
 void wifi_disconnect();
 void wifi_connect(const char *ssid, const char *pass);
+int wifi_wait_conn(int timeout_ms);
+int wifi_get_rssi(int8_t *rssi);
+uint32_t wifi_get_reconnects();
+void wifi_report_sent();
+uint32_t wifi_get_ttfr();
+void wifi_set_power_save(int on);
 
 
 
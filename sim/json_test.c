@@ -0,0 +1,653 @@
+/*
+ * json_test.c
+ *
+ * Compares json.c against the cJSON output it replaced
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * /api/conf.json and /api/history are built twice from the same data: as a
+ * cJSON tree the way http.c did before json.c, printed by cJSON itself, and
+ * with the streaming writer the way http.c does now, flushed in chunks of
+ * various sizes. The outputs must be byte for byte the same. Without the
+ * cJSON sources (see the Makefile) the writer is only compared against
+ * itself into one buffer. Overflowing a fixed buffer and a failing flush
+ * must be reported and must not write past the buffer.
+ *
+ * The reader gets request bodies from the network. Each document is parsed
+ * whole, split at every byte and a byte at a time, and must give the same
+ * callback events; every truncation of it must fail without events that
+ * the whole document does not have. Malformed input, escapes, the depth
+ * and token limits and a rejecting callback are checked for the error
+ * reported.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef JSON_TEST_CJSON
+#include "cJSON.h"
+#endif
+#include "conf.h"
+#include "history.h"
+#include "json.h"
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: ", __func__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		failures++; \
+	} \
+} while (0)
+
+/* Current readings of the configured sensors, bt_result_get_*() in http.c */
+struct reading {
+	float t, h, rssi;
+	int adv;
+};
+
+static struct conf conf;
+static struct reading readings[CONF_MAX_IFX_CLIENTS];
+
+static const char *ip_fmt(char ip[16], uint32_t a) {
+	if (a == 0) ip[0] = '\0';
+	else snprintf(ip, 16, "%lu.%lu.%lu.%lu", (unsigned long) a & 0xFF,
+			(unsigned long)(a >> 8) & 0xFF, (unsigned long)(a >> 16) & 0xFF,
+			(unsigned long)(a >> 24) & 0xFF);
+	return ip;
+}
+
+static void uuids_fmt(char *buf, size_t size, const struct conf *c) {
+	int u, len = 0;
+	buf[0] = '\0';
+	for (u=0; u<CONF_FWD_UUIDS && c->fwd.uuids[u] != 0; u++) {
+		len += snprintf(buf + len, size - len, "%s%04x", u ? "," : "", c->fwd.uuids[u]);
+	}
+}
+
+#ifdef JSON_TEST_CJSON
+static char *conf_cjson(const struct conf *c) {
+	char ip[16], tmp[64];
+	cJSON *root = cJSON_CreateObject();
+
+	cJSON_AddStringToObject(root, "ifx_host", c->influx.host);
+	cJSON_AddStringToObject(root, "ifx_db", c->influx.db);
+	cJSON_AddStringToObject(root, "ifx_pfx", c->influx.pfx);
+	cJSON_AddNumberToObject(root, "ifx_int", c->influx.interval_s);
+	cJSON_AddNumberToObject(root, "ifx_max", CONF_MAX_IFX_CLIENTS);
+	cJSON_AddStringToObject(root, "net_ip", ip_fmt(ip, c->net.ip));
+	cJSON_AddStringToObject(root, "net_gw", ip_fmt(ip, c->net.gw));
+	cJSON_AddStringToObject(root, "net_mask", ip_fmt(ip, c->net.mask));
+	cJSON_AddStringToObject(root, "net_dns", ip_fmt(ip, c->net.dns));
+	cJSON_AddBoolToObject(root, "pwr_low", c->power.low);
+	cJSON_AddNumberToObject(root, "pwr_scan", c->power.scan_s);
+	cJSON_AddBoolToObject(root, "gsp_on", c->gossip.on);
+	cJSON_AddNumberToObject(root, "rly_mode", c->relay.mode);
+	cJSON_AddNumberToObject(root, "rly_chan", c->relay.channel);
+	cJSON_AddStringToObject(root, "fwd_host", c->fwd.host);
+	cJSON_AddNumberToObject(root, "fwd_port", c->fwd.port);
+	cJSON_AddNumberToObject(root, "fwd_rate", c->fwd.rate_ms);
+	cJSON_AddBoolToObject(root, "ifx_bin", c->bin.on);
+	cJSON_AddNumberToObject(root, "ifx_bin_port", c->bin.port);
+	cJSON_AddStringToObject(root, "log_host", c->syslog.host);
+	cJSON_AddNumberToObject(root, "log_port", c->syslog.port);
+	uuids_fmt(tmp, sizeof(tmp), c);
+	cJSON_AddStringToObject(root, "fwd_uuids", tmp);
+
+	cJSON *ifx_clients = cJSON_CreateArray();
+	cJSON_AddItemToObject(root, "ifx_clients", ifx_clients);
+
+	int i;
+	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
+		if (c->clients[i].addr == 0) continue;
+		cJSON *cli = cJSON_CreateObject();
+		cJSON_AddItemToArray(ifx_clients, cli);
+
+		cJSON_AddStringToObject(cli, "name", c->clients[i].name);
+		snprintf(tmp, sizeof(tmp), "%012llx", (unsigned long long) c->clients[i].addr);
+		cJSON_AddStringToObject(cli, "addr", tmp);
+		cJSON_AddNumberToObject(cli, "t", readings[i].t);
+		cJSON_AddNumberToObject(cli, "h", readings[i].h);
+		cJSON_AddNumberToObject(cli, "rssi", readings[i].rssi);
+		cJSON_AddNumberToObject(cli, "adv", readings[i].adv);
+	}
+
+	char *str = cJSON_PrintUnformatted(root);
+	cJSON_Delete(root);
+	return str;
+}
+#endif
+
+static void conf_jsonw(struct jsonw *w, const struct conf *c) {
+	char ip[16], tmp[64];
+	jsonw_obj_open(w, NULL);
+
+	jsonw_str(w, "ifx_host", c->influx.host);
+	jsonw_str(w, "ifx_db", c->influx.db);
+	jsonw_str(w, "ifx_pfx", c->influx.pfx);
+	jsonw_num(w, "ifx_int", c->influx.interval_s);
+	jsonw_int(w, "ifx_max", CONF_MAX_IFX_CLIENTS);
+	jsonw_str(w, "net_ip", ip_fmt(ip, c->net.ip));
+	jsonw_str(w, "net_gw", ip_fmt(ip, c->net.gw));
+	jsonw_str(w, "net_mask", ip_fmt(ip, c->net.mask));
+	jsonw_str(w, "net_dns", ip_fmt(ip, c->net.dns));
+	jsonw_bool(w, "pwr_low", c->power.low);
+	jsonw_int(w, "pwr_scan", c->power.scan_s);
+	jsonw_bool(w, "gsp_on", c->gossip.on);
+	jsonw_int(w, "rly_mode", c->relay.mode);
+	jsonw_int(w, "rly_chan", c->relay.channel);
+	jsonw_str(w, "fwd_host", c->fwd.host);
+	jsonw_int(w, "fwd_port", c->fwd.port);
+	jsonw_int(w, "fwd_rate", c->fwd.rate_ms);
+	jsonw_bool(w, "ifx_bin", c->bin.on);
+	jsonw_int(w, "ifx_bin_port", c->bin.port);
+	jsonw_str(w, "log_host", c->syslog.host);
+	jsonw_int(w, "log_port", c->syslog.port);
+	uuids_fmt(tmp, sizeof(tmp), c);
+	jsonw_str(w, "fwd_uuids", tmp);
+
+	jsonw_arr_open(w, "ifx_clients");
+
+	int i;
+	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
+		if (c->clients[i].addr == 0) continue;
+		jsonw_obj_open(w, NULL);
+
+		jsonw_str(w, "name", c->clients[i].name);
+		snprintf(tmp, sizeof(tmp), "%012llx", (unsigned long long) c->clients[i].addr);
+		jsonw_str(w, "addr", tmp);
+		jsonw_num(w, "t", readings[i].t);
+		jsonw_num(w, "h", readings[i].h);
+		jsonw_num(w, "rssi", readings[i].rssi);
+		jsonw_num(w, "adv", readings[i].adv);
+		jsonw_obj_close(w);
+	}
+
+	jsonw_arr_close(w);
+	jsonw_obj_close(w);
+}
+
+static float hist_val(int16_t v) {
+	return v == HISTORY_NONE ? NAN : v / 10.0f;
+}
+
+static struct history_bucket hist[HISTORY_LEN];
+
+#ifdef JSON_TEST_CJSON
+static char *history_cjson(uint32_t bucket_s, uint32_t age_s, int n) {
+	cJSON *root = cJSON_CreateObject();
+	cJSON_AddNumberToObject(root, "bucket", bucket_s);
+	cJSON_AddNumberToObject(root, "age", age_s);
+
+	cJSON *t = cJSON_CreateArray();
+	cJSON_AddItemToObject(root, "t", t);
+	cJSON *h = cJSON_CreateArray();
+	cJSON_AddItemToObject(root, "h", h);
+	int i;
+	for (i=0; i<n; i++) {
+		cJSON *p = cJSON_CreateArray();
+		cJSON_AddItemToArray(p, cJSON_CreateNumber(hist_val(hist[i].t_min)));
+		cJSON_AddItemToArray(p, cJSON_CreateNumber(hist_val(hist[i].t_max)));
+		cJSON_AddItemToArray(t, p);
+		p = cJSON_CreateArray();
+		cJSON_AddItemToArray(p, cJSON_CreateNumber(hist_val(hist[i].h_min)));
+		cJSON_AddItemToArray(p, cJSON_CreateNumber(hist_val(hist[i].h_max)));
+		cJSON_AddItemToArray(h, p);
+	}
+
+	char *str = cJSON_PrintUnformatted(root);
+	cJSON_Delete(root);
+	return str;
+}
+#endif
+
+static void history_jsonw(struct jsonw *w, uint32_t bucket_s, uint32_t age_s, int n) {
+	jsonw_obj_open(w, NULL);
+	jsonw_int(w, "bucket", bucket_s);
+	jsonw_int(w, "age", age_s);
+
+	int i;
+	jsonw_arr_open(w, "t");
+	for (i=0; i<n; i++) {
+		jsonw_arr_open(w, NULL);
+		jsonw_num(w, NULL, hist_val(hist[i].t_min));
+		jsonw_num(w, NULL, hist_val(hist[i].t_max));
+		jsonw_arr_close(w);
+	}
+	jsonw_arr_close(w);
+	jsonw_arr_open(w, "h");
+	for (i=0; i<n; i++) {
+		jsonw_arr_open(w, NULL);
+		jsonw_num(w, NULL, hist_val(hist[i].h_min));
+		jsonw_num(w, NULL, hist_val(hist[i].h_max));
+		jsonw_arr_close(w);
+	}
+	jsonw_arr_close(w);
+	jsonw_obj_close(w);
+}
+
+/* Collects the flushed chunks, failing once more than limit bytes were sent */
+struct sink {
+	char buf[1 << 20];
+	size_t len;
+	size_t limit;
+	int calls;
+	int after_fail;
+};
+
+static int sink_flush(void *ctx, const char *buf, size_t len) {
+	struct sink *s = ctx;
+	s->calls++;
+	if (s->len >= s->limit) s->after_fail++;
+	if (s->len + len > s->limit) return 1;
+	memcpy(s->buf + s->len, buf, len);
+	s->len += len;
+	return 0;
+}
+
+/*
+ * Which document a test writes. The writer runs over the shared data the
+ * same way for every chunk size.
+ */
+enum doc { DOC_CONF, DOC_HISTORY };
+static uint32_t hist_bucket_s, hist_age_s;
+static int hist_n;
+
+static void doc_jsonw(struct jsonw *w, enum doc d) {
+	if (d == DOC_CONF) conf_jsonw(w, &conf);
+	else history_jsonw(w, hist_bucket_s, hist_age_s, hist_n);
+}
+
+static struct sink sink;
+
+/* The document from the writer into one buffer, without flush */
+static char *doc_whole(enum doc d) {
+	char *buf = malloc(sizeof(sink.buf));
+	struct jsonw w;
+	jsonw_init(&w, buf, sizeof(sink.buf) - 1, NULL, NULL);
+	doc_jsonw(&w, d);
+	CHECK(jsonw_finish(&w) == 0, "writer failed without flush");
+	buf[w.len] = '\0';
+	return buf;
+}
+
+/* What the writer must produce: cJSON's output where it is built in */
+static char *doc_ref(enum doc d) {
+#ifdef JSON_TEST_CJSON
+	if (d == DOC_CONF) return conf_cjson(&conf);
+	return history_cjson(hist_bucket_s, hist_age_s, hist_n);
+#else
+	return doc_whole(d);
+#endif
+}
+
+static void compare(const char *what, enum doc d) {
+	static const size_t chunks[] = { 1, 2, 7, 64, 1024 };
+	char *ref = doc_ref(d);
+	size_t k;
+	for (k=0; k<sizeof(chunks)/sizeof(chunks[0]); k++) {
+		char chunk[1024];
+		struct jsonw w;
+		memset(&sink, 0, sizeof(sink));
+		sink.limit = sizeof(sink.buf);
+		jsonw_init(&w, chunk, chunks[k], sink_flush, &sink);
+		doc_jsonw(&w, d);
+		CHECK(jsonw_finish(&w) == 0, "%s: writer failed with %zu byte chunks", what, chunks[k]);
+		sink.buf[sink.len] = '\0';
+		if (strcmp(sink.buf, ref) != 0) {
+			size_t i = 0;
+			while (sink.buf[i] == ref[i]) i++;
+			CHECK(0, "%s with %zu byte chunks differs at %zu:\n  ref   %.60s\n  jsonw %.60s",
+					what, chunks[k], i, ref + i, sink.buf + i);
+		}
+	}
+	free(ref);
+}
+
+static void client(int i, uint64_t addr, const char *name, float t, float h, float rssi, int adv) {
+	conf.clients[i].addr = addr;
+	snprintf(conf.clients[i].name, sizeof(conf.clients[i].name), "%s", name);
+	readings[i] = (struct reading) { t, h, rssi, adv };
+}
+
+static void test_conf() {
+	memset(&conf, 0, sizeof(conf));
+	memset(readings, 0, sizeof(readings));
+	compare("empty configuration", DOC_CONF);
+
+	strcpy(conf.influx.host, "10.0.0.5");
+	strcpy(conf.influx.db, "sensors");
+	strcpy(conf.influx.pfx, "site=\"attic\",room=a\\b");
+	conf.influx.interval_s = 60;
+	conf.net.ip = 0x0a01a8c0;
+	conf.net.mask = 0x00ffffff;
+	conf.power.low = 1;
+	conf.power.scan_s = 20;
+	conf.gossip.on = 1;
+	conf.relay.mode = 2;
+	strcpy(conf.fwd.host, "fwd.local");
+	conf.fwd.port = 8091;
+	conf.fwd.uuids[0] = 0x181a;
+	conf.fwd.uuids[1] = 0xfe95;
+	conf.bin.on = 1;
+	strcpy(conf.syslog.host, "logs/\x7f");
+	compare("sensors not configured", DOC_CONF);
+
+	client(0, 0xa4c138000001ULL, "Köök", 21.3f, 45.6f, -67.25f, 12);
+	client(1, 0xa4c138000002ULL, "quote\" back\\slash", NAN, 50, NAN, 0);
+	client(3, 0xa4c138000003ULL, "tab\tnl\ncr\rbs\bff\f", -0.0f, 100, -100, 255);
+	client(7, 0xa4c138000004ULL, "ctl\x01\x1f/", -40, 0.1f, 0, 1);
+	client(8, 0xffffffffffffULL, "", INFINITY, -INFINITY, 1e9f, 2147483647);
+	client(9, 0xa4c138000005ULL, "no reading", NAN, NAN, NAN, 0);
+	compare("configuration", DOC_CONF);
+
+	/* Every reading the sensors can report, as the float it is stored in */
+	int i, v;
+	memset(conf.clients, 0, sizeof(conf.clients));
+	for (i=0, v=-400; v<=1000 && i<CONF_MAX_IFX_CLIENTS; i++, v++) {
+		client(i, 0xa4c138000000ULL + i, "s", v / 10.0f, (v + 400) / 14.0f, -v / 7.0f, v & 0xff);
+	}
+	compare("reading range", DOC_CONF);
+
+	/* Arbitrary doubles, where %1.15g does and does not read back */
+	memset(conf.clients, 0, sizeof(conf.clients));
+	srand(1);
+	for (i=0; i<CONF_MAX_IFX_CLIENTS; i++) {
+		double r = (double) rand() / RAND_MAX;
+		client(i, i + 1, "r", r * 1e6 - 5e5, r, r * 1e-9, 0);
+	}
+	compare("random numbers", DOC_CONF);
+}
+
+static void test_history() {
+	hist_bucket_s = 60;
+	hist_age_s = 0;
+	hist_n = 0;
+	compare("empty history", DOC_HISTORY);
+
+	int i;
+	for (i=0; i<HISTORY_LEN; i++) {
+		hist[i].t_min = i % 5 == 0 ? HISTORY_NONE : -400 + i;
+		hist[i].t_max = i % 5 == 0 ? HISTORY_NONE : -400 + 3 * i;
+		hist[i].h_min = i % 7 == 0 ? HISTORY_NONE : i % 1000;
+		hist[i].h_max = i % 7 == 0 ? HISTORY_NONE : INT16_MAX - i;
+	}
+	hist_bucket_s = 600;
+	hist_age_s = 17;
+	hist_n = HISTORY_LEN;
+	compare("history", DOC_HISTORY);
+}
+
+/* A fixed buffer without flush, as http_ws_format uses */
+static void test_truncation() {
+	hist_n = 3;
+	char *ref = doc_whole(DOC_HISTORY);
+	size_t len = strlen(ref);
+	char buf[512];
+	size_t size;
+	for (size=len+2; size>0; size--) {
+		struct jsonw w;
+		memset(buf, '#', sizeof(buf));
+		jsonw_init(&w, buf, size, NULL, NULL);
+		doc_jsonw(&w, DOC_HISTORY);
+		CHECK(buf[size] == '#', "wrote past a %zu byte buffer", size);
+		if (size >= len) {
+			CHECK(!w.err && w.len == len && memcmp(buf, ref, len) == 0,
+					"%zu bytes fit a %zu byte buffer", len, size);
+			CHECK(jsonw_finish(&w) == 0, "finish failed with a %zu byte buffer", size);
+		} else {
+			CHECK(w.err, "%zu bytes overflowed a %zu byte buffer unnoticed", len, size);
+			CHECK(jsonw_finish(&w) != 0, "finish succeeded with a %zu byte buffer", size);
+		}
+	}
+	free(ref);
+}
+
+/* A flush failing midway, as when the HTTP client goes away */
+static void test_flush_error() {
+	hist_n = HISTORY_LEN;
+	char *ref = doc_whole(DOC_HISTORY);
+	size_t limits[] = { 0, 1, 100, 1000, strlen(ref) - 1 };
+	size_t k;
+	for (k=0; k<sizeof(limits)/sizeof(limits[0]); k++) {
+		char chunk[64];
+		struct jsonw w;
+		memset(&sink, 0, sizeof(sink));
+		sink.limit = limits[k];
+		jsonw_init(&w, chunk, sizeof(chunk), sink_flush, &sink);
+		doc_jsonw(&w, DOC_HISTORY);
+		CHECK(jsonw_finish(&w) != 0, "flush failing after %zu bytes went unnoticed", limits[k]);
+		CHECK(sink.after_fail <= 1, "flushed %d times after failing", sink.after_fail);
+		CHECK(memcmp(sink.buf, ref, sink.len) == 0, "output before the failure differs");
+	}
+	free(ref);
+
+	/* Unbalanced documents are errors too */
+	char buf[64];
+	struct jsonw w;
+	memset(&sink, 0, sizeof(sink));
+	sink.limit = sizeof(sink.buf);
+	jsonw_init(&w, buf, sizeof(buf), sink_flush, &sink);
+	jsonw_obj_open(&w, NULL);
+	jsonw_arr_open(&w, "a");
+	jsonw_obj_close(&w);
+	CHECK(jsonw_finish(&w) != 0, "unclosed object accepted");
+	jsonw_init(&w, buf, sizeof(buf), sink_flush, &sink);
+	jsonw_arr_close(&w);
+	CHECK(jsonw_finish(&w) != 0, "close without open accepted");
+}
+
+/* Reader events as text: depth, type, key=value */
+struct events {
+	char buf[1024];
+	size_t len;
+	int n;
+	int reject_at;			// event number the callback rejects, 0: none
+};
+
+static int events_cb(void *ctx, int depth, enum jsonr_type type,
+		const char *key, const char *val) {
+	static const char types[] = "{[.\"#?~";
+	struct events *e = ctx;
+	if (e->len < sizeof(e->buf)) {
+		e->len += snprintf(e->buf + e->len, sizeof(e->buf) - e->len, "%d%c%s%s%s ",
+				depth, types[type], key ? key : "", key && val ? "=" : "", val ? val : "");
+	}
+	return ++e->n == e->reject_at;
+}
+
+/* Parses doc fed in pieces of at most step bytes, plus a split at split */
+static int parse(struct events *e, const char *doc, size_t len, size_t split, size_t step,
+		const char **msg) {
+	struct jsonr r;
+	memset(e->buf, 0, sizeof(e->buf));
+	e->len = 0;
+	e->n = 0;
+	jsonr_init(&r, events_cb, e);
+	size_t off = 0;
+	while (off < len) {
+		size_t n = len - off < step ? len - off : step;
+		if (off < split && off + n > split) n = split - off;
+		if (jsonr_feed(&r, doc + off, n)) break;
+		off += n;
+	}
+	int err = jsonr_finish(&r);
+	*msg = r.msg;
+	return err;
+}
+
+static const struct {
+	const char *doc;
+	const char *events;
+} reader_docs[] = {
+	{ "{\"a\":1,\"b\":[true,false,null],\"c\":{\"d\":\"x\"},\"e\":[],\"f\":{}}",
+		"0{ 1#a=1 1[b 2?true 2?false 2~ 1. 1{c 2\"d=x 1. 1[e 1. 1{f 1. 0. " },
+	{ " {\n\t\"k\" : -1.5e+3 ,\r\"s\":\"q\\\"b\\\\s\\/\\b\\f\\n\\r\\t\" } ",
+		"0{ 1#k=-1.5e+3 1\"s=q\"b\\s/\b\f\n\r\t 0. " },
+	{ "[\"\\u0041\\u00e9\\u20AC\\ud83d\\ude00\",\"\xc3\xa9\"]",
+		"0[ 1\"A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80 1\"\xc3\xa9 0. " },
+	{ "[[{\"a\":[0]}],-0.5,\"\"]", "0[ 1[ 2{ 3[a 4#0 3. 2. 1. 1#-0.5 1\" 0. " },
+};
+
+static void test_reader_docs() {
+	size_t d;
+	for (d=0; d<sizeof(reader_docs)/sizeof(reader_docs[0]); d++) {
+		const char *doc = reader_docs[d].doc, *want = reader_docs[d].events, *msg;
+		size_t len = strlen(doc), k;
+		struct events e = { .reject_at = 0 };
+
+		for (k=0; k<=len; k++) {
+			int err = parse(&e, doc, len, k, len, &msg);
+			CHECK(!err && strcmp(e.buf, want) == 0, "doc %zu split at %zu: %s: %s",
+					d, k, err ? msg : "ok", e.buf);
+		}
+		int err = parse(&e, doc, len, 0, 1, &msg);
+		CHECK(!err && strcmp(e.buf, want) == 0, "doc %zu a byte at a time: %s: %s",
+				d, err ? msg : "ok", e.buf);
+
+		/* The root is a container, so only trailing whitespace may be cut */
+		size_t end = len;
+		while (end > 0 && strchr(" \t\r\n", doc[end - 1])) end--;
+		for (k=0; k<end; k++) {
+			err = parse(&e, doc, k, len, len, &msg);
+			CHECK(err && strncmp(e.buf, want, e.len) == 0,
+					"doc %zu cut at %zu: %s: %s", d, k, err ? msg : "accepted", e.buf);
+		}
+
+		/* Nothing is parsed after the callback rejects a value */
+		int n = e.n;
+		parse(&e, doc, len, len, len, &msg);
+		for (n=e.n, k=1; k<=(size_t) n; k++) {
+			e.reject_at = k;
+			err = parse(&e, doc, len, len, len, &msg);
+			CHECK(err && e.n == (int) k && strcmp(msg, "Rejected") == 0,
+					"doc %zu rejected at event %zu: %s after %d events",
+					d, k, err ? msg : "accepted", e.n);
+		}
+	}
+}
+
+static void expect_error(const char *doc, size_t len, const char *want) {
+	struct events e = { .reject_at = 0 };
+	const char *msg;
+	int err = parse(&e, doc, len, len, len, &msg);
+	CHECK(err && strcmp(msg, want) == 0, "'%.40s': %s, expected %s",
+			doc, err ? msg : "accepted", want);
+}
+
+static void test_reader_errors() {
+	static const struct {
+		const char *doc;
+		const char *msg;
+	} bad[] = {
+		{ "", "Unexpected end of input" },
+		{ "]", "Value expected" },
+		{ "{\"a\":1,}", "Member name expected" },
+		{ "{a:1}", "Member name expected" },
+		{ "{\"a\" 1}", "Colon expected" },
+		{ "[1 2]", "Comma expected" },
+		{ "{\"a\":1]", "Unexpected bracket" },
+		{ "[}", "Value expected" },
+		{ "[1}", "Unexpected bracket" },
+		{ "{\"a\":1} x", "Trailing data" },
+		{ "{}{}", "Trailing data" },
+		{ "[tru]", "Invalid literal" },
+		{ "[nul]", "Invalid literal" },
+		{ "[1.2.3]", "Invalid number" },
+		{ "[-]", "Invalid number" },
+		{ "[\"a\x01\"]", "Control character in string" },
+		{ "[\"a\\q\"]", "Invalid escape" },
+		{ "[\"\\u12G4\"]", "Invalid escape" },
+		{ "[\"\\u0000\"]", "Invalid escape" },
+		{ "[\"\\ude00\"]", "Invalid escape" },
+		{ "[\"\\ud83d\"]", "Invalid escape" },
+		{ "[\"\\ud83dx\"]", "Invalid escape" },
+		{ "[\"\\ud83d\\n\"]", "Invalid escape" },
+		{ "[\"\\ud83d\\u0041\"]", "Invalid escape" },
+		{ "[\"\\ud83d\\ud83d\"]", "Invalid escape" },
+	};
+	size_t k;
+	for (k=0; k<sizeof(bad)/sizeof(bad[0]); k++) {
+		expect_error(bad[k].doc, strlen(bad[k].doc), bad[k].msg);
+	}
+	/* A NUL is a control character, not the end of the string */
+	expect_error("[\"a\0b\"]", 7, "Control character in string");
+}
+
+static void test_reader_limits() {
+	char doc[256];
+	struct events e = { .reject_at = 0 };
+	const char *msg;
+	int err;
+
+	/* JSONR_MAX_DEPTH containers nest, one more does not */
+	memset(doc, '[', JSONR_MAX_DEPTH);
+	memset(doc + JSONR_MAX_DEPTH, ']', JSONR_MAX_DEPTH);
+	err = parse(&e, doc, 2 * JSONR_MAX_DEPTH, 0, 2 * JSONR_MAX_DEPTH, &msg);
+	CHECK(!err, "%d levels: %s", JSONR_MAX_DEPTH, err ? msg : "ok");
+	memset(doc, '[', JSONR_MAX_DEPTH + 1);
+	memset(doc + JSONR_MAX_DEPTH + 1, ']', JSONR_MAX_DEPTH + 1);
+	expect_error(doc, 2 * JSONR_MAX_DEPTH + 2, "Nested too deep");
+
+	/* Keys, strings, numbers and literals up to JSONR_TOK_LEN - 1 bytes */
+	static const char *fmts[] = { "{\"%s\":1}", "[\"%s\"]", "[1%s]", "[t%s]" };
+	char tok[JSONR_TOK_LEN + 1];
+	size_t f, n;
+	for (f=0; f<sizeof(fmts)/sizeof(fmts[0]); f++) {
+		for (n=JSONR_TOK_LEN-2; n<=JSONR_TOK_LEN; n++) {
+			memset(tok, f == 2 ? '0' : 'a', n);
+			tok[n] = '\0';
+			snprintf(doc, sizeof(doc), fmts[f], tok);
+			err = parse(&e, doc, strlen(doc), 0, 1, &msg);
+			size_t tok_len = n + (f >= 2);		// the first character is in the format
+			if (tok_len < JSONR_TOK_LEN) {
+				CHECK(!err || (f == 3 && strcmp(msg, "Invalid literal") == 0),
+						"%zu byte token in %s: %s", tok_len, fmts[f], err ? msg : "ok");
+			} else {
+				CHECK(err && strcmp(msg, "Value too long") == 0,
+						"%zu byte token in %s: %s", tok_len, fmts[f], err ? msg : "accepted");
+			}
+		}
+	}
+
+	/* Escapes count as the bytes they decode to */
+	char *p = doc + sprintf(doc, "[\"");
+	for (n=0; n<(JSONR_TOK_LEN-1)/3; n++) p += sprintf(p, "\\u20ac");
+	sprintf(p, "\"]");
+	err = parse(&e, doc, strlen(doc), 0, 7, &msg);
+	CHECK(!err, "%d bytes of escapes: %s", (JSONR_TOK_LEN-1)/3*3, err ? msg : "ok");
+	sprintf(p, "\\u20ac\"]");
+	expect_error(doc, strlen(doc), "Value too long");
+}
+
+int main() {
+	test_conf();
+	test_history();
+	test_truncation();
+	test_flush_error();
+	test_reader_docs();
+	test_reader_errors();
+	test_reader_limits();
+#ifndef JSON_TEST_CJSON
+	printf("json_test: cJSON not built in, the writer was not compared against it\n");
+#endif
+	printf("json_test: %s\n", failures ? "FAILED" : "ok");
+	return failures != 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * partition.c
+ *
+ * Flash partitions in files
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Each partition is a file of its size. NOR flash rules apply as on the
+ * SPI flash: erase works on whole 4 KB sectors and sets them to 0xFF, and
+ * a write can only clear bits, so writing over data ANDs it in. A power cut
+ * can be set up to stop writing after a number of bytes, which leaves torn
+ * writes the way a reset in the middle of one would.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "esp_partition.h"
+
+#define SIM_PARTITIONS		4
+#define SIM_SECTOR			4096
+
+struct sim_partition {
+	esp_partition_t part;
+	int fd;
+	int64_t budget;			// bytes left to program before the cut, <0: no cut
+};
+
+static struct sim_partition sim_parts[SIM_PARTITIONS];
+static int sim_nparts;
+static pthread_mutex_t sim_parts_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sim_partition *sim_part(const esp_partition_t *p) {
+	return (struct sim_partition *) p;
+}
+
+const esp_partition_t *sim_partition_add(const char *label, const char *path, uint32_t size) {
+	if (sim_nparts == SIM_PARTITIONS || size % SIM_SECTOR) return NULL;
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) return NULL;
+
+	off_t cur = lseek(fd, 0, SEEK_END);
+	if (cur != size) {
+		static const uint8_t ff[SIM_SECTOR] = { [0 ... SIM_SECTOR-1] = 0xFF };
+		uint32_t off;
+		if (ftruncate(fd, 0)) goto fail;
+		for (off=0; off<size; off+=SIM_SECTOR) {
+			if (pwrite(fd, ff, SIM_SECTOR, off) != SIM_SECTOR) goto fail;
+		}
+	}
+
+	struct sim_partition *s = &sim_parts[sim_nparts++];
+	s->part = (esp_partition_t) {
+		.type = ESP_PARTITION_TYPE_DATA,
+		.subtype = ESP_PARTITION_SUBTYPE_ANY,
+		.size = size,
+		.erase_size = SIM_SECTOR,
+	};
+	snprintf(s->part.label, sizeof(s->part.label), "%s", label);
+	s->fd = fd;
+	s->budget = -1;
+	return &s->part;
+fail:
+	close(fd);
+	return NULL;
+}
+
+void sim_partition_cut(const esp_partition_t *p, int64_t budget) {
+	pthread_mutex_lock(&sim_parts_mtx);
+	sim_part(p)->budget = budget;
+	pthread_mutex_unlock(&sim_parts_mtx);
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+		esp_partition_subtype_t subtype, const char *label) {
+	int i;
+	for (i=0; i<sim_nparts; i++) {
+		const esp_partition_t *p = &sim_parts[i].part;
+		if (type != ESP_PARTITION_TYPE_ANY && p->type != type) continue;
+		if (subtype != ESP_PARTITION_SUBTYPE_ANY && p->subtype != subtype) continue;
+		if (label != NULL && strcmp(p->label, label) != 0) continue;
+		return p;
+	}
+	return NULL;
+}
+
+static int sim_range_ok(const esp_partition_t *p, size_t off, size_t size) {
+	return off <= p->size && size <= p->size - off;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *p, size_t off, void *dst, size_t size) {
+	if (!sim_range_ok(p, off, size)) return ESP_ERR_INVALID_SIZE;
+	if (pread(sim_part(p)->fd, dst, size, off) != (ssize_t) size) return ESP_FAIL;
+	return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *p, size_t off, const void *src, size_t size) {
+	struct sim_partition *s = sim_part(p);
+	if (!sim_range_ok(p, off, size)) return ESP_ERR_INVALID_SIZE;
+
+	pthread_mutex_lock(&sim_parts_mtx);
+	esp_err_t err = ESP_OK;
+	size_t n = size;
+	if (s->budget >= 0 && (int64_t) n > s->budget) {
+		n = s->budget;
+		err = ESP_FAIL;
+	}
+	if (s->budget >= 0) s->budget -= n;
+
+	uint8_t cur[SIM_SECTOR];
+	const uint8_t *b = src;
+	size_t done = 0;
+	while (done < n) {
+		size_t k = n - done < sizeof(cur) ? n - done : sizeof(cur);
+		size_t i;
+		if (pread(s->fd, cur, k, off + done) != (ssize_t) k) {
+			err = ESP_FAIL;
+			break;
+		}
+		for (i=0; i<k; i++) cur[i] &= b[done + i];
+		if (pwrite(s->fd, cur, k, off + done) != (ssize_t) k) {
+			err = ESP_FAIL;
+			break;
+		}
+		done += k;
+	}
+	pthread_mutex_unlock(&sim_parts_mtx);
+	return err;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *p, size_t off, size_t size) {
+	static const uint8_t ff[SIM_SECTOR] = { [0 ... SIM_SECTOR-1] = 0xFF };
+	struct sim_partition *s = sim_part(p);
+	if (off % SIM_SECTOR || size % SIM_SECTOR) return ESP_ERR_INVALID_ARG;
+	if (!sim_range_ok(p, off, size)) return ESP_ERR_INVALID_SIZE;
+
+	pthread_mutex_lock(&sim_parts_mtx);
+	esp_err_t err = ESP_OK;
+	if (s->budget == 0) {
+		err = ESP_FAIL;
+	} else {
+		size_t done;
+		for (done=0; done<size; done+=SIM_SECTOR) {
+			if (pwrite(s->fd, ff, SIM_SECTOR, off + done) != SIM_SECTOR) err = ESP_FAIL;
+		}
+	}
+	pthread_mutex_unlock(&sim_parts_mtx);
+	return err;
+}
@@ -0,0 +1,222 @@
+/*
+ * poll_test.c
+ *
+ * Report deadlines of the poller against drifting clocks
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replays the poller's deadlines through poller_next() with 10 ms ticks as
+ * on the device. The tick count starts at boot or just before it wraps;
+ * SNTP first sets the wall clock some reports in, to a time anywhere
+ * relative to the slot, and then steps it every hour by what the tick
+ * crystal drifted meanwhile. Every interval must stay within 1/8 of the
+ * configured one, and once the slew has had time to cover half an interval
+ * after boot, the SNTP jump or a tick wrap, every deadline must fall on
+ * phase % period of the clock in use to within a tick.
+ *
+ * Random calls then cover what the replay does not reach, such as a sweep
+ * that overran right after boot or a tick wrap, which puts the deadline
+ * before tick 0 on the uptime basis: the deadline must move towards the
+ * nearest slot by the distance to it, at most 1/8 of the interval.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "poller.h"
+
+#define TEST_EPOCH_MS		1700000000000LL		// 2023-11-14, a time SNTP could set
+#define TEST_RESYNC_MS		3600000LL		// CONFIG_LWIP_SNTP_UPDATE_DELAY
+#define TEST_WORK			5				// ticks from the wakeup to poller_next()
+#define TEST_REPORTS		200
+#define TEST_SNTP_AT		20				// report before which SNTP sets the clock
+#define TEST_SETTLE			5				// half an interval at POLL_SLEW 8, plus one
+
+#if portTICK_PERIOD_MS != 10
+#error "built with the firmware's tick period, see the Makefile"
+#endif
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: ", __func__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		failures++; \
+	} \
+} while (0)
+
+struct run {
+	uint32_t interval_s;
+	uint32_t phase;
+	double drift;			// true time runs this much faster than the ticks
+	TickType_t start;		// tick count at the first deadline
+	int sntp;				// 0: SNTP never answers
+	int64_t epoch_ms;		// true time when SNTP first sets the clock
+};
+
+#define TEST_RESYNC		(TEST_RESYNC_MS / portTICK_PERIOD_MS)
+
+/* Wall clock in ms at e ticks after the start, -1 before SNTP set it */
+static int64_t wall_ms(const struct run *r, int64_t e_sntp, int64_t e) {
+	if (e_sntp < 0 || e < e_sntp) return -1;
+	/* The clock runs on the tick crystal between the steps to true time */
+	int64_t e_sync = e_sntp + (e - e_sntp) / TEST_RESYNC * TEST_RESYNC;
+	int64_t at_sync = r->epoch_ms + (int64_t) ((e_sync - e_sntp) * portTICK_PERIOD_MS * (1 + r->drift));
+	return at_sync + (e - e_sync) * portTICK_PERIOD_MS;
+}
+
+static void run(const struct run *r) {
+	uint32_t interval = r->interval_s * 1000 / portTICK_PERIOD_MS;
+	int64_t period = (int64_t) interval * portTICK_PERIOD_MS;
+	int64_t slot = r->phase % period;
+	TickType_t last = r->start, prev_now = r->start;
+	int64_t e = 0, e_sntp = -1, sync = 0;
+	int settled = TEST_SETTLE;		// the uptime slot is not reached at boot either
+	int k;
+
+	for (k=0; k<TEST_REPORTS; k++) {
+		int64_t e_now = e + TEST_WORK;
+		TickType_t now = r->start + e_now;
+		if (r->sntp && k == TEST_SNTP_AT) {
+			e_sntp = e_now;
+			settled = k + TEST_SETTLE;
+		}
+		int64_t wall = wall_ms(r, e_sntp, e_now);
+		if (wall >= 0 && (e_now - e_sntp) / TEST_RESYNC != sync) {
+			sync = (e_now - e_sntp) / TEST_RESYNC;
+			if (settled < k + 1) settled = k + 1;	// stepped by the drift since the last sync
+		}
+		if (wall < 0 && now < prev_now) settled = k + TEST_SETTLE;	// the uptime basis wrapped
+		prev_now = now;
+
+		struct timeval tv;
+		if (wall >= 0) {
+			tv.tv_sec = wall / 1000;
+			tv.tv_usec = wall % 1000 * 1000;
+		} else {
+			tv.tv_sec = e_now * portTICK_PERIOD_MS / 1000;		// since boot at 1970
+			tv.tv_usec = 0;
+		}
+
+		TickType_t next = poller_next(last, interval, r->phase, now, &tv);
+		int32_t step = next - last;
+		CHECK(step >= (int32_t) (interval - interval / 8) - 1 &&
+				step <= (int32_t) (interval + interval / 8) + 1,
+				"%us interval, phase %u, drift %g, start %u, epoch %lld: report %d after %d ticks",
+				r->interval_s, r->phase, r->drift, r->start, (long long) r->epoch_ms, k, step);
+
+		/* Where the deadline falls on the clock poller_next() goes by */
+		int64_t at = wall >= 0 ? wall : (int64_t) now * portTICK_PERIOD_MS;
+		at += (int64_t) (int32_t) (next - now) * portTICK_PERIOD_MS;
+		int64_t err = ((at - slot) % period + period) % period;
+		if (err > period / 2) err -= period;
+		if (k >= settled) {
+			CHECK(llabs(err) <= portTICK_PERIOD_MS,
+					"%us interval, phase %u, drift %g, start %u, epoch %lld: report %d %lld ms off the slot",
+					r->interval_s, r->phase, r->drift, r->start, (long long) r->epoch_ms,
+					k, (long long) err);
+		}
+
+		e += step;
+		last = next;
+	}
+}
+
+static uint64_t rnd_state = 0x853c49e6748fea9bULL;
+
+static uint32_t rnd() {
+	rnd_state = rnd_state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return rnd_state >> 32;
+}
+
+static void test_random() {
+	int n;
+	for (n=0; n<1000000; n++) {
+		uint32_t interval_s = 30 + rnd() % 3571;
+		uint32_t interval = interval_s * 1000 / portTICK_PERIOD_MS;
+		uint32_t phase = rnd();
+		/* Right after boot or a wrap, a quarter of the time */
+		TickType_t now = rnd() % 4 ? rnd() : rnd() % (2 * interval);
+		TickType_t last = now - rnd() % (2 * interval);		// up to a sweep that overran
+		struct timeval tv;
+		if (rnd() % 2) {
+			tv.tv_sec = TEST_EPOCH_MS / 1000 + rnd();
+			tv.tv_usec = rnd() % 1000000;
+		} else {
+			tv.tv_sec = rnd() % 1000000;		// no SNTP yet
+			tv.tv_usec = 0;
+		}
+
+		int64_t period = (int64_t) interval * portTICK_PERIOD_MS;
+		int64_t at = tv.tv_sec >= TEST_EPOCH_MS / 1000 ?
+				(int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000 : (int64_t) now * portTICK_PERIOD_MS;
+		at += (int64_t) (int32_t) (last + interval - now) * portTICK_PERIOD_MS;
+		int64_t err = ((at - phase % period) % period + period) % period;
+		if (err > period / 2) err -= period;
+		int64_t want = llabs(err) < period / 8 ? -err : err < 0 ? period / 8 : -(period / 8);
+
+		TickType_t next = poller_next(last, interval, phase, now, &tv);
+		int64_t got = (int64_t) (int32_t) (next - last - interval) * portTICK_PERIOD_MS;
+		CHECK(got == want / portTICK_PERIOD_MS * portTICK_PERIOD_MS ||
+				(err == period / 2 && got == period / 8 / portTICK_PERIOD_MS * portTICK_PERIOD_MS),
+				"%us interval, phase %u, now %u, last %u, %s %lld: %lld ms off the slot, moved %lld ms",
+				interval_s, phase, now, last, tv.tv_sec >= TEST_EPOCH_MS / 1000 ? "wall" : "uptime",
+				(long long) tv.tv_sec, (long long) err, (long long) got);
+	}
+}
+
+int main() {
+	static const uint32_t intervals[] = { 30, 60, 300, 3600 };
+	static const uint32_t phases[] = { 0, 0x9e3779b9, UINT32_MAX };
+	static const double drifts[] = { 0, 150e-6, -150e-6 };
+	size_t i, p, d;
+	int wrap, j;
+
+	for (i=0; i<sizeof(intervals)/sizeof(intervals[0]); i++) {
+		int64_t period = intervals[i] * 1000LL;
+		for (p=0; p<sizeof(phases)/sizeof(phases[0]); p++) {
+			for (d=0; d<sizeof(drifts)/sizeof(drifts[0]); d++) {
+				for (wrap=0; wrap<2; wrap++) {
+					struct run r = {
+						.interval_s = intervals[i],
+						.phase = phases[p],
+						.drift = drifts[d],
+						/* The wrap comes before SNTP, on the uptime basis */
+						.start = wrap ? (TickType_t) (-10 * (int64_t) intervals[i] * 1000 / portTICK_PERIOD_MS) : 0,
+					};
+					run(&r);
+
+					/* SNTP lands anywhere in the period, also half of it away */
+					r.sntp = 1;
+					for (j=0; j<=16; j++) {
+						r.epoch_ms = TEST_EPOCH_MS + period * j / 16 + (j == 16 ? -1 : 0);
+						run(&r);
+					}
+					r.epoch_ms = TEST_EPOCH_MS + period / 2 + 1;
+					run(&r);
+				}
+			}
+		}
+	}
+	test_random();
+	printf("poll_test: %s\n", failures ? "FAILED" : "ok");
+	return failures != 0;
+}
@@ -0,0 +1,345 @@
+/*
+ * shim.c
+ *
+ * FreeRTOS and ESP-IDF functions used by the pipeline, on POSIX
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Tasks are detached threads, a tick is one millisecond of CLOCK_MONOTONIC
+ * and semaphores are a counter under a mutex. Priorities, cores and stack
+ * sizes are ignored.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_gap_ble_api.h"
+#include "esp_mac.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "nvs_flash.h"
+
+#define SIM_TASKS	16
+
+esp_log_level_t sim_log_level = ESP_LOG_WARN;
+
+struct sim_sem {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	uint32_t count;
+	uint32_t max;
+};
+
+struct sim_task {
+	pthread_t thread;
+	char name[16];
+	TaskFunction_t fn;
+	void *arg;
+	struct sim_sem notify;
+};
+
+static struct sim_task sim_tasks[SIM_TASKS];
+static int sim_ntasks;
+static pthread_mutex_t sim_tasks_mtx = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct sim_task *sim_self;
+
+static void sim_now(struct timespec *ts) {
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static void sim_ts_add_ms(struct timespec *ts, uint32_t ms) {
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+void sim_log(esp_log_level_t level, const char *tag, const char *fmt, ...) {
+	static const char lvl[] = "NEWIDV";
+	if (level > sim_log_level) return;
+	va_list ap;
+	va_start(ap, fmt);
+	flockfile(stderr);
+	fprintf(stderr, "%c (%u) %s: ", lvl[level], (unsigned) xTaskGetTickCount(), tag);
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+	funlockfile(stderr);
+	va_end(ap);
+}
+
+const char *esp_err_to_name(esp_err_t err) {
+	return err == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+/* Time */
+
+TickType_t xTaskGetTickCount(void) {
+	struct timespec ts;
+	sim_now(&ts);
+	return (TickType_t) (ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000);
+}
+
+int64_t esp_timer_get_time(void) {
+	struct timespec ts;
+	sim_now(&ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void vTaskDelay(TickType_t ticks) {
+	struct timespec ts = { ticks / 1000, (ticks % 1000) * 1000000L };
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+void vTaskDelayUntil(TickType_t *prev, TickType_t inc) {
+	*prev += inc;
+	int32_t left = (int32_t) (*prev - xTaskGetTickCount());
+	if (left > 0) vTaskDelay(left);
+}
+
+/* Semaphores */
+
+static void sim_sem_init(struct sim_sem *s, uint32_t count, uint32_t max) {
+	pthread_mutex_init(&s->mtx, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->count = count;
+	s->max = max;
+}
+
+/* Takes one count, or all of them with clear; returns the count before */
+static uint32_t sim_sem_take(struct sim_sem *s, TickType_t ticks, int clear) {
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	sim_ts_add_ms(&until, ticks);
+
+	pthread_mutex_lock(&s->mtx);
+	while (s->count == 0) {
+		if (ticks == 0) break;
+		if (ticks == portMAX_DELAY) pthread_cond_wait(&s->cond, &s->mtx);
+		else if (pthread_cond_timedwait(&s->cond, &s->mtx, &until) == ETIMEDOUT) break;
+	}
+	uint32_t n = s->count;
+	if (n != 0) s->count = clear ? 0 : n - 1;
+	pthread_mutex_unlock(&s->mtx);
+	return n;
+}
+
+static void sim_sem_give(struct sim_sem *s) {
+	pthread_mutex_lock(&s->mtx);
+	if (s->count < s->max) s->count++;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->mtx);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+	struct sim_sem *s = malloc(sizeof(*s));
+	sim_sem_init(s, 1, 1);
+	return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+	struct sim_sem *s = malloc(sizeof(*s));
+	sim_sem_init(s, 0, 1);
+	return s;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks) {
+	return sim_sem_take(s, ticks, 0) != 0;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s) {
+	sim_sem_give(s);
+	return pdTRUE;
+}
+
+/* Tasks */
+
+static void *sim_task_main(void *arg) {
+	sim_self = arg;
+	sim_self->fn(sim_self->arg);
+	return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+		UBaseType_t prio, TaskHandle_t *hdl) {
+	pthread_mutex_lock(&sim_tasks_mtx);
+	if (sim_ntasks == SIM_TASKS) {
+		pthread_mutex_unlock(&sim_tasks_mtx);
+		return pdFAIL;
+	}
+	struct sim_task *t = &sim_tasks[sim_ntasks++];
+	pthread_mutex_unlock(&sim_tasks_mtx);
+
+	snprintf(t->name, sizeof(t->name), "%s", name);
+	t->fn = fn;
+	t->arg = arg;
+	sim_sem_init(&t->notify, 0, UINT32_MAX);
+	if (hdl) *hdl = t;
+	if (pthread_create(&t->thread, NULL, sim_task_main, t) != 0) return pdFAIL;
+	pthread_detach(t->thread);
+	return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack,
+		void *arg, UBaseType_t prio, TaskHandle_t *hdl, BaseType_t core) {
+	return xTaskCreate(fn, name, stack, arg, prio, hdl);
+}
+
+void vTaskDelete(TaskHandle_t hdl) {
+	if (hdl == NULL || hdl == sim_self) pthread_exit(NULL);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+	return sim_sem_take(&sim_self->notify, ticks, clear);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t hdl) {
+	if (hdl) sim_sem_give(&hdl->notify);
+	return pdPASS;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t hdl) {
+	return 0;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+	return sim_self;
+}
+
+TaskHandle_t xTaskGetHandle(const char *name) {
+	int i;
+	for (i=0; i<sim_ntasks; i++) {
+		if (strcmp(sim_tasks[i].name, name) == 0) return &sim_tasks[i];
+	}
+	return NULL;
+}
+
+int64_t sim_task_cpu_ns(const char *name) {
+	TaskHandle_t t = xTaskGetHandle(name);
+	clockid_t clk;
+	struct timespec ts;
+	if (t == NULL || pthread_getcpuclockid(t->thread, &clk) != 0) return -1;
+	if (clock_gettime(clk, &ts) != 0) return -1;
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* System */
+
+/* Locally administered, the last byte is the instance id */
+uint8_t sim_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type) {
+	memcpy(mac, sim_mac, 6);
+	return ESP_OK;
+}
+
+uint32_t esp_random(void) {
+	return (uint32_t) random();
+}
+
+void esp_restart(void) {
+	exit(0);
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len) {
+	crc = ~crc;
+	while (len--) {
+		int k;
+		crc ^= *buf++;
+		for (k=0; k<8; k++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/* NVS: nothing stored, every read misses */
+
+esp_err_t nvs_flash_init(void) { return ESP_OK; }
+esp_err_t nvs_flash_erase(void) { return ESP_OK; }
+esp_err_t nvs_open(const char *ns, nvs_open_mode_t mode, nvs_handle_t *h) { *h = 1; return ESP_OK; }
+void nvs_close(nvs_handle_t h) { }
+esp_err_t nvs_commit(nvs_handle_t h) { return ESP_OK; }
+esp_err_t nvs_erase_key(nvs_handle_t h, const char *key) { return ESP_OK; }
+esp_err_t nvs_get_str(nvs_handle_t h, const char *key, char *out, size_t *len) { return ESP_ERR_NVS_NOT_FOUND; }
+esp_err_t nvs_get_blob(nvs_handle_t h, const char *key, void *out, size_t *len) { return ESP_ERR_NVS_NOT_FOUND; }
+esp_err_t nvs_get_u8(nvs_handle_t h, const char *key, uint8_t *out) { return ESP_ERR_NVS_NOT_FOUND; }
+esp_err_t nvs_get_u16(nvs_handle_t h, const char *key, uint16_t *out) { return ESP_ERR_NVS_NOT_FOUND; }
+esp_err_t nvs_get_u32(nvs_handle_t h, const char *key, uint32_t *out) { return ESP_ERR_NVS_NOT_FOUND; }
+esp_err_t nvs_get_u64(nvs_handle_t h, const char *key, uint64_t *out) { return ESP_ERR_NVS_NOT_FOUND; }
+esp_err_t nvs_set_str(nvs_handle_t h, const char *key, const char *val) { return ESP_OK; }
+esp_err_t nvs_set_blob(nvs_handle_t h, const char *key, const void *val, size_t len) { return ESP_OK; }
+esp_err_t nvs_set_u8(nvs_handle_t h, const char *key, uint8_t val) { return ESP_OK; }
+esp_err_t nvs_set_u16(nvs_handle_t h, const char *key, uint16_t val) { return ESP_OK; }
+esp_err_t nvs_set_u32(nvs_handle_t h, const char *key, uint32_t val) { return ESP_OK; }
+esp_err_t nvs_set_u64(nvs_handle_t h, const char *key, uint64_t val) { return ESP_OK; }
+esp_err_t nvs_get_stats(const char *part, nvs_stats_t *stats) { return ESP_ERR_NOT_SUPPORTED; }
+
+/* Bluetooth: the controller is the simulator calling gap_cb() */
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode) { return ESP_OK; }
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t *cfg) { return ESP_OK; }
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode) { return ESP_OK; }
+esp_err_t esp_ble_tx_power_set(esp_ble_power_type_t type, esp_power_level_t level) { return ESP_OK; }
+esp_err_t esp_bluedroid_init(void) { return ESP_OK; }
+esp_err_t esp_bluedroid_init_with_cfg(esp_bluedroid_config_t *cfg) { return ESP_OK; }
+esp_err_t esp_bluedroid_enable(void) { return ESP_OK; }
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t cb) { return ESP_OK; }
+esp_err_t esp_ble_gap_set_scan_params(esp_ble_scan_params_t *params) { return ESP_OK; }
+esp_err_t esp_ble_gap_start_scanning(uint32_t duration_s) { return ESP_OK; }
+esp_err_t esp_ble_gap_stop_scanning(void) { return ESP_OK; }
+
+/* Walks the AD structures of the advertisement and scan response */
+uint8_t *esp_ble_resolve_adv_data(uint8_t *adv, uint8_t type, uint8_t *len) {
+	int ofs = 0;
+	*len = 0;
+	while (ofs < ESP_BLE_ADV_DATA_LEN_MAX + ESP_BLE_SCAN_RSP_DATA_LEN_MAX) {
+		int l = adv[ofs];
+		if (l == 0 || ofs + 1 + l > ESP_BLE_ADV_DATA_LEN_MAX + ESP_BLE_SCAN_RSP_DATA_LEN_MAX) break;
+		if (adv[ofs + 1] == type) {
+			*len = l - 1;
+			return &adv[ofs + 2];
+		}
+		ofs += 1 + l;
+	}
+	return NULL;
+}
+
+/* Sockets */
+
+#undef setsockopt
+
+int sim_setsockopt(int fd, int level, int name, const void *val, socklen_t len) {
+	if (level == IPPROTO_IP && name == IP_ADD_MEMBERSHIP && len == sizeof(struct ip_mreq)) {
+		struct ip_mreq mreq = *(const struct ip_mreq *) val;
+		if (mreq.imr_interface.s_addr == htonl(INADDR_ANY)) {
+			mreq.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+			if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq.imr_interface,
+					sizeof(mreq.imr_interface)) < 0) return -1;
+		}
+		return setsockopt(fd, level, name, &mreq, sizeof(mreq));
+	}
+	return setsockopt(fd, level, name, val, len);
+}
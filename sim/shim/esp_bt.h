@@ -0,0 +1,16 @@
+#pragma once
+#include "esp_bt_defs.h"
+
+typedef enum {
+	ESP_BT_MODE_IDLE, ESP_BT_MODE_BLE, ESP_BT_MODE_CLASSIC_BT, ESP_BT_MODE_BTDM
+} esp_bt_mode_t;
+typedef struct { int unused; } esp_bt_controller_config_t;
+#define BT_CONTROLLER_INIT_CONFIG_DEFAULT() { 0 }
+
+typedef enum { ESP_BLE_PWR_TYPE_DEFAULT, ESP_BLE_PWR_TYPE_ADV, ESP_BLE_PWR_TYPE_SCAN } esp_ble_power_type_t;
+typedef enum { ESP_PWR_LVL_P9 = 7 } esp_power_level_t;
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode);
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t *cfg);
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode);
+esp_err_t esp_ble_tx_power_set(esp_ble_power_type_t type, esp_power_level_t level);
@@ -0,0 +1,5 @@
+#pragma once
+#include "esp_err.h"
+
+#define ESP_BD_ADDR_LEN		6
+typedef uint8_t esp_bd_addr_t[ESP_BD_ADDR_LEN];
@@ -0,0 +1,9 @@
+#pragma once
+#include "esp_bt.h"
+
+typedef struct { int unused; } esp_bluedroid_config_t;
+#define BT_BLUEDROID_INIT_CONFIG_DEFAULT() { 0 }
+
+esp_err_t esp_bluedroid_init(void);
+esp_err_t esp_bluedroid_init_with_cfg(esp_bluedroid_config_t *cfg);
+esp_err_t esp_bluedroid_enable(void);
@@ -0,0 +1,12 @@
+/* Simulator stand-in: the cycle counter runs at CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ */
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#include "sdkconfig.h"
+
+static inline uint32_t esp_cpu_get_cycle_count(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t) (((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec) *
+			CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ / 1000);
+}
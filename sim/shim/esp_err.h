@@ -0,0 +1,32 @@
+/* Simulator stand-in for the ESP-IDF header of the same name */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdio.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK					0
+#define ESP_FAIL				-1
+#define ESP_ERR_NO_MEM			0x101
+#define ESP_ERR_INVALID_ARG		0x102
+#define ESP_ERR_INVALID_STATE	0x103
+#define ESP_ERR_INVALID_SIZE	0x104
+#define ESP_ERR_NOT_FOUND		0x105
+#define ESP_ERR_NOT_SUPPORTED	0x106
+#define ESP_ERR_TIMEOUT			0x107
+#define ESP_ERR_INVALID_CRC		0x109
+
+const char *esp_err_to_name(esp_err_t err);
+
+#define ESP_ERROR_CHECK(x)		do { esp_err_t e_ = (x); if (e_ != ESP_OK) abort(); } while (0)
+#define BIT0	0x01
+#define BIT1	0x02
+#define BIT2	0x04
+#define BIT3	0x08
+#define IRAM_ATTR
@@ -0,0 +1,51 @@
+#pragma once
+#include "esp_bt_defs.h"
+
+typedef enum {
+	ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT,
+	ESP_GAP_BLE_SCAN_START_COMPLETE_EVT,
+	ESP_GAP_BLE_SCAN_RESULT_EVT,
+	ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT,
+} esp_gap_ble_cb_event_t;
+typedef enum { ESP_GAP_SEARCH_INQ_RES_EVT, ESP_GAP_SEARCH_INQ_CMPL_EVT } esp_gap_search_evt_t;
+typedef enum { ESP_BT_STATUS_SUCCESS } esp_bt_status_t;
+
+#define ESP_BLE_ADV_DATA_LEN_MAX		31
+#define ESP_BLE_SCAN_RSP_DATA_LEN_MAX	31
+
+typedef union {
+	struct { esp_bt_status_t status; } scan_param_cmpl;
+	struct { esp_bt_status_t status; } scan_start_cmpl;
+	struct { esp_bt_status_t status; } scan_stop_cmpl;
+	struct ble_scan_result_evt_param {
+		esp_gap_search_evt_t search_evt;
+		esp_bd_addr_t bda;
+		int rssi;
+		uint8_t ble_adv[ESP_BLE_ADV_DATA_LEN_MAX + ESP_BLE_SCAN_RSP_DATA_LEN_MAX];
+		uint8_t adv_data_len;
+		uint8_t scan_rsp_len;
+	} scan_rst;
+} esp_ble_gap_cb_param_t;
+
+typedef struct {
+	int scan_type, own_addr_type, scan_filter_policy;
+	uint16_t scan_interval, scan_window;
+	int scan_duplicate;
+} esp_ble_scan_params_t;
+
+#define BLE_SCAN_TYPE_PASSIVE			0
+#define BLE_SCAN_TYPE_ACTIVE			1
+#define BLE_ADDR_TYPE_PUBLIC			0
+#define BLE_SCAN_FILTER_ALLOW_ALL		0
+#define BLE_SCAN_DUPLICATE_DISABLE		0
+#define ESP_BLE_AD_TYPE_16SRV_CMPL		0x03
+#define ESP_BLE_AD_TYPE_NAME_CMPL		0x09
+#define ESP_BLE_AD_TYPE_SERVICE_DATA	0x16
+
+typedef void (*esp_gap_ble_cb_t)(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param);
+
+uint8_t *esp_ble_resolve_adv_data(uint8_t *adv, uint8_t type, uint8_t *len);
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t cb);
+esp_err_t esp_ble_gap_set_scan_params(esp_ble_scan_params_t *params);
+esp_err_t esp_ble_gap_start_scanning(uint32_t duration_s);
+esp_err_t esp_ble_gap_stop_scanning(void);
@@ -0,0 +1,18 @@
+/* Simulator stand-in: errors, warnings and info to stderr, debug compiled out like on the target */
+#pragma once
+#include "esp_err.h"
+
+typedef enum {
+	ESP_LOG_NONE, ESP_LOG_ERROR, ESP_LOG_WARN, ESP_LOG_INFO, ESP_LOG_DEBUG, ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+extern esp_log_level_t sim_log_level;
+void sim_log(esp_log_level_t level, const char *tag, const char *fmt, ...)
+		__attribute__((format(printf, 3, 4)));
+
+#define ESP_LOGE(tag, fmt, ...) sim_log(ESP_LOG_ERROR, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) sim_log(ESP_LOG_WARN, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) sim_log(ESP_LOG_INFO, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) do { } while (0)
+#define ESP_LOGV(tag, fmt, ...) do { } while (0)
+#define ESP_LOG_BUFFER_HEX_LEVEL(tag, buf, len, level) do { } while (0)
@@ -0,0 +1,7 @@
+#pragma once
+#include "esp_err.h"
+
+typedef enum { ESP_MAC_WIFI_STA, ESP_MAC_WIFI_SOFTAP, ESP_MAC_BT } esp_mac_type_t;
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type);
+
+extern uint8_t sim_mac[6];		// returned for every type
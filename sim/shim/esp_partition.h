@@ -0,0 +1,39 @@
+/* Simulator stand-in for the ESP-IDF header of the same name, see partition.c */
+#pragma once
+#include "esp_err.h"
+
+typedef enum {
+	ESP_PARTITION_TYPE_APP = 0x00,
+	ESP_PARTITION_TYPE_DATA = 0x01,
+	ESP_PARTITION_TYPE_ANY = 0xff,
+} esp_partition_type_t;
+
+typedef enum {
+	ESP_PARTITION_SUBTYPE_ANY = 0xff,
+} esp_partition_subtype_t;
+
+typedef struct {
+	esp_partition_type_t type;
+	esp_partition_subtype_t subtype;
+	uint32_t address;
+	uint32_t size;
+	uint32_t erase_size;
+	char label[17];
+	bool encrypted;
+	bool readonly;
+} esp_partition_t;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+		esp_partition_subtype_t subtype, const char *label);
+esp_err_t esp_partition_read(const esp_partition_t *p, size_t off, void *dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *p, size_t off, const void *src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t *p, size_t off, size_t size);
+
+/* Simulator only: a data partition backed by a file, erased if it is new */
+const esp_partition_t *sim_partition_add(const char *label, const char *path, uint32_t size);
+/*
+ * Simulator only: after budget more bytes have been programmed, writes and
+ * erases fail as if the power had been cut, the write in progress halfway.
+ * A negative budget restores the power.
+ */
+void sim_partition_cut(const esp_partition_t *p, int64_t budget);
@@ -0,0 +1,5 @@
+#pragma once
+#include "esp_err.h"
+
+uint32_t esp_random(void);
+void esp_restart(void);
@@ -0,0 +1,19 @@
+/* Simulator stand-in: FreeRTOS on pthreads, one tick per millisecond */
+#pragma once
+#include "esp_err.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#ifndef portTICK_PERIOD_MS		// poll_test uses the firmware's 10 ms
+#define portTICK_PERIOD_MS	1
+#endif
+#define configTICK_RATE_HZ	(1000 / portTICK_PERIOD_MS)
+#define portMAX_DELAY		0xffffffffu
+#define pdTRUE				1
+#define pdFALSE				0
+#define pdPASS				1
+#define pdFAIL				0
+#define pdMS_TO_TICKS(ms)	((TickType_t) ((ms) / portTICK_PERIOD_MS))
+#define tskNO_AFFINITY		0x7fffffff
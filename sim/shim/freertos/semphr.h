@@ -0,0 +1,9 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_sem *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s);
@@ -0,0 +1,22 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+		UBaseType_t prio, TaskHandle_t *hdl);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack,
+		void *arg, UBaseType_t prio, TaskHandle_t *hdl, BaseType_t core);
+void vTaskDelete(TaskHandle_t hdl);
+void vTaskDelay(TickType_t ticks);
+void vTaskDelayUntil(TickType_t *prev, TickType_t inc);
+TickType_t xTaskGetTickCount(void);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+BaseType_t xTaskNotifyGive(TaskHandle_t hdl);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t hdl);
+TaskHandle_t xTaskGetHandle(const char *name);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+
+/* CPU time used by the named task so far, for the benchmark */
+int64_t sim_task_cpu_ns(const char *name);
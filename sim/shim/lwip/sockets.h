@@ -0,0 +1,14 @@
+/* Simulator stand-in: lwIP's BSD socket API is the host's */
+#pragma once
+#include "esp_err.h"
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * The simulator's network is loopback: multicast groups joined on any
+ * interface are joined and sent to there instead, see shim.c.
+ */
+int sim_setsockopt(int fd, int level, int name, const void *val, socklen_t len);
+#define setsockopt sim_setsockopt
@@ -0,0 +1,34 @@
+/* Simulator stand-in: nothing is persisted, every read misses */
+#pragma once
+#include "esp_err.h"
+
+#define ESP_ERR_NVS_NOT_FOUND			0x1102
+#define ESP_ERR_NVS_NO_FREE_PAGES		0x110d
+#define ESP_ERR_NVS_NEW_VERSION_FOUND	0x1110
+
+typedef uint32_t nvs_handle_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+typedef struct {
+	size_t used_entries;
+	size_t free_entries;
+	size_t total_entries;
+	size_t namespace_count;
+} nvs_stats_t;
+
+esp_err_t nvs_open(const char *ns, nvs_open_mode_t mode, nvs_handle_t *h);
+void nvs_close(nvs_handle_t h);
+esp_err_t nvs_commit(nvs_handle_t h);
+esp_err_t nvs_erase_key(nvs_handle_t h, const char *key);
+esp_err_t nvs_get_str(nvs_handle_t h, const char *key, char *out, size_t *len);
+esp_err_t nvs_get_blob(nvs_handle_t h, const char *key, void *out, size_t *len);
+esp_err_t nvs_get_u8(nvs_handle_t h, const char *key, uint8_t *out);
+esp_err_t nvs_get_u16(nvs_handle_t h, const char *key, uint16_t *out);
+esp_err_t nvs_get_u32(nvs_handle_t h, const char *key, uint32_t *out);
+esp_err_t nvs_get_u64(nvs_handle_t h, const char *key, uint64_t *out);
+esp_err_t nvs_set_str(nvs_handle_t h, const char *key, const char *val);
+esp_err_t nvs_set_blob(nvs_handle_t h, const char *key, const void *val, size_t len);
+esp_err_t nvs_set_u8(nvs_handle_t h, const char *key, uint8_t val);
+esp_err_t nvs_set_u16(nvs_handle_t h, const char *key, uint16_t val);
+esp_err_t nvs_set_u32(nvs_handle_t h, const char *key, uint32_t val);
+esp_err_t nvs_set_u64(nvs_handle_t h, const char *key, uint64_t val);
+esp_err_t nvs_get_stats(const char *part, nvs_stats_t *stats);
@@ -0,0 +1,19 @@
+/* Simulator stand-in: the defaults of the options the simulated modules use */
+#pragma once
+
+#define CONFIG_HYG_CORE_BLE					0
+#define CONFIG_HYG_PRIO_POLL				5
+#define CONFIG_HYG_PRIO_NET					4
+#define CONFIG_HYG_PRIO_HTTPD				3
+#define CONFIG_HYG_PRIO_SPOOL				2
+#define CONFIG_HYG_PRIO_LOG					1
+#define CONFIG_HYG_STACK_MARGIN				512
+#ifndef CONFIG_HYG_REPORT_SPREAD			// set by the Makefile
+#define CONFIG_HYG_REPORT_SPREAD			0
+#endif
+#define CONFIG_BT_BLUEDROID_PINNED_TO_CORE	0
+#define CONFIG_BT_BTC_TASK_STACK_SIZE		3072
+#define CONFIG_BT_BTU_TASK_STACK_SIZE		4096
+#define CONFIG_LWIP_TCPIP_TASK_STACK_SIZE	3072
+#define CONFIG_ESP_MAIN_TASK_STACK_SIZE		3584
+#define CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ		160
@@ -0,0 +1,428 @@
+/*
+ * sim.c
+ *
+ * Load simulator for the advertisement to Influx pipeline
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs the firmware's bt.c, conf.c, history.c, influx.c, fwd.c, gossip.c, poller.c
+ * and tasks.c against N synthetic MiBeacon sensors. The injector thread plays the
+ * Bluetooth stack and calls gap_cb() at the configured advertisement rate;
+ * the poller sends its line protocol to a UDP sink on loopback, the port
+ * the firmware uses for Influx.
+ *
+ * Each advertisement carries a per-sensor sequence number as its raw
+ * temperature, so the sink can match a reported point to the time its
+ * advertisement was injected.
+ *
+ * Several instances can run side by side as proxies hearing the same
+ * sensors: instance k has the MAC 02:00:00:00:00:k and its Influx sink on
+ * 127.0.0.k, and with -g they elect reporters over the gossip group on
+ * loopback. -a sets how much weaker an instance hears the sensors, and when
+ * that changes; -p prints every point its sink receives.
+ */
+
+#include <pthread.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_gap_ble_api.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "conf.h"
+#include "bt.h"
+#include "history.h"
+#include "fwd.h"
+#include "gossip.h"
+#include "poller.h"
+#include "stats.h"
+
+#define SIM_ADDR_BASE	0xA4C138000000ULL
+#define SIM_RING		64				// injection times kept per sensor
+#define SIM_RAW_WRAP	(30 * SIM_RING)	// raw temperature 0..191.9 °C
+#define SIM_BATCH_MS	5				// injector wakeup period
+#define SIM_INFLUX_PORT	8089			// fixed in influx.c
+#define SIM_BUF_LEN		2048
+#define SIM_ATTEN_STEPS	8
+
+void gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param);
+extern uint32_t sim_spooled;
+
+static int sim_n = 100;
+static double sim_rate = 1.0;			// advertisements per sensor and second
+static int sim_interval_s = 10;
+static int sim_duration_s = 60;
+static int sim_fwd;
+static int sim_id = 1;
+static int sim_gossip;
+static int sim_print;
+
+/* Attenuation in dB from the given time on */
+static struct {
+	int64_t at_us;
+	int db;
+} sim_atten[SIM_ATTEN_STEPS];
+static int sim_natten;
+
+static int64_t sim_t0;
+static uint64_t *sim_ring;				// injection time << 11 | raw temperature
+static volatile int sim_stop;
+
+/* Sink state, only touched by the sink threads until they are stopped */
+static double *sim_lat_ms;
+static uint32_t sim_points, sim_points_cap, sim_unmatched, sim_datagrams;
+static uint32_t sim_sweeps;
+static int64_t sim_sweep_first, sim_sweep_last, sim_sweep_sum, sim_sweep_max;
+static uint32_t sim_fwd_datagrams, sim_fwd_recs;
+
+static int64_t sim_thread_cpu_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int sim_atten_at(int64_t t_us) {
+	int k, db = 0;
+	for (k=0; k<sim_natten && sim_atten[k].at_us <= t_us; k++) db = sim_atten[k].db;
+	return db;
+}
+
+/* "db[,db@s...]": the attenuation from the start and from s seconds on */
+static int sim_atten_parse(char *arg) {
+	char *tok;
+	for (tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (sim_natten == SIM_ATTEN_STEPS) return -1;
+		char *at = strchr(tok, '@');
+		sim_atten[sim_natten].db = atoi(tok);
+		sim_atten[sim_natten].at_us = at ? atof(at + 1) * 1e6 : 0;
+		if (sim_natten > 0 && sim_atten[sim_natten].at_us < sim_atten[sim_natten - 1].at_us) return -1;
+		sim_natten++;
+	}
+	return 0;
+}
+
+/* MiBeacon temperature and humidity advertisement of sensor i */
+static void sim_build_adv(esp_ble_gap_cb_param_t *p, int i, uint32_t seq, int raw_t, int atten) {
+	uint64_t addr = SIM_ADDR_BASE + i;
+	int k;
+	memset(p, 0, sizeof(*p));
+	p->scan_rst.search_evt = ESP_GAP_SEARCH_INQ_RES_EVT;
+	for (k=0; k<6; k++) p->scan_rst.bda[k] = addr >> (8 * (5 - k));
+	p->scan_rst.rssi = -50 - i % 40 - atten;
+
+	uint8_t *a = p->scan_rst.ble_adv;
+	*a++ = 2;					// flags
+	*a++ = 0x01;
+	*a++ = 0x06;
+	*a++ = 21;					// service data
+	*a++ = ESP_BLE_AD_TYPE_SERVICE_DATA;
+	*a++ = 0x95;				// UUID 0xFE95
+	*a++ = 0xFE;
+	*a++ = 0x50;				// frame control: object included, no capability
+	*a++ = 0x20;
+	*a++ = 0x5B;				// product id
+	*a++ = 0x05;
+	*a++ = seq;					// frame counter
+	for (k=0; k<6; k++) *a++ = p->scan_rst.bda[5 - k];
+	*a++ = 0x0D;				// temperature and humidity
+	*a++ = 0x10;
+	*a++ = 4;
+	*a++ = raw_t;
+	*a++ = raw_t >> 8;
+	*a++ = 500 & 0xFF;			// 50.0 %
+	*a++ = 500 >> 8;
+	p->scan_rst.adv_data_len = a - p->scan_rst.ble_adv;
+}
+
+/* Plays the Bluetooth stack: adverts round robin over the sensors at the total rate */
+static void sim_inject(uint64_t *adverts, int64_t *cpu_ns) {
+	static esp_ble_gap_cb_param_t batch[4096];
+	uint32_t *seq = calloc(sim_n, sizeof(uint32_t));
+	double total_rate = sim_n * sim_rate;
+	int64_t start = esp_timer_get_time();
+	int64_t end = start + sim_duration_s * 1000000LL;
+	uint64_t sent = 0;
+	static int idx[4096];
+	static uint16_t raws[4096];
+
+	while (1) {
+		int64_t now = esp_timer_get_time();
+		if (now >= end) break;
+		uint64_t due = (now - start) * total_rate / 1e6;
+		int atten = sim_atten_at(now - start);
+		while (sent < due) {
+			int n = 0, k;
+			while (sent < due && n < 4096) {
+				int i = sent % sim_n;
+				uint32_t s = seq[i]++;
+				raws[n] = s % SIM_RAW_WRAP;
+				sim_build_adv(&batch[n], i, s, raws[n], atten);
+				idx[n++] = i;
+				sent++;
+			}
+			int64_t c0 = sim_thread_cpu_ns();
+			for (k=0; k<n; k++) {
+				int i = idx[k], raw = raws[k];
+				uint64_t t = esp_timer_get_time() - sim_t0;
+				__atomic_store_n(&sim_ring[i * SIM_RING + raw % SIM_RING], t << 11 | raw,
+						__ATOMIC_RELAXED);
+				gap_cb(ESP_GAP_BLE_SCAN_RESULT_EVT, &batch[k]);
+			}
+			*cpu_ns += sim_thread_cpu_ns() - c0;
+		}
+		vTaskDelay(SIM_BATCH_MS);
+	}
+	*adverts = sent;
+	free(seq);
+}
+
+static int sim_bind(uint32_t addr, int port) {
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+	struct sockaddr_in a = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(addr),
+	};
+	int sz = 4 << 20;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+	if (bind(sock, (struct sockaddr *) &a, sizeof(a)) < 0) {
+		fprintf(stderr, "cannot bind UDP port %d: %s\n", port, strerror(errno));
+		exit(1);
+	}
+	struct timeval tv = { 0, 100000 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return sock;
+}
+
+static void sim_point(const char *line, int64_t now) {
+	const char *id = strstr(line, ",id=");
+	const char *temp = strstr(line, " temperature=");
+	if (id == NULL || temp == NULL) return;
+	uint64_t addr = strtoull(id + 4, NULL, 16);
+	int raw = lround(strtod(temp + 13, NULL) * 10);
+	int64_t i = addr - SIM_ADDR_BASE;
+	if (sim_print) printf("point %.3f %lld\n", (now - sim_t0) / 1e6, (long long) i);
+
+	if (sim_points == sim_points_cap) {
+		sim_points_cap = sim_points_cap ? 2 * sim_points_cap : 65536;
+		sim_lat_ms = realloc(sim_lat_ms, sim_points_cap * sizeof(double));
+	}
+	uint64_t e = i >= 0 && i < sim_n ?
+			__atomic_load_n(&sim_ring[i * SIM_RING + raw % SIM_RING], __ATOMIC_RELAXED) : 0;
+	if (e == 0 || (int) (e & 0x7FF) != raw) {
+		sim_unmatched++;
+		return;
+	}
+	sim_lat_ms[sim_points++] = (now - sim_t0 - (int64_t) (e >> 11)) / 1000.0;
+}
+
+/* Influx line protocol sink; a gap of half an interval starts a new sweep */
+static void *sim_sink(void *arg) {
+	int sock = *(int *) arg;
+	char buf[SIM_BUF_LEN + 1];
+	while (!sim_stop) {
+		int len = recv(sock, buf, SIM_BUF_LEN, 0);
+		if (len <= 0) continue;
+		int64_t now = esp_timer_get_time();
+		buf[len] = '\0';
+		sim_datagrams++;
+
+		if (sim_sweeps == 0 || now - sim_sweep_last > sim_interval_s * 500000LL) {
+			if (sim_sweeps != 0) sim_sweep_sum += sim_sweep_last - sim_sweep_first;
+			sim_sweeps++;
+			sim_sweep_first = now;
+		}
+		sim_sweep_last = now;
+		if (now - sim_sweep_first > sim_sweep_max) sim_sweep_max = now - sim_sweep_first;
+
+		char *line = buf, *nl;
+		while (line != NULL && *line != '\0') {
+			nl = strchr(line, '\n');
+			if (nl) *nl++ = '\0';
+			if (strstr(line, ",type=bt,")) sim_point(line, now);
+			line = nl;
+		}
+	}
+	return NULL;
+}
+
+/* Forwarded advertisement batches, only counted */
+static void *sim_fwd_sink(void *arg) {
+	int sock = *(int *) arg;
+	uint8_t buf[SIM_BUF_LEN];
+	while (!sim_stop) {
+		int len = recv(sock, buf, sizeof(buf), 0);
+		if (len < 20 || buf[0] != 'H' || buf[1] != 'F') continue;
+		sim_fwd_datagrams++;
+		sim_fwd_recs += buf[18] | (buf[19] << 8);
+	}
+	return NULL;
+}
+
+static int sim_cmp(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static double sim_pct(double p) {
+	if (sim_points == 0) return NAN;
+	uint32_t k = p * (sim_points - 1) + 0.5;
+	return sim_lat_ms[k];
+}
+
+static void sim_configure() {
+	struct conf *c = conf_edit();
+	memset(c->clients, 0, sizeof(c->clients));
+	snprintf(c->influx.host, sizeof(c->influx.host), "127.0.0.%d", sim_id);
+	snprintf(c->influx.db, sizeof(c->influx.db), "sim");
+	c->influx.interval_s = sim_interval_s;
+	c->gossip.on = sim_gossip;
+	if (sim_fwd) {
+		snprintf(c->fwd.host, sizeof(c->fwd.host), "127.0.0.1");
+		c->fwd.port = FWD_PORT_DEFAULT;
+	}
+	int i;
+	for (i=0; i<sim_n; i++) {
+		c->clients[i].addr = SIM_ADDR_BASE + i;
+		snprintf(c->clients[i].name, sizeof(c->clients[i].name), "s%d", i);
+	}
+	conf_commit(c);
+	bt_results_clear();
+}
+
+static void sim_usage(const char *prog) {
+	fprintf(stderr,
+			"usage: %s [-n sensors] [-r adverts/s per sensor] [-i report interval s]\n"
+			"          [-d duration s] [-f] [-v] [-m id] [-g] [-a db[,db@s...]] [-p]\n"
+			"  -f  also forward raw advertisements to UDP %d\n"
+			"  -v  log firmware info messages\n"
+			"  -m  instance 1..254: MAC 02:00:00:00:00:id, Influx sink on 127.0.0.id\n"
+			"  -g  elect reporters with other instances over %s:%d\n"
+			"  -a  hear the sensors this many dB weaker, from s seconds on\n"
+			"  -p  print each point received as: point <s since start> <sensor>\n",
+			prog, FWD_PORT_DEFAULT, GOSSIP_GROUP, GOSSIP_PORT);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "n:r:i:d:fvm:ga:p")) != -1) {
+		switch (opt) {
+		case 'n': sim_n = atoi(optarg); break;
+		case 'r': sim_rate = atof(optarg); break;
+		case 'i': sim_interval_s = atoi(optarg); break;
+		case 'd': sim_duration_s = atoi(optarg); break;
+		case 'f': sim_fwd = 1; break;
+		case 'v': sim_log_level = ESP_LOG_INFO; break;
+		case 'm': sim_id = atoi(optarg); break;
+		case 'g': sim_gossip = 1; break;
+		case 'a': if (sim_atten_parse(optarg)) sim_usage(argv[0]); break;
+		case 'p': sim_print = 1; break;
+		default: sim_usage(argv[0]);
+		}
+	}
+	if (sim_n < 1 || sim_n > CONF_MAX_IFX_CLIENTS || sim_rate <= 0 ||
+			sim_interval_s < 1 || sim_duration_s < sim_interval_s ||
+			sim_id < 1 || sim_id > 254) sim_usage(argv[0]);
+	sim_mac[5] = sim_id;
+	if (sim_print) setvbuf(stdout, NULL, _IOLBF, 0);
+
+	sim_ring = calloc((size_t) sim_n * SIM_RING, sizeof(uint64_t));
+	sim_t0 = esp_timer_get_time() - 1;		// no injection time is 0
+
+	int sink = sim_bind(INADDR_LOOPBACK - 1 + sim_id, SIM_INFLUX_PORT), fwd_sink = -1;
+	pthread_t sink_thr, fwd_thr;
+	pthread_create(&sink_thr, NULL, sim_sink, &sink);
+	if (sim_fwd) {
+		fwd_sink = sim_bind(INADDR_LOOPBACK, FWD_PORT_DEFAULT);
+		pthread_create(&fwd_thr, NULL, sim_fwd_sink, &fwd_sink);
+	}
+
+	conf_init();
+	history_init();
+	fwd_init();
+	bt_init();
+	sim_configure();
+	if (sim_gossip) gossip_init();
+	poller_init();
+
+	struct rusage ru0, ru1;
+	getrusage(RUSAGE_SELF, &ru0);
+	uint64_t adverts = 0;
+	int64_t adv_cpu_ns = 0;
+	sim_inject(&adverts, &adv_cpu_ns);
+
+	/* Let the last sweep, which reports the last adverts, arrive */
+	vTaskDelay(sim_interval_s * 1000 + 500);
+	getrusage(RUSAGE_SELF, &ru1);
+	sim_stop = 1;
+	pthread_join(sink_thr, NULL);
+	if (sim_fwd) pthread_join(fwd_thr, NULL);
+	if (sim_sweeps != 0) sim_sweep_sum += sim_sweep_last - sim_sweep_first;
+
+	int64_t poll_cpu_ns = sim_task_cpu_ns("pollT");
+	double cpu_s = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec + ru1.ru_stime.tv_sec -
+			ru0.ru_stime.tv_sec) + (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec +
+			ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec) / 1e6;
+	double wall_s = sim_duration_s + sim_interval_s + 0.5;
+	struct bt_stats bs;
+	bt_stats_get(&bs);
+
+	qsort(sim_lat_ms, sim_points, sizeof(double), sim_cmp);
+	uint32_t received = sim_points + sim_unmatched;
+
+	printf("sensors           %d, %.2f adverts/s each, report every %d s, %d s\n",
+			sim_n, sim_rate, sim_interval_s, sim_duration_s);
+	printf("adverts           %llu injected, %u matched, %u decoded\n",
+			(unsigned long long) adverts, bs.adv_matched, bs.adv_decoded);
+	printf("points            %u in %u datagrams, %u unmatched, %u spooled\n",
+			received, sim_datagrams, sim_unmatched, sim_spooled);
+	printf("latency ms        p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+			sim_pct(0.50), sim_pct(0.90), sim_pct(0.99),
+			sim_points ? sim_lat_ms[sim_points - 1] : NAN);
+	printf("cpu per advert    %.2f us (gap_cb)\n", adverts ? adv_cpu_ns / 1e3 / adverts : NAN);
+	printf("cpu per point     %.2f us (poller: format and send)\n",
+			received && poll_cpu_ns >= 0 ? poll_cpu_ns / 1e3 / received : NAN);
+	printf("sweeps            %u, %.1f ms average, %.1f ms longest\n", sim_sweeps,
+			sim_sweeps ? sim_sweep_sum / 1e3 / sim_sweeps : NAN, sim_sweep_max / 1e3);
+	printf("points/s          %.0f during sweeps, %.1f overall\n",
+			sim_sweep_sum ? received / (sim_sweep_sum / 1e6) : NAN, received / wall_s);
+	printf("process cpu       %.1f %% of one core\n", 100 * cpu_s / wall_s);
+	if (sim_fwd) {
+		struct fwd_stats fs;
+		fwd_stats_get(&fs);
+		printf("forwarded         %u records in %u datagrams, %u dropped\n",
+				sim_fwd_recs, sim_fwd_datagrams, fs.drops + fs.rate_drops);
+	}
+	int id;
+	for (id=0; id<STATS_COUNT; id++) {
+		struct stats_hist h;
+		stats_get(id, &h);
+		if (h.count == 0) continue;
+		printf("%-17s p50 %lu  p90 %lu  p99 %lu  max %lu us (stats.c, %lu samples)\n",
+				stats_name(id), (unsigned long) stats_pct(&h, 50),
+				(unsigned long) stats_pct(&h, 90), (unsigned long) stats_pct(&h, 99),
+				(unsigned long) h.max_us, (unsigned long) h.count);
+	}
+	return 0;
+}
@@ -0,0 +1,474 @@
+/*
+ * tslog_test.c
+ *
+ * Flash log and spool on a file-backed partition
+ *
+ * Copyright 2019 Anti Sullin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * tslog.c runs on a partition in a file (partition.c), remounted from it
+ * wherever the device would reboot. The spool test runs spool.c with its
+ * task, the real Influx formatter and a UDP sink on 127.0.0.1:8089, going
+ * offline and back online through wifi_wait_conn().
+ */
+
+#include <arpa/inet.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "conf.h"
+#include "spool.h"
+#include "tslog.h"
+
+#define TEST_SECTORS		16
+#define SPOOL_SECTORS		3
+#define SINK_PORT			8089	// fixed in influx.c
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: ", __func__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		failures++; \
+	} \
+} while (0)
+
+///////////////////////////////////////////////////////////////////////////////
+/* Stand-ins for wifi.c: the spool test switches the network on and off */
+
+static volatile int test_online;
+
+int wifi_wait_conn(int timeout_ms) {
+	for (; !test_online && timeout_ms > 0; timeout_ms -= 10) vTaskDelay(10);
+	return test_online;
+}
+
+void wifi_report_sent() { }
+
+///////////////////////////////////////////////////////////////////////////////
+static const esp_partition_t *part;
+
+static int fl_read(void *ctx, uint32_t off, void *buf, size_t len) {
+	return esp_partition_read(part, off, buf, len) != ESP_OK;
+}
+
+static int fl_write(void *ctx, uint32_t off, const void *buf, size_t len) {
+	return esp_partition_write(part, off, buf, len) != ESP_OK;
+}
+
+static int fl_erase(void *ctx, uint32_t off) {
+	return esp_partition_erase_range(part, off, TSLOG_SECTOR) != ESP_OK;
+}
+
+static struct tslog_flash flash = {
+	.read = fl_read,
+	.write = fl_write,
+	.erase = fl_erase,
+};
+
+static struct tslog tl;
+
+/* An erased log of nsect sectors */
+static void fresh(uint32_t nsect) {
+	esp_partition_erase_range(part, 0, part->size);
+	flash.size = nsect * TSLOG_SECTOR;
+	CHECK(tslog_mount(&tl, &flash) == 0, "mount of a blank log failed");
+}
+
+/* As after a reset: everything in RAM is gone */
+static void reboot() {
+	CHECK(tslog_mount(&tl, &flash) == 0, "remount failed");
+}
+
+/* Frames as appended, the expected replay */
+struct frame {
+	uint32_t time;
+	int n;
+	struct tslog_rec recs[TSLOG_FRAME_RECS];
+};
+
+static struct frame frames[4096];
+
+static int frame_eq(const struct frame *f, uint32_t time, const struct tslog_rec *recs, int n) {
+	if (f->time != time || f->n != n) return 0;
+	int i;
+	for (i=0; i<n; i++) {
+		if (recs[i].addr != f->recs[i].addr || recs[i].t != f->recs[i].t ||
+				recs[i].h != f->recs[i].h) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Reads and acknowledges everything pending. Returns the number of frames;
+ * first is the index of the first one in frames[], -1 if it is not there.
+ * The frames must follow each other in frames[].
+ */
+static int replay_all(int nframes, int *first) {
+	struct tslog_rec recs[TSLOG_FRAME_RECS];
+	struct tslog_pos pos;
+	uint32_t time;
+	int n, count = 0, k = -1;
+	*first = -1;
+	while ((n = tslog_read(&tl, &pos, &time, recs)) > 0) {
+		if (count == 0) {
+			for (k=0; k<nframes && !frame_eq(&frames[k], time, recs, n); k++);
+			*first = k < nframes ? k : -1;
+		} else {
+			k++;
+			CHECK(k < nframes && frame_eq(&frames[k], time, recs, n),
+					"frame %d after %d replayed out of order", count, *first);
+		}
+		CHECK(tslog_ack(&tl, &pos) == 0, "ack failed");
+		if (++count > nframes) break;
+	}
+	CHECK(n == 0, "read failed");
+	return count;
+}
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd() {
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+/* Random frame of up to n sensors, values changing in every delta class */
+static void frame_make(struct frame *f, uint32_t time, int nsensors, int n) {
+	static const int16_t steps[] = { 0, 0, 0, 1, -1, 7, -8, 8, -9, 127, -128, 128, -129, 3000 };
+	f->time = time;
+	f->n = n;
+	int i;
+	for (i=0; i<n; i++) {
+		struct tslog_rec *r = &f->recs[i];
+		r->addr = 0xa4c138000000ULL + (rnd() % nsensors) * 0x010203ULL;
+		int16_t base = f == frames ? 0 : f[-1].recs[i % f[-1].n].t;
+		if (base == TSLOG_NONE) base = 0;
+		int32_t t = base + steps[rnd() % (sizeof(steps) / sizeof(steps[0]))];
+		if (t > INT16_MAX || t <= TSLOG_NONE) t = 0;
+		r->t = rnd() % 13 == 0 ? TSLOG_NONE : t;
+		r->h = rnd() % 11 == 0 ? TSLOG_NONE : (int16_t) (rnd() % 1001);
+	}
+}
+
+/* Reads and acknowledges the next n frames */
+static void ack(int n) {
+	struct tslog_rec recs[TSLOG_FRAME_RECS];
+	struct tslog_pos pos;
+	uint32_t time;
+	while (n-- > 0) {
+		CHECK(tslog_read(&tl, &pos, &time, recs) > 0 && tslog_ack(&tl, &pos) == 0,
+				"read or ack failed");
+	}
+}
+
+static void append(struct frame *f) {
+	CHECK(tslog_append(&tl, f->time, f->recs, f->n) == 0, "append failed");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/* Delta-of-delta times and value deltas at every coding boundary */
+static void test_codec() {
+	static const int32_t dods[] = {
+		0, 1, -1, 63, -64, 64, -65, 255, -256, 256, -257, 2047, -2048, 2048, -2049,
+		100000, -100000, 0, 0, -30,
+	};
+	static const int16_t vals[] = {
+		0, 0, 7, -1, 7, -1, 126, -1, 127, -1, INT16_MAX, INT16_MIN + 1, TSLOG_NONE, -400,
+		TSLOG_NONE, TSLOG_NONE, 1000, -9, 0,
+	};
+	fresh(TEST_SECTORS);
+
+	uint32_t time = 1700000000;
+	int32_t dt = 30;
+	int nframes = 0, i, j;
+	for (i=0; i<(int) (sizeof(dods)/sizeof(dods[0])); i++) {
+		dt += dods[i];
+		time += dt;
+		struct frame *f = &frames[nframes++];
+		f->time = time;
+		f->n = 4;
+		for (j=0; j<f->n; j++) {
+			f->recs[j].addr = 0xa4c138000001ULL + j;
+			f->recs[j].t = vals[(i + j) % (sizeof(vals)/sizeof(vals[0]))];
+			f->recs[j].h = vals[(i * 3 + j) % (sizeof(vals)/sizeof(vals[0]))];
+		}
+		append(f);
+	}
+	/* Extremes of the time and a full dictionary */
+	for (i=0; i<3; i++) {
+		struct frame *f = &frames[nframes++];
+		f->time = i == 0 ? 0 : i == 1 ? UINT32_MAX : 1;
+		f->n = TSLOG_FRAME_RECS;
+		for (j=0; j<f->n; j++) {
+			/* 96 sensors, the third frame overflows the dictionary */
+			int k = i * TSLOG_FRAME_RECS + j;
+			f->recs[j].addr = k == 0 ? 0xffffffffffffULL : 0x800000000000ULL + k * 0x10101ULL;
+			f->recs[j].t = j - 16;
+			f->recs[j].h = j * 31;
+		}
+		append(f);
+	}
+	/* Random frames */
+	for (i=0; i<300; i++) {
+		struct frame *f = &frames[nframes];
+		frame_make(f, frames[nframes - 1].time + 25 + rnd() % 10, 40, 1 + rnd() % TSLOG_FRAME_RECS);
+		nframes++;
+		append(f);
+	}
+	CHECK(tl.dropped == 0, "%lu sectors dropped", (unsigned long) tl.dropped);
+
+	int first, n = replay_all(nframes, &first);
+	CHECK(first == 0 && n == nframes, "replayed %d of %d frames from %d", n, nframes, first);
+
+	/* Acknowledged frames stay so over a reset */
+	reboot();
+	n = replay_all(nframes, &first);
+	CHECK(n == 0, "%d frames replayed again after a reset", n);
+}
+
+/* A full ring overwrites the oldest sector, replay resumes after it */
+static void test_wrap() {
+	fresh(3);
+	int nframes = 0, i;
+	uint32_t time = 1700000000;
+	while (tl.dropped < 4) {
+		CHECK(nframes < (int) (sizeof(frames)/sizeof(frames[0])), "log does not wrap");
+		if (nframes == sizeof(frames)/sizeof(frames[0])) return;
+		frame_make(&frames[nframes], time += 30, 20, 20);
+		append(&frames[nframes++]);
+	}
+
+	/* What survived is the newest frames, in order, up to the last one */
+	reboot();
+	int first, n = replay_all(nframes, &first);
+	CHECK(first > 0 && first + n == nframes, "replayed %d frames from %d of %d", n, first, nframes);
+
+	/* Replay falling behind: the sector it is in is overwritten meanwhile */
+	int base = nframes;
+	for (i=0; i<60; i++) {
+		frame_make(&frames[nframes], time += 30, 20, 20);
+		append(&frames[nframes++]);
+	}
+	struct tslog_rec recs[TSLOG_FRAME_RECS];
+	struct tslog_pos pos;
+	uint32_t t;
+	for (i=0; i<3; i++) {
+		int k = tslog_read(&tl, &pos, &t, recs);
+		CHECK(k > 0 && frame_eq(&frames[base + i], t, recs, k), "frame %d not first", base + i);
+		tslog_ack(&tl, &pos);
+	}
+	uint32_t dropped = tl.dropped;
+	while (tl.dropped < dropped + 2) {
+		frame_make(&frames[nframes], time += 30, 20, 20);
+		append(&frames[nframes++]);
+	}
+	n = replay_all(nframes, &first);
+	CHECK(first > base + 3 && first + n == nframes,
+			"replay after overwrite: %d frames from %d of %d", n, first, nframes);
+}
+
+/*
+ * The power is cut after every possible number of bytes of an append,
+ * mid-sector and when the append moves to a new sector. After the reset
+ * the earlier frames must all be there, the cut one complete or not at
+ * all, and the log must take new frames.
+ */
+static void test_torn() {
+	int at_end;
+	for (at_end=0; at_end<2; at_end++) {
+		int64_t budget;
+		for (budget=0; ; budget++) {
+			fresh(3);
+			int nframes = 0;
+			uint32_t time = 1700000000;
+			/* Some acknowledged, some pending */
+			int i;
+			for (i=0; i<5; i++) {
+				frame_make(&frames[nframes], time += 30, 8, 8);
+				append(&frames[nframes++]);
+			}
+			ack(2);
+			if (at_end) {
+				/* Until a frame of new sensors no longer fits, at most 100 bytes */
+				uint32_t sect = tl.wr.sect;
+				while (tl.wr.off + 100 < TSLOG_SECTOR) {
+					frame_make(&frames[nframes], time += 30, 8, 8);
+					append(&frames[nframes++]);
+				}
+				CHECK(tl.wr.sect == sect, "sector full early");
+				frame_make(&frames[nframes], time += 30, 100000, TSLOG_FRAME_RECS);
+			} else {
+				frame_make(&frames[nframes], time += 30, 8, 8);
+			}
+
+			sim_partition_cut(part, budget);
+			int err = tslog_append(&tl, frames[nframes].time, frames[nframes].recs, frames[nframes].n);
+			sim_partition_cut(part, -1);
+			reboot();
+
+			int first, n = replay_all(nframes + 1, &first);
+			CHECK(first == 2 && (n == nframes - 2 || (!err && n == nframes - 1)),
+					"cut after %lld bytes%s: replayed %d frames from %d, %d appended",
+					(long long) budget, at_end ? " at sector end" : "", n, first, nframes);
+			if (!err) nframes++;
+
+			frame_make(&frames[nframes], time += 30, 8, 8);
+			append(&frames[nframes]);
+			reboot();
+			n = replay_all(nframes + 1, &first);
+			CHECK(n == 1 && first == nframes, "no new frame after a cut after %lld bytes",
+					(long long) budget);
+			if (!err) break;
+		}
+		CHECK(budget > (at_end ? 100 : 8), "append done with %lld bytes", (long long) budget);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+#define SPOOL_SENSORS		6
+
+static int sink;
+
+static int sink_open() {
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+	struct sockaddr_in a = {
+		.sin_family = AF_INET,
+		.sin_port = htons(SINK_PORT),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int sz = 4 << 20;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+	if (bind(sock, (struct sockaddr *) &a, sizeof(a)) < 0) {
+		printf("cannot bind UDP port %d\n", SINK_PORT);
+		exit(1);
+	}
+	struct timeval tv = { 1, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return sock;
+}
+
+/*
+ * Spooled while offline, replayed in order once online: sensors in the
+ * order added, cycles oldest first, from the first one left after the
+ * ring wrapped, under the current names and without removed sensors.
+ */
+static void test_spool() {
+	part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "tslog");
+	sink = sink_open();
+
+	conf_init();
+	struct conf *c = conf_edit();
+	snprintf(c->influx.host, sizeof(c->influx.host), "127.0.0.1");
+	snprintf(c->influx.db, sizeof(c->influx.db), "t");
+	int i, j;
+	for (i=0; i<SPOOL_SENSORS; i++) {
+		c->clients[i].addr = 0xa4c138000000ULL + i;
+		snprintf(c->clients[i].name, sizeof(c->clients[i].name), "s%d", i);
+	}
+	conf_commit(c);
+
+	spool_init();
+	time_t start = time(NULL);
+	int cycles = 0;
+	while (spool_get_dropped() < 2 && cycles < 100000) {
+		for (j=0; j<SPOOL_SENSORS; j++) {
+			/* Humidity counts the cycles, temperature jumps to take space */
+			float t = ((cycles * 7919 + j * 104729) % 1200 - 400) / 10.0f;
+			spool_add(0xa4c138000000ULL + j, t, cycles % 1000 / 10.0f);
+		}
+		spool_flush();
+		cycles++;
+	}
+	CHECK(spool_get_dropped() >= 2, "spool did not wrap");
+
+	/* Renamed and removed meanwhile */
+	c = conf_edit();
+	snprintf(c->clients[1].name, sizeof(c->clients[1].name), "renamed");
+	memset(&c->clients[4], 0, sizeof(c->clients[4]));
+	conf_commit(c);
+	test_online = 1;
+
+	char line[256];
+	int n, got = 0, first = -1, prev = -1, sensor = 0, order = 1;
+	unsigned long long ts_prev = 0;
+	while ((n = recv(sink, line, sizeof(line) - 1, 0)) > 0) {
+		line[n] = '\0';
+		char name[32];
+		float h;
+		unsigned long long ts;
+		const char *p = strstr(line, ",name=");
+		const char *q = strstr(line, "humidity=");
+		const char *s = strrchr(line, ' ');
+		if (!p || !q || !s || sscanf(p, ",name=%31[^ ,]", name) != 1 ||
+				sscanf(q, "humidity=%f", &h) != 1 || sscanf(s, " %llu", &ts) != 1) {
+			CHECK(0, "unexpected line %s", line);
+			continue;
+		}
+		int cycle = lroundf(h * 10);
+		if (got == 0) first = cycle;
+		if (cycle != prev) {
+			if (prev >= 0 && cycle != (prev + 1) % 1000) order = 0;
+			sensor = 0;
+		}
+		static const char *names[] = { "s0", "renamed", "s2", "s3", "s5" };
+		if (sensor >= 5 || strcmp(name, names[sensor]) != 0) order = 0;
+		if (ts < ts_prev || ts / 1000000000 < (unsigned long long) start ||
+				ts / 1000000000 > (unsigned long long) time(NULL)) order = 0;
+		ts_prev = ts;
+		sensor++;
+		prev = cycle;
+		got++;
+	}
+	CHECK(order, "replay out of order or under stale names");
+	CHECK(prev == (cycles - 1) % 1000, "last cycle replayed %d, spooled %d", prev, cycles - 1);
+	CHECK(first > 0 && got % 5 == 0 && got < cycles * 5,
+			"replayed %d lines from cycle %d of %d", got, first, cycles);
+	close(sink);
+}
+
+int main() {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/tslog_test.%d", (int) getpid());
+	unlink(path);
+	part = sim_partition_add("test", path, TEST_SECTORS * TSLOG_SECTOR);
+	unlink(path);
+	snprintf(path, sizeof(path), "/tmp/tslog_spool.%d", (int) getpid());
+	unlink(path);
+	const esp_partition_t *sp = sim_partition_add("tslog", path, SPOOL_SECTORS * TSLOG_SECTOR);
+	unlink(path);
+	if (part == NULL || sp == NULL) {
+		printf("cannot create the partition files\n");
+		return 1;
+	}
+
+	test_codec();
+	test_wrap();
+	test_torn();
+	test_spool();
+	printf("tslog_test: %s\n", failures ? "FAILED" : "ok");
+	return failures != 0;
+}
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 Anti Sullin
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Receiver for advertisements forwarded by hygproxy.
+
+Decodes the batches sent by proxies with forwarding enabled (see main/fwd.c)
+and prints the readings as Influx line protocol, so it can be piped into
+anything that takes it. New sensor formats only need a decoder here.
+
+    fwd_recv.py --db hyg
+    fwd_recv.py --raw
+"""
+
+import argparse
+import socket
+import struct
+import sys
+import time
+
+PORT = 8091
+VERSION = 1
+TIME_UNIX = 0x01
+
+
+def decode_batch(data):
+    """Returns (proxy mac, [(mac, rssi, unix time or None, service data)])"""
+    if len(data) < 20 or data[:2] != b"HF" or data[2] != VERSION:
+        raise ValueError("not a forwarded batch")
+    flags = data[3]
+    proxy = data[4:10].hex()
+    base_ms, n = struct.unpack_from("<QH", data, 10)
+    recs = []
+    off = 20
+    for _ in range(n):
+        ln = data[off]
+        if ln < 9 or off + 1 + ln > len(data):
+            raise ValueError("truncated record")
+        mac = data[off + 1:off + 7].hex()
+        rssi, dt = struct.unpack_from("<bH", data, off + 7)
+        t = (base_ms + dt) / 1000.0 if flags & TIME_UNIX else None
+        recs.append((mac, rssi, t, data[off + 10:off + 1 + ln]))
+        off += 1 + ln
+    return proxy, recs
+
+
+def decode_mibeacon(sd):
+    """Xiaomi MiBeacon (UUID fe95), the objects main/bt.c decodes"""
+    if len(sd) < 6:
+        return {}
+    ofs = 14 if sd[2] & 0x20 else 13
+    if len(sd) < ofs + 3 or sd[ofs + 1] != 0x10 or len(sd) - ofs - 3 != sd[ofs + 2]:
+        return {}
+    typ, obj = sd[ofs], sd[ofs + 3:]
+    if typ == 0x04 and len(obj) == 2:
+        return {"temperature": struct.unpack("<h", obj)[0] / 10}
+    if typ == 0x06 and len(obj) == 2:
+        return {"humidity": struct.unpack("<H", obj)[0] / 10}
+    if typ == 0x0D and len(obj) == 4:
+        t, h = struct.unpack("<hH", obj)
+        return {"temperature": t / 10, "humidity": h / 10}
+    return {}
+
+
+def decode_env(sd):
+    """Environmental sensing (UUID 181a) in the ATC1441 and pvvx custom formats"""
+    if len(sd) == 15:       # ATC1441: big endian, 0.1 degC, whole percent
+        t, h = struct.unpack_from(">hB", sd, 8)
+        return {"temperature": t / 10, "humidity": float(h)}
+    if len(sd) == 17:       # pvvx: little endian, 0.01 units
+        t, h = struct.unpack_from("<hH", sd, 8)
+        return {"temperature": t / 100, "humidity": h / 100}
+    return {}
+
+
+DECODERS = {0xFE95: decode_mibeacon, 0x181A: decode_env}
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__,
+                                 formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--port", type=int, default=PORT)
+    ap.add_argument("--db", default="hyg", help="measurement name")
+    ap.add_argument("--raw", action="store_true", help="print the records, do not decode")
+    args = ap.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", args.port))
+    while True:
+        data, src = sock.recvfrom(2048)
+        try:
+            proxy, recs = decode_batch(data)
+        except (ValueError, IndexError, struct.error) as e:
+            print("%s: %s" % (src[0], e), file=sys.stderr)
+            continue
+        for mac, rssi, t, sd in recs:
+            if args.raw:
+                print("%s %s %d %s %s" % (proxy, mac, rssi, "-" if t is None else "%.3f" % t, sd.hex()))
+                continue
+            dec = DECODERS.get(struct.unpack_from("<H", sd)[0])
+            fields = dec(sd) if dec else {}
+            if not fields:
+                continue
+            fields["rssi"] = float(rssi)
+            ts = int((t if t is not None else time.time()) * 1e9)
+            print("%s,type=bt,id=%s,proxy=%s %s %d" % (
+                args.db, mac, proxy,
+                ",".join("%s=%.2f" % kv for kv in sorted(fields.items())), ts), flush=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 Anti Sullin
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Proxy gossip peer: monitors the election and takes part in it.
+
+Follows the rules of main/gossip.c. Without --sensor it only prints what the
+proxies announce. With --sensor it announces made-up receptions, so several
+instances on one host exercise the election:
+
+    gossip_peer.py --iface 127.0.0.1 --id 1 --sensor a4c138000001:-60
+    gossip_peer.py --iface 127.0.0.1 --id 2 --sensor a4c138000001:-70:50
+
+Stop the instance that reports and the other one takes over.
+"""
+
+import argparse
+import socket
+import struct
+import time
+
+GROUP = "239.255.72.71"
+PORT = 8090
+VERSION = 1
+PERIOD = 5.0
+TIMEOUT = 3 * PERIOD + 1.0
+LOSS_DB = 20
+HYST_DB = 3
+CLAIM = 0x01
+
+
+def score(rssi, rx_pm, claim):
+    if rx_pm < 0:
+        rx_pm = 1000
+    return rssi - LOSS_DB * (1000 - rx_pm) // 1000 + (HYST_DB if claim else 0)
+
+
+def better(s, pid, other, other_id):
+    return s > other if s != other else pid < other_id
+
+
+def decode(data):
+    if len(data) < 10 or data[:2] != b"HG" or data[2] != VERSION:
+        return None
+    n = data[3]
+    if len(data) != 10 + 9 * n:
+        return None
+    entries = {}
+    for i in range(n):
+        addr, rssi, rx, flags = struct.unpack_from(">6sbBB", data, 10 + 9 * i)
+        entries[addr.hex()] = (rssi, -1 if rx == 0xFF else rx * 10, flags & CLAIM)
+    return data[4:10], entries
+
+
+def encode(pid, entries):
+    out = b"HG" + bytes([VERSION, len(entries)]) + pid
+    for addr, (rssi, rx, claim) in entries.items():
+        out += struct.pack(">6sbBB", bytes.fromhex(addr), rssi,
+                           0xFF if rx < 0 else rx // 10, CLAIM if claim else 0)
+    return out
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__,
+                                 formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--iface", default="0.0.0.0", help="local address to join the group on")
+    ap.add_argument("--id", type=int, default=0, help="proxy id to announce as")
+    ap.add_argument("--sensor", action="append", default=[],
+                    help="MAC:RSSI[:RX_PERCENT] reception to announce")
+    args = ap.parse_args()
+
+    pid = args.id.to_bytes(6, "big")
+    mine = {}
+    for s in args.sensor:
+        f = s.split(":")
+        mine[f[0].lower()] = (int(f[1]), int(f[2]) * 10 if len(f) > 2 else -1)
+    claims = set()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", PORT))
+    iface = socket.inet_aton(args.iface)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP,
+                    socket.inet_aton(GROUP) + iface)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, iface)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+    sock.settimeout(0.5)
+
+    best = {}       # sensor -> (score, proxy id, time)
+    last = 0.0
+    while True:
+        now = time.monotonic()
+        if now - last >= PERIOD:
+            last = now
+            # Election as done by the poller before each report
+            for addr, (rssi, rx) in mine.items():
+                b = best.get(addr)
+                if b is None or now - b[2] >= TIMEOUT:
+                    own = True
+                else:
+                    own = better(score(rssi, rx, addr in claims), pid, b[0], b[1])
+                if own and addr not in claims:
+                    print("%s: reporting" % addr)
+                    claims.add(addr)
+                elif not own and addr in claims:
+                    print("%s: yielding to %s" % (addr, b[1].hex()))
+                    claims.discard(addr)
+            if mine:
+                sock.sendto(encode(pid, {a: (r, x, a in claims) for a, (r, x) in mine.items()}),
+                            (GROUP, PORT))
+
+        try:
+            data, src = sock.recvfrom(2048)
+        except socket.timeout:
+            continue
+        msg = decode(data)
+        if msg is None or msg[0] == pid:
+            continue
+        proxy, entries = msg
+        print("%s from %s:" % (proxy.hex(), src[0]))
+        for addr, (rssi, rx, claim) in entries.items():
+            print("  %s rssi %d rx %s%s" % (addr, rssi, "?" if rx < 0 else "%d%%" % (rx // 10),
+                                            " reporting" if claim else ""))
+            s = score(rssi, rx, claim)
+            b = best.get(addr)
+            if b is None or now - b[2] >= TIMEOUT or b[1] == proxy or better(s, proxy, b[0], b[1]):
+                best[addr] = (s, proxy, now)
+        for addr, b in list(best.items()):
+            if b[1] == proxy and addr not in entries:
+                del best[addr]
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 Anti Sullin
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Reporter election of main/gossip.c between two simulated proxies.
+
+Runs two sim/hygsim instances with gossip on, both hearing the same sensors
+over the multicast group on loopback, and checks who reports them:
+
+    make -C sim hygsim && tools/gossip_sim.py
+
+Proxy 1 hears the sensors at a fixed strength. Proxy 2 starts 6 dB weaker,
+then turns 2 dB stronger, which is within the bonus of the current reporter,
+then 6 dB stronger, and is killed at the end. The phases:
+
+    election    proxy 2 is weaker and leaves the sensors to proxy 1
+    hysteresis  proxy 1 keeps them although proxy 2 is 2 dB stronger
+    yield       proxy 1 gives them up to the now 6 dB stronger proxy 2
+    takeover    proxy 1 stays silent while proxy 2's last summary is
+                fresh, then reports every sensor every interval again
+
+Each phase is checked a few seconds after it starts, for the RSSI average
+and the summaries to settle. The simulator's advertisement rate window is
+10 s, so sensors are announced from then on. Exit status 1 on failure.
+"""
+
+import argparse
+import os
+import signal
+import subprocess
+import sys
+import threading
+import time
+
+PHASE_S = 30        # election, hysteresis and yield
+TIMEOUT_S = 16      # GOSSIP_TIMEOUT_MS
+SETTLE_S = 10
+
+
+def run(args, sim_id, atten, duration):
+    cmd = [args.hygsim, "-g", "-p", "-m", str(sim_id), "-n", str(args.sensors),
+           "-r", str(args.rate), "-i", str(args.interval), "-d", str(duration),
+           "-a", atten]
+    return subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                            text=True)
+
+
+def collect(proc, points):
+    for line in proc.stdout:
+        f = line.split()
+        if len(f) == 3 and f[0] == "point":
+            points.append((float(f[1]), int(f[2])))
+
+
+def reported(points, t0, t1):
+    """Points per sensor received in [t0, t1)"""
+    n = {}
+    for t, i in points:
+        if t0 <= t < t1:
+            n[i] = n.get(i, 0) + 1
+    return n
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    p = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    p.add_argument("--hygsim", default=os.path.join(here, "..", "sim", "hygsim"))
+    p.add_argument("--sensors", type=int, default=4)
+    p.add_argument("--rate", type=float, default=4, help="adverts/s per sensor")
+    p.add_argument("--interval", type=int, default=2, help="report interval s")
+    args = p.parse_args()
+
+    kill_at = 3 * PHASE_S
+    end = kill_at + TIMEOUT_S + 2 * SETTLE_S
+    a_pts, b_pts = [], []
+    a = run(args, 1, "0", end)
+    b = run(args, 2, "6,-2@%d,-6@%d" % (PHASE_S, 2 * PHASE_S), end)
+    threads = [threading.Thread(target=collect, args=x) for x in ((a, a_pts), (b, b_pts))]
+    for t in threads:
+        t.start()
+
+    time.sleep(kill_at)
+    b.send_signal(signal.SIGKILL)
+    a.wait()
+    b.wait()
+    for t in threads:
+        t.join()
+
+    sensors = set(range(args.sensors))
+    failed = 0
+
+    def check(name, t0, t1, who, pts, silent):
+        nonlocal failed
+        every = (t1 - t0) // args.interval - 1
+        n = reported(pts, t0, t1)
+        quiet = reported(silent, t0, t1)
+        ok = not quiet and set(n) == sensors and min(n.values()) >= every
+        print("%-11s [%3d,%3d) proxy %d reports %s, the other %s: %s" % (
+            name, t0, t1, who, sorted(n.items()), sorted(quiet.items()),
+            "ok" if ok else "FAIL"))
+        failed += not ok
+
+    check("election", SETTLE_S + 5, PHASE_S, 1, a_pts, b_pts)
+    check("hysteresis", PHASE_S + SETTLE_S, 2 * PHASE_S, 1, a_pts, b_pts)
+    check("yield", 2 * PHASE_S + SETTLE_S, kill_at, 2, b_pts, a_pts)
+
+    # Proxy 2 sent its last summary at most a gossip period before the kill
+    early = reported(a_pts, kill_at + 1, kill_at + TIMEOUT_S - 5)
+    print("%-11s [%3d,%3d) proxy 1 waits, reports %s: %s" % (
+        "timeout", kill_at + 1, kill_at + TIMEOUT_S - 5, sorted(early.items()),
+        "FAIL" if early else "ok"))
+    failed += bool(early)
+    check("takeover", kill_at + TIMEOUT_S + SETTLE_S, end - 2, 1, a_pts, [])
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
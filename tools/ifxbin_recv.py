@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 Anti Sullin
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Expands hygproxy binary reports to Influx line protocol.
+
+Listens for the frames of proxies with binary reports enabled (see
+main/ifxbin.c) and turns them back into the points the proxy would have sent
+as line protocol. The points are batched and written to Influx over UDP or
+HTTP, or printed:
+
+    ifxbin_recv.py                                   # print
+    ifxbin_recv.py --udp 127.0.0.1:8089              # Influx UDP listener
+    ifxbin_recv.py --http http://127.0.0.1:8086 --database sensors
+                                                     # Influx 1.x /write
+
+The first token of each line is the proxy's measurement name (ifx_db in its
+configuration), not a database; the HTTP API writes to --database.
+"""
+
+import argparse
+import socket
+import struct
+import sys
+import time
+import urllib.parse
+import urllib.request
+
+PORT = 8094
+VERSION = 1
+ANNOUNCE = 1
+DATA = 2
+F_T, F_H, F_RSSI = 0x01, 0x02, 0x04
+UDP_MAX = 1400
+
+
+def escape(s):
+    return "".join("\\" + c if c in ", =" else c for c in s if c.isprintable())
+
+
+class Tables:
+    """Sensor tables announced by the proxies, by proxy and table id
+
+    Only the latest table of each proxy is kept; announcing a new one
+    retires the one it replaces.
+    """
+
+    def __init__(self):
+        self.tables = {}
+        self.current = {}           # proxy MAC: table id
+        self.dropped = 0
+
+    def announce(self, key, b):
+        off = 0
+        db = b[off + 1:off + 1 + b[off]].decode(errors="replace")
+        off += 1 + b[off]
+        pfx = b[off + 1:off + 1 + b[off]].decode(errors="replace")
+        off += 1 + b[off]
+        n = b[off]
+        off += 1
+        proxy, table = key
+        old = self.current.get(proxy)
+        if old is not None and old != table:
+            self.tables.pop((proxy, old), None)
+        self.current[proxy] = table
+        t = self.tables.setdefault(key, {"db": db, "pfx": pfx, "sensors": {}})
+        for _ in range(n):
+            idx, mac, ln = b[off], b[off + 1:off + 7].hex(), b[off + 7]
+            t["sensors"][idx] = (mac, b[off + 8:off + 8 + ln].decode(errors="replace"))
+            off += 8 + ln
+
+    def expand(self, key, b, now):
+        t = self.tables.get(key)
+        ts, n = struct.unpack_from("<IB", b)
+        if t is None:
+            self.dropped += n
+            return []
+        tags_pfx = "," + t["pfx"] if t["pfx"] else ""
+        ns = (ts if ts else int(now)) * 1000000000
+        lines = []
+        for i in range(n):
+            idx, flags, tv, hv, rssi, rate = struct.unpack_from("<BBhHbB", b, 5 + 8 * i)
+            s = t["sensors"].get(idx)
+            if s is None:
+                self.dropped += 1
+                continue
+            fields = []
+            if flags & F_T:
+                fields.append("temperature=%.1f" % (tv / 10))
+            if flags & F_H:
+                fields.append("humidity=%.1f" % (hv / 10))
+            if flags & F_RSSI:
+                fields.append("rssi=%.1f,adv_rate=%di" % (rssi, rate))
+            if not fields:
+                continue
+            lines.append("%s,type=bt,id=%s,name=%s%s %s %d" % (
+                t["db"], s[0], escape(s[1]), tags_pfx, ",".join(fields), ns))
+        return lines
+
+
+class Writer:
+    def __init__(self, args):
+        self.args = args
+        self.lines = []
+        self.sock = None
+        if args.udp:
+            host, _, port = args.udp.partition(":")
+            self.dest = (host, int(port or 8089))
+            self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+
+    def add(self, lines):
+        self.lines += lines
+
+    def flush(self):
+        if not self.lines:
+            return
+        if self.sock:
+            buf = ""
+            for ln in self.lines:
+                if buf and len(buf) + len(ln) + 1 > UDP_MAX:
+                    self.sock.sendto(buf.encode(), self.dest)
+                    buf = ""
+                buf += ln + "\n"
+            self.sock.sendto(buf.encode(), self.dest)
+        elif self.args.http:
+            url = "%s/write?%s" % (self.args.http.rstrip("/"),
+                                   urllib.parse.urlencode({"db": self.args.database}))
+            req = urllib.request.Request(url, data="\n".join(self.lines).encode())
+            try:
+                urllib.request.urlopen(req, timeout=5).close()
+            except OSError as e:
+                print("write failed: %s" % e, file=sys.stderr)
+        else:
+            print("\n".join(self.lines), flush=True)
+        self.lines = []
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__,
+                                 formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--port", type=int, default=PORT)
+    ap.add_argument("--udp", help="Influx UDP listener, host[:port]")
+    ap.add_argument("--http", help="Influx HTTP base URL")
+    ap.add_argument("--database", help="Influx database of the HTTP writes")
+    ap.add_argument("--flush", type=float, default=5.0, help="seconds between writes")
+    args = ap.parse_args()
+    if args.http and not args.database:
+        ap.error("--http needs --database")
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", args.port))
+    sock.settimeout(args.flush)
+    tables = Tables()
+    out = Writer(args)
+    last = time.monotonic()
+    while True:
+        try:
+            data, src = sock.recvfrom(2048)
+        except socket.timeout:
+            data = None
+        if data and len(data) >= 14 and data[:2] == b"HB" and data[2] == VERSION:
+            key = (data[4:10], data[10:14])
+            try:
+                if data[3] == ANNOUNCE:
+                    tables.announce(key, data[14:])
+                elif data[3] == DATA:
+                    out.add(tables.expand(key, data[14:], time.time()))
+            except (IndexError, struct.error):
+                print("%s: malformed frame" % src[0], file=sys.stderr)
+        if time.monotonic() - last >= args.flush:
+            last = time.monotonic()
+            out.flush()
+
+
+if __name__ == "__main__":
+    main()
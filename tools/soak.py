@@ -0,0 +1,256 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 Anti Sullin
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Soak run of the hygproxy firmware in Espressif's QEMU.
+
+Boots the soak image (CONFIG_HYG_SOAK, see main/soak.c) in QEMU with the
+emulated Ethernet MAC on user networking, receives its Influx datagrams on a
+local UDP port, polls the web UI and API through a forwarded port, and
+prints a summary every --report-s seconds and at the end:
+
+    idf.py -B build_soak -D SDKCONFIG=build_soak/sdkconfig \\
+        -D SDKCONFIG_DEFAULTS="sdkconfig;sdkconfig.soak" build
+    tools/soak.py --build build_soak --hours 8
+
+The heap trend comes from the proxy's own telemetry: free heap, low-water
+mark and largest free block, with a least squares slope after --warmup-s.
+The run fails (exit status 1) on a leak over --max-leak bytes per hour, on
+missed report intervals, on crashes and on failed HTTP requests.
+"""
+
+import argparse
+import os
+import re
+import socket
+import subprocess
+import sys
+import threading
+import time
+import urllib.request
+
+HTTP_PATHS = ["/", "/conf.html", "/api/conf.json", "/api/readings.json", "/api/scan.json"]
+CRASH = re.compile(r"Guru Meditation|abort\(\) was called|Backtrace:|rst:0x")
+
+
+class State:
+    def __init__(self, interval):
+        self.lock = threading.Lock()
+        self.interval = interval
+        self.points = 0
+        self.sweeps = []            # points per sweep
+        self.sweep_at = None        # arrival of the last point
+        self.gaps = 0               # sweeps the sink never saw
+        self.heap = []              # (t, free, min, largest)
+        self.missed = 0
+        self.http_ok = 0
+        self.http_err = 0
+        self.http_ms = []
+        self.crashes = 0
+        self.started = time.monotonic()
+
+    def point(self, now):
+        if self.sweep_at is None or now - self.sweep_at > self.interval / 2:
+            if self.sweep_at is not None:
+                self.gaps += max(0, round((now - self.sweep_at) / self.interval) - 1)
+            self.sweeps.append(0)
+        self.sweeps[-1] += 1
+        self.sweep_at = now
+        self.points += 1
+
+
+def fields(line):
+    """Field set of a line protocol point, integers without their i"""
+    parts = line.split(" ")
+    if len(parts) < 2:
+        return {}
+    res = {}
+    for kv in parts[1].split(","):
+        k, _, v = kv.partition("=")
+        try:
+            res[k] = float(v.rstrip("i"))
+        except ValueError:
+            pass
+    return res
+
+
+def sink(state, port):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(("0.0.0.0", port))
+    while True:
+        data, _ = s.recvfrom(2048)
+        now = time.monotonic()
+        with state.lock:
+            for line in data.decode(errors="replace").splitlines():
+                if ",type=bt," in line:
+                    state.point(now)
+                elif ",type=proxy," in line:
+                    f = fields(line)
+                    if "heap_free" in f:
+                        state.heap.append((now - state.started, f["heap_free"],
+                                           f.get("heap_min", 0), f.get("heap_blk", 0)))
+                    state.missed = int(f.get("missed", state.missed))
+
+
+def poll_http(state, port, every):
+    i = 0
+    while True:
+        time.sleep(every)
+        path = HTTP_PATHS[i % len(HTTP_PATHS)]
+        i += 1
+        t0 = time.monotonic()
+        try:
+            with urllib.request.urlopen("http://127.0.0.1:%d%s" % (port, path), timeout=10) as r:
+                r.read()
+            with state.lock:
+                state.http_ok += 1
+                state.http_ms.append((time.monotonic() - t0) * 1000)
+        except OSError:
+            with state.lock:
+                state.http_err += 1
+
+
+def console(state, proc, log):
+    for raw in proc.stdout:
+        line = raw.decode(errors="replace")
+        log.write(line)
+        log.flush()
+        if CRASH.search(line):
+            with state.lock:
+                state.crashes += 1
+
+
+def slope(samples, col):
+    """Least squares slope per hour of column col over (t, ...) samples"""
+    if len(samples) < 3:
+        return float("nan")
+    n = len(samples)
+    mt = sum(s[0] for s in samples) / n
+    mv = sum(s[col] for s in samples) / n
+    var = sum((s[0] - mt) ** 2 for s in samples)
+    if var == 0:
+        return float("nan")
+    return sum((s[0] - mt) * (s[col] - mv) for s in samples) / var * 3600
+
+
+def frag(s):
+    return 100.0 * (1 - s[3] / s[1]) if s[1] else 0.0
+
+
+def summary(state, args, final):
+    with state.lock:
+        elapsed = time.monotonic() - state.started
+        sweeps = state.sweeps[:-1] if not final else state.sweeps
+        short = sum(1 for n in sweeps if n < args.sensors)
+        steady = [s for s in state.heap if s[0] >= args.warmup_s]
+        fr = [(s[0], frag(s)) for s in steady]
+        ms = sorted(state.http_ms)
+        leak = -slope(steady, 1)
+        res = {
+            "elapsed_h": elapsed / 3600,
+            "points": state.points,
+            "sweeps": len(state.sweeps),
+            "short_sweeps": short,
+            "sink_gaps": state.gaps,
+            "missed": state.missed,
+            "crashes": state.crashes,
+            "http_ok": state.http_ok,
+            "http_err": state.http_err,
+        }
+        print("--- %.2f h: %d points in %d sweeps, %d short, %d gaps seen, %d missed by proxy, "
+              "%d crashes" % (res["elapsed_h"], state.points, len(state.sweeps), short,
+                              state.gaps, state.missed, state.crashes))
+        if state.heap:
+            last = state.heap[-1]
+            print("    heap free %d, low-water %d, largest block %d, fragmentation %.1f %%"
+                  % (last[1], min(s[2] for s in state.heap), last[3], frag(last)))
+            print("    trend after warmup: free %+.0f B/h, fragmentation %+.2f %%/h (%d samples)"
+                  % (-leak, slope(fr, 1), len(steady)))
+        if ms:
+            print("    http %d ok, %d failed, p50 %.0f ms, p95 %.0f ms"
+                  % (state.http_ok, state.http_err, ms[len(ms) // 2], ms[int(len(ms) * 0.95)]))
+        sys.stdout.flush()
+
+    failed = (state.crashes or state.missed or state.gaps or state.http_err or
+              (leak == leak and leak > args.max_leak))
+    return failed
+
+
+def flash_image(build):
+    img = os.path.join(build, "flash_image.bin")
+    if not os.path.exists(img):
+        subprocess.check_call(["esptool.py", "--chip", "esp32", "merge_bin", "--fill-flash-size",
+                               "4MB", "-o", "flash_image.bin", "@flash_args"], cwd=build)
+    return img
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--build", default="build_soak", help="idf.py build directory")
+    ap.add_argument("--qemu", default="qemu-system-xtensa")
+    ap.add_argument("--no-qemu", action="store_true", help="only receive, QEMU runs elsewhere")
+    ap.add_argument("--hours", type=float, default=4)
+    ap.add_argument("--sensors", type=int, default=32, help="CONFIG_HYG_SOAK_SENSORS")
+    ap.add_argument("--interval", type=int, default=30, help="CONFIG_HYG_SOAK_INTERVAL_S")
+    ap.add_argument("--port", type=int, default=8089, help="Influx UDP port to listen on")
+    ap.add_argument("--http-port", type=int, default=8080, help="host port forwarded to 80")
+    ap.add_argument("--http-every", type=float, default=5, help="seconds between requests")
+    ap.add_argument("--report-s", type=int, default=600)
+    ap.add_argument("--warmup-s", type=int, default=600, help="ignored by the heap trend")
+    ap.add_argument("--max-leak", type=float, default=2048, help="bytes per hour")
+    ap.add_argument("--log", default="soak.log", help="QEMU console output")
+    args = ap.parse_args()
+
+    state = State(args.interval)
+    threading.Thread(target=sink, args=(state, args.port), daemon=True).start()
+
+    proc = None
+    if not args.no_qemu:
+        img = flash_image(args.build)
+        proc = subprocess.Popen(
+            [args.qemu, "-nographic", "-machine", "esp32",
+             "-drive", "file=%s,if=mtd,format=raw" % img,
+             "-nic", "user,model=open_eth,hostfwd=tcp:127.0.0.1:%d-:80" % args.http_port,
+             "-global", "driver=timer.esp32.timg,property=wdt_disable,value=true"],
+            stdin=subprocess.DEVNULL, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        log = open(args.log, "w")
+        threading.Thread(target=console, args=(state, proc, log), daemon=True).start()
+    threading.Thread(target=poll_http, args=(state, args.http_port, args.http_every),
+                     daemon=True).start()
+
+    end = time.monotonic() + args.hours * 3600
+    try:
+        while time.monotonic() < end:
+            time.sleep(min(args.report_s, max(0, end - time.monotonic())))
+            if proc is not None and proc.poll() is not None:
+                print("QEMU exited with status %d" % proc.returncode)
+                with state.lock:
+                    state.crashes += 1
+                break
+            summary(state, args, False)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if proc is not None and proc.poll() is None:
+            proc.terminate()
+            proc.wait()
+
+    print("=== final")
+    sys.exit(1 if summary(state, args, True) else 0)
+
+
+if __name__ == "__main__":
+    main()